@@ -0,0 +1,40 @@
+#include <stdatomic.h>
+#include "admission.h"
+
+static atomic_int limit = ADMISSION_LIMIT;
+static atomic_int active = 0;
+static atomic_long rejected = 0;
+
+int admission_enter()
+{
+    int cap = atomic_load_explicit(&limit, memory_order_relaxed);
+    if (atomic_fetch_add(&active, 1) < cap || cap == 0)
+        return 1;
+    atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+    return 0;
+}
+
+void admission_leave()
+{
+    atomic_fetch_sub(&active, 1);
+}
+
+void admission_set(int cap)
+{
+    atomic_store(&limit, cap > 0 ? cap : 0);
+}
+
+int admission_limit()
+{
+    return atomic_load(&limit);
+}
+
+int admission_active()
+{
+    return atomic_load(&active);
+}
+
+long admission_rejected()
+{
+    return atomic_load(&rejected);
+}
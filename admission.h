@@ -0,0 +1,52 @@
+#if !defined(ADMISSION_H)
+#define ADMISSION_H
+
+/**
+ * admission.h
+ *
+ * Admission control: a cap on the connections the server holds at once,
+ * whatever engine accepted them. A connection is counted from accept to
+ * close; the ones that come in over the cap are still counted until
+ * they are answered 503, so a burst cannot grow the queues past the cap
+ * and the latency of the admitted connections stays bounded. The cap is
+ * one atomic, it can be changed while the server runs.
+ */
+
+// connections held at once until admission_set is called
+#define ADMISSION_LIMIT 4096
+
+/**
+ * admission_enter counts a new connection. returns 1 when it is within
+ * the cap (or there is none), 0 when it has to be turned away. either
+ * way admission_leave must be called once it is closed.
+ */
+int admission_enter();
+
+/**
+ * admission_leave uncounts a closed connection.
+ */
+void admission_leave();
+
+/**
+ * admission_set changes the cap, 0 for no cap. connections already held
+ * are kept, the new cap applies to the next ones.
+ */
+void admission_set(int limit);
+
+/**
+ * admission_limit returns the cap, 0 when there is none.
+ */
+int admission_limit();
+
+/**
+ * admission_active returns the connections held now, rejected ones
+ * still being answered included.
+ */
+int admission_active();
+
+/**
+ * admission_rejected returns the connections turned away so far.
+ */
+long admission_rejected();
+
+#endif
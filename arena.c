@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "stats.h"
+
+#define ERROR -1
+#define SUCCESS 0
+#define ALIGN 16
+#define HEADER ((sizeof(arena_block_t) + ALIGN - 1) & ~(size_t)(ALIGN - 1))
+#define DATA(block) ((char *)(block) + HEADER)
+
+static slab_t *blocks = NULL; /* Blocks of ARENA_BLOCK bytes */
+
+int arenas_init()
+{
+    if (blocks == NULL && (blocks = create_slab(ARENA_BLOCK)) == NULL)
+        return ERROR;
+    return SUCCESS;
+}
+
+void arenas_destroy()
+{
+    destroy_slab(blocks);
+    blocks = NULL;
+}
+
+void arena_init(arena_t *arena)
+{
+    arena->head = NULL;
+    arena->last = NULL;
+}
+
+/* A block with room for size bytes, from the slab unless it is too large */
+static arena_block_t *new_block(size_t size)
+{
+    arena_block_t *block;
+    if (size <= ARENA_BLOCK - HEADER && blocks != NULL)
+    {
+        if ((block = slab_alloc(blocks)) == NULL)
+            return NULL;
+        block->slab = blocks;
+        block->size = ARENA_BLOCK - HEADER;
+    }
+    else
+    {
+        if (size < ARENA_BLOCK - HEADER)
+            size = ARENA_BLOCK - HEADER;
+        if ((block = malloc(HEADER + size)) == NULL)
+            return NULL;
+        block->slab = NULL;
+        block->size = size;
+    }
+    block->used = 0;
+    return block;
+}
+
+static void free_block(arena_block_t *block)
+{
+    if (block->slab != NULL)
+        slab_free(block->slab, block);
+    else
+        free(block);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    arena_block_t *block = arena->head;
+    if (block == NULL || block->size - block->used < size)
+    {
+        if ((block = new_block(size)) == NULL)
+            return NULL;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    arena->last = DATA(block) + block->used;
+    block->used += size;
+    stats_alloc(ALLOC_ARENA);
+    return arena->last;
+}
+
+void *arena_grow(arena_t *arena, void *data, size_t old, size_t size)
+{
+    arena_block_t *block = arena->head;
+    if (data != NULL && data == arena->last && (char *)data + size <= DATA(block) + block->size)
+    {
+        block->used = (char *)data - DATA(block) + ((size + ALIGN - 1) & ~(size_t)(ALIGN - 1));
+        return data;
+    }
+    void *grown = arena_alloc(arena, size);
+    if (grown != NULL && data != NULL)
+        memcpy(grown, data, old < size ? old : size);
+    return grown;
+}
+
+void arena_reset(arena_t *arena)
+{
+    arena_block_t *block = arena->head;
+    while (block != NULL && block->next != NULL) /* Down to the first block */
+    {
+        arena->head = block->next;
+        free_block(block);
+        block = arena->head;
+    }
+    if (block != NULL && block->size > ARENA_BLOCK - HEADER) /* A large one is not worth keeping */
+    {
+        free_block(block);
+        arena->head = block = NULL;
+    }
+    if (block != NULL)
+        block->used = 0;
+    arena->last = NULL;
+}
+
+void arena_free(arena_t *arena)
+{
+    while (arena->head != NULL)
+    {
+        arena_block_t *block = arena->head;
+        arena->head = block->next;
+        free_block(block);
+    }
+    arena->last = NULL;
+}
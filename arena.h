@@ -0,0 +1,75 @@
+#if !defined(ARENA_H)
+#define ARENA_H
+#include <stddef.h>
+#include "slab.h"
+
+/**
+ * arena.h
+ *
+ * Bump allocator for the memory a request needs until it is answered.
+ * Every connection owns an arena: an allocation is a pointer increment
+ * in the current block and nothing is freed on its own, arena_reset
+ * after the response takes it all back at once and keeps the first
+ * block for the next request. Blocks come from a slab, so a connection
+ * that reuses its arena calls neither malloc nor free. An allocation
+ * larger than a block gets a block of its own from the heap.
+ */
+
+// bytes of a block, its header included
+#define ARENA_BLOCK 16384
+
+typedef struct arena_block_st
+{
+	struct arena_block_st *next; //the block filled before this one
+	slab_t *slab;				 //where the block goes back to, NULL for the heap
+	size_t size;				 //bytes after the header
+	size_t used;				 //bytes handed out
+} arena_block_t;
+
+typedef struct arena_st
+{
+	arena_block_t *head; //block the allocations come from, NULL before the first one
+	void *last;			 //latest allocation, the one arena_grow extends in place
+} arena_t;
+
+/**
+ * arenas_init creates the slab the blocks come from, before the first
+ * arena is used. without it the blocks come from the heap. returns 0 or
+ * -1 when out of memory.
+ */
+int arenas_init();
+
+/**
+ * arenas_destroy frees the slab, every arena must be freed already.
+ */
+void arenas_destroy();
+
+/**
+ * arena_init makes an empty arena, it allocates nothing.
+ */
+void arena_init(arena_t *arena);
+
+/**
+ * arena_alloc returns size bytes aligned to 16, valid until the next
+ * arena_reset. NULL when out of memory.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * arena_grow resizes the allocation data of old bytes to size bytes,
+ * in place when it is the latest one and the block has room, otherwise
+ * into a new allocation with the old bytes copied. data may be NULL.
+ */
+void *arena_grow(arena_t *arena, void *data, size_t old, size_t size);
+
+/**
+ * arena_reset takes every allocation back and keeps the first block.
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * arena_free gives every block back, the arena is empty again.
+ */
+void arena_free(arena_t *arena);
+
+#endif
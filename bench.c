@@ -0,0 +1,681 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "threadpool.h"
+#include "resolver.h"
+#include "http_parser.h"
+#include "mime.h"
+#include "writer.h"
+
+/* Micro benchmarks for the server building blocks.
+ * Usage: bench <pool|stress|resolve|parse|mime|mmap> [count] | bench connect <port> [count]
+ * Every result is printed as one "key=value" line per run so the output
+ * can be diffed or fed to a script. */
+
+typedef enum
+{
+    false,
+    true
+} bool;
+#define ERROR -1
+#define POOL_JOBS 200000
+#define JOB_SPIN 2000
+#define STRESS_JOBS 400000
+#define STRESS_PRODUCERS 8
+#define STRESS_QUEUE 16 /* A small ring keeps producers racing for neighbouring slots */
+#define STRESS_TIMEOUT 10 /* Seconds without progress before the pool is declared stuck */
+#define STRESS_ROUNDS 4 /* Bursts per producer, apart long enough for adaptive workers to retire */
+#define STRESS_PAUSE 50000 /* Microseconds between the bursts */
+#define STRESS_WAIT 20000L /* Nanoseconds of queue wait before an adaptive pool grows */
+#define STRESS_IDLE 5 /* Milliseconds an adaptive worker waits before it retires */
+#define RESOLVE_ROUNDS 100000
+#define TRACE_ROUNDS 100
+#define PARSE_ROUNDS 2000000
+#define PARSE_STEP 64
+#define MIME_ROUNDS 5000000
+#define MMAP_BYTES (128L * 1024 * 1024) /* Sent per file size and mode */
+#define CONNECTIONS 20000
+#define CONNECT_THREADS 8
+
+static atomic_long done;
+
+/* Current monotonic time in seconds */
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A short CPU bound job, roughly the cost of handling a tiny request, counted in the counter at arg */
+static int spin_job(void *arg)
+{
+    volatile unsigned long x = 0;
+    for (int i = 0; i < JOB_SPIN; i++)
+        x += i;
+    atomic_fetch_add((atomic_long *)arg, 1);
+    return 0;
+}
+
+/* Push jobs through a pool from one producer and time the drain */
+static double run_pool(pool_mode mode, int threads, long jobs)
+{
+    threadpool *pool = create_threadpool_mode(threads, DEFAULT_QUEUE_SIZE, mode);
+    if (pool == NULL)
+        return ERROR;
+    atomic_store(&done, 0);
+    double start = now_sec();
+    for (long i = 0; i < jobs; i++)
+    {
+        while (dispatch(pool, spin_job, &done) == ERROR) /* ring is full, let the workers catch up */
+            sched_yield();
+    }
+    destroy_threadpool(pool);
+    return now_sec() - start;
+}
+
+typedef struct stress_st
+{
+    threadpool *pool;
+    long jobs;           /* Per producer */
+    atomic_long running; /* Jobs running right now */
+    atomic_long peak;    /* Most jobs seen running at once */
+} stress_t;
+
+/* A short job that records how many jobs run next to it */
+static int stress_job(void *arg)
+{
+    stress_t *s = (stress_t *)arg;
+    long now = atomic_fetch_add(&s->running, 1) + 1;
+    long peak = atomic_load(&s->peak);
+    while (now > peak && atomic_compare_exchange_weak(&s->peak, &peak, now) == false)
+        ;
+    volatile unsigned long x = 0;
+    for (int i = 0; i < JOB_SPIN / 10; i++)
+        x += i;
+    atomic_fetch_sub(&s->running, 1);
+    atomic_fetch_add(&done, 1);
+    return 0;
+}
+
+/* One of the producers dispatching into the shared pool */
+static void *stress_producer(void *arg)
+{
+    stress_t *s = (stress_t *)arg;
+    for (int round = 0; round < STRESS_ROUNDS; round++)
+    {
+        if (round > 0)
+            usleep(STRESS_PAUSE);
+        for (long i = 0; i < s->jobs / STRESS_ROUNDS; i++)
+        {
+            while (dispatch(s->pool, stress_job, s) == ERROR) /* ring is full */
+                sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* Several producers against one pool: every job must run, no more than the workers at once,
+ * and the pool must drain and destroy. A pool that stops making progress is reported and
+ * left alive, destroying it would hang too */
+static int run_stress(const char *name, threadpool *pool, int max_threads, long jobs)
+{
+    pthread_t producers[STRESS_PRODUCERS];
+    stress_t s = {.pool = pool, .jobs = jobs / STRESS_PRODUCERS / STRESS_ROUNDS * STRESS_ROUNDS};
+    pool_stats_t st;
+    long total = s.jobs * STRESS_PRODUCERS;
+    if (pool == NULL)
+        return ERROR;
+    atomic_store(&done, 0);
+    double start = now_sec();
+    for (int i = 0; i < STRESS_PRODUCERS; i++)
+        pthread_create(&producers[i], NULL, stress_producer, &s);
+    for (int i = 0; i < STRESS_PRODUCERS; i++)
+        pthread_join(producers[i], NULL);
+    long last = -1;
+    double progress = now_sec();
+    while (atomic_load(&done) < total)
+    {
+        if (atomic_load(&done) != last)
+        {
+            last = atomic_load(&done);
+            progress = now_sec();
+        }
+        else if (now_sec() - progress > STRESS_TIMEOUT)
+        {
+            int tokens;
+            sem_getvalue(&pool->q_not_empty, &tokens);
+            printf("bench=stress pool=%s threads=%d dispatched=%ld done=%ld qsize=%d sem=%d stuck=1\n",
+                   name, max_threads, total, last, atomic_load(&pool->qsize), tokens);
+            return ERROR;
+        }
+        usleep(1000);
+    }
+    threadpool_stats(pool, &st);
+    destroy_threadpool(pool);
+    double elapsed = now_sec() - start;
+    long peak = atomic_load(&s.peak);
+    printf("bench=stress pool=%s threads=%d producers=%d jobs=%ld peak_running=%ld grown=%ld retired=%ld seconds=%.4f jobs_per_sec=%.0f\n",
+           name, max_threads, STRESS_PRODUCERS, total, peak, st.grown, st.retired, elapsed, total / elapsed);
+    return peak > max_threads ? ERROR : 0;
+}
+
+/* Multi producer stress of every pool mode at 1..32 threads, and of adaptive pools
+ * from 1 and from 0 to as many threads that grow in every burst and retire between them */
+static int bench_stress(long jobs)
+{
+    const char *names[] = {"global", "stealing"};
+    for (int threads = 1; threads <= 32; threads *= 2)
+    {
+        for (int mode = POOL_GLOBAL_QUEUE; mode <= POOL_WORK_STEALING; mode++)
+        {
+            if (run_stress(names[mode], create_threadpool_mode(threads, STRESS_QUEUE, mode), threads, jobs) == ERROR)
+                return ERROR;
+        }
+        if (run_stress("adaptive", create_threadpool_adaptive(1, threads, STRESS_QUEUE, STRESS_WAIT, STRESS_IDLE), threads, jobs) == ERROR)
+            return ERROR;
+        if (run_stress("adaptive0", create_threadpool_adaptive(0, threads, STRESS_QUEUE, STRESS_WAIT, STRESS_IDLE), threads, jobs) == ERROR) /* Every worker retires between the bursts */
+            return ERROR;
+    }
+    return 0;
+}
+
+/* Compare the global queue with work stealing at 1..64 threads */
+static int bench_pool(long jobs)
+{
+    const char *names[] = {"global", "stealing"};
+    for (int threads = 1; threads <= 64; threads *= 2)
+    {
+        for (int mode = POOL_GLOBAL_QUEUE; mode <= POOL_WORK_STEALING; mode++)
+        {
+            double elapsed = run_pool(mode, threads, jobs);
+            if (elapsed < 0)
+                return ERROR;
+            printf("bench=pool mode=%s threads=%d jobs=%ld seconds=%.4f jobs_per_sec=%.0f\n",
+                   names[mode], threads, jobs, elapsed, jobs / elapsed);
+        }
+    }
+    return 0;
+}
+
+/* The path checks the server did per request before the resolver:
+ * is_exist, is_directory, recursive_permission, get_index, is_file,
+ * file_permission, then open_s and get_size in the send path */
+static int legacy_resolve(const char *path)
+{
+    struct stat st;
+    char posix[RESOLVE_PATH_MAX], file[RESOLVE_PATH_MAX];
+    snprintf(file, sizeof(file), "%s", path + 1);
+    if (stat(file, &st) == ERROR) /* is_exist */
+        return ERROR;
+    stat(file, &st); /* is_directory */
+    if (S_ISDIR(st.st_mode))
+    {
+        for (size_t i = 0; file[i] != '\0'; i++) /* recursive_permission */
+        {
+            if (file[i] != '/')
+                continue;
+            memcpy(posix, file, i + 1);
+            posix[i + 1] = '\0';
+            stat(posix, &st);
+        }
+        DIR *directory = opendir(file); /* get_index */
+        struct dirent *entry;
+        while (directory != NULL && (entry = readdir(directory)) != NULL && strcmp(entry->d_name, INDEX_FILE) != 0)
+            ;
+        if (directory != NULL)
+            closedir(directory);
+        strcat(file, INDEX_FILE);
+    }
+    else
+    {
+        stat(file, &st); /* is_file */
+        int fd = open(file, O_RDONLY); /* file_permission */
+        close(fd);
+    }
+    int fd = open(file, O_RDONLY); /* open_s */
+    if (fd == ERROR)
+        return ERROR;
+    off_t pos = lseek(fd, 0, SEEK_CUR); /* get_size */
+    lseek(fd, 0, SEEK_END);
+    lseek(fd, pos, SEEK_SET);
+    close(fd);
+    return 0;
+}
+
+/* The single pass resolver the server uses now */
+static int resolver_resolve(int rootfd, const char *path)
+{
+    resolved_t res;
+    resolve_status status = resolve_path(rootfd, path, &res);
+    if (res.fd != ERROR)
+        close(res.fd);
+    return status == RESOLVE_FILE || status == RESOLVE_DIRECTORY ? 0 : ERROR;
+}
+
+/* Run rounds resolutions of path, legacy or resolver */
+static int resolve_rounds(int legacy, int rootfd, const char *path, long rounds)
+{
+    for (long i = 0; i < rounds; i++)
+    {
+        if ((legacy ? legacy_resolve(path) : resolver_resolve(rootfd, path)) == ERROR)
+            return ERROR;
+    }
+    return 0;
+}
+
+/* Count the system calls of rounds resolutions in a traced child */
+static long count_syscalls(int legacy, int rootfd, const char *path, long rounds)
+{
+    pid_t pid = fork();
+    if (pid == ERROR)
+        return ERROR;
+    if (pid == 0)
+    {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        _exit(resolve_rounds(legacy, rootfd, path, rounds) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    long stops = 0;
+    int status;
+    waitpid(pid, &status, 0); /* The SIGSTOP */
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD);
+    while (true)
+    {
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+        if (waitpid(pid, &status, 0) == ERROR || WIFEXITED(status) || WIFSIGNALED(status))
+            break;
+        if (WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80))
+            stops++;
+    }
+    return stops / 2; /* One stop on entry and one on exit */
+}
+
+/* Create a small document root to resolve against */
+static int make_docroot(char *dir)
+{
+    const char *files[] = {"index.html", "sub/index.html", "sub/inner/a.txt"};
+    if (mkdtemp(dir) == NULL || chdir(dir) == ERROR || mkdir("sub", 0755) == ERROR || mkdir("sub/inner", 0755) == ERROR)
+        return ERROR;
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = open(files[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == ERROR || write(fd, "bench\n", 6) != 6)
+            return ERROR;
+        close(fd);
+    }
+    return 0;
+}
+
+/* Syscalls and time per path resolution, before and after the resolver */
+static int bench_resolve(long rounds)
+{
+    const char *paths[] = {"/index.html", "/sub/inner/a.txt", "/sub/"};
+    const char *names[] = {"resolver", "legacy"};
+    char dir[] = "/tmp/bench-docroot-XXXXXX";
+    if (make_docroot(dir) == ERROR)
+    {
+        perror("docroot");
+        return ERROR;
+    }
+    int rootfd = open_root(".");
+    for (int p = 0; p < 3; p++)
+    {
+        for (int legacy = 1; legacy >= 0; legacy--)
+        {
+            long base = count_syscalls(legacy, rootfd, paths[p], 0);
+            long traced = count_syscalls(legacy, rootfd, paths[p], TRACE_ROUNDS);
+            double start = now_sec();
+            if (resolve_rounds(legacy, rootfd, paths[p], rounds) == ERROR)
+                return ERROR;
+            double elapsed = now_sec() - start;
+            printf("bench=resolve mode=%s path=%s syscalls_per_request=%.1f ns_per_request=%.0f\n",
+                   names[legacy], paths[p], (double)(traced - base) / TRACE_ROUNDS, elapsed * 1e9 / rounds);
+        }
+    }
+    close(rootfd);
+    unlink("sub/inner/a.txt");
+    unlink("sub/index.html");
+    unlink("index.html");
+    rmdir("sub/inner");
+    rmdir("sub");
+    rmdir(dir);
+    return 0;
+}
+
+/* A request as a desktop browser sends it */
+static const char browser_request[] =
+    "GET /static/css/site.css?v=3 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n";
+
+/* The request handling the server did before the incremental parser:
+ * find the end of the headers, then split a copy of the request line with strtok */
+static int legacy_parse(char *buf, size_t len)
+{
+    char copy[sizeof(browser_request)];
+    if (strstr(buf, "\r\n\r\n") == NULL)
+        return ERROR;
+    memcpy(copy, buf, len + 1);
+    char **parsed = malloc(4000 * sizeof(char *));
+    if (parsed == NULL)
+        return ERROR;
+    int position = 0;
+    char *end = strstr(copy, "\r\n");
+    end[0] = '\0';
+    for (char *temp = strtok(copy, " "); temp != NULL && temp < end; temp = strtok(NULL, " "))
+        parsed[position++] = temp;
+    int ok = position == 3 && strcasestr(end + 2, "Connection:") != NULL;
+    free(parsed);
+    return ok ? 0 : ERROR;
+}
+
+/* Parse the request rounds times, fed whole or PARSE_STEP bytes at a time */
+static int parse_rounds(int mode, long rounds)
+{
+    char buf[sizeof(browser_request)];
+    size_t len = sizeof(browser_request) - 1;
+    http_request_t req;
+    memcpy(buf, browser_request, sizeof(browser_request));
+    for (long i = 0; i < rounds; i++)
+    {
+        if (mode == 0)
+        {
+            if (legacy_parse(buf, len) == ERROR)
+                return ERROR;
+            continue;
+        }
+        http_parse_status status = HTTP_PARSE_AGAIN;
+        http_reset(&req);
+        for (size_t fed = mode == 1 ? len : PARSE_STEP; status == HTTP_PARSE_AGAIN; fed += PARSE_STEP)
+            status = http_parse(&req, buf, fed < len ? fed : len);
+        if (status != HTTP_PARSE_DONE || http_header(&req, "Connection") == NULL)
+            return ERROR;
+    }
+    return 0;
+}
+
+/* Requests per second on one core, strtok parser against the incremental one */
+static int bench_parse(long rounds)
+{
+    const char *names[] = {"legacy", "incremental", "incremental-split"};
+    for (int mode = 0; mode < 3; mode++)
+    {
+        double start = now_sec();
+        if (parse_rounds(mode, rounds) == ERROR)
+        {
+            printf("bench=parse mode=%s failed\n", names[mode]);
+            return ERROR;
+        }
+        double elapsed = now_sec() - start;
+        printf("bench=parse mode=%s bytes=%zu requests_per_sec=%.0f ns_per_request=%.0f\n",
+               names[mode], sizeof(browser_request) - 1, rounds / elapsed, elapsed * 1e9 / rounds);
+    }
+    return 0;
+}
+
+/* The lookup the server did before the mime table: a strcmp chain on the raw extension */
+static const char *legacy_mime(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (!ext)
+        return NULL;
+    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
+        return "text/html";
+    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
+        return "image/jpeg";
+    if (strcmp(ext, ".gif") == 0)
+        return "image/gif";
+    if (strcmp(ext, ".png") == 0)
+        return "image/png";
+    if (strcmp(ext, ".css") == 0)
+        return "text/css";
+    if (strcmp(ext, ".au") == 0)
+        return "audio/basic";
+    if (strcmp(ext, ".wav") == 0)
+        return "audio/wav";
+    if (strcmp(ext, ".avi") == 0)
+        return "video/x-msvideo";
+    if (strcmp(ext, ".mpeg") == 0 || strcmp(ext, ".mpg") == 0)
+        return "video/mpeg";
+    if (strcmp(ext, ".mp3") == 0)
+        return "audio/mpeg";
+    return NULL;
+}
+
+/* Lookups per second over a mix of names, the strcmp chain against the built in and the system table */
+static int bench_mime(long rounds)
+{
+    const char *files[] = {"index.html", "site.css", "app.js", "logo.svg", "photo.JPG", "clip.mp4", "font.woff2", "data.json", "track.mp3", "README"};
+    const char *names[] = {"legacy", "table", "indexed+system"};
+    int numFiles = sizeof(files) / sizeof(files[0]);
+    for (int mode = 0; mode < 3; mode++)
+    {
+        long known = 0;
+        if (mode == 2 && mime_load(MIME_TYPES_FILE) == ERROR)
+        {
+            printf("bench=mime mode=%s missing=%s\n", names[mode], MIME_TYPES_FILE);
+            break;
+        }
+        double start = now_sec();
+        for (long i = 0; i < rounds; i++)
+            known += (mode == 0 ? legacy_mime(files[i % numFiles]) : mime_type(files[i % numFiles])) != NULL;
+        double elapsed = now_sec() - start;
+        printf("bench=mime mode=%s known=%ld/%d lookups_per_sec=%.0f ns_per_lookup=%.1f\n",
+               names[mode], known * numFiles / rounds, numFiles, rounds / elapsed, elapsed * 1e9 / rounds);
+    }
+    mime_destroy();
+    return 0;
+}
+
+/* Read and drop everything sent on the socket */
+static void *drain(void *arg)
+{
+    char buf[65536];
+    while (read(*(int *)arg, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+/* A connected loopback TCP pair, like the server and a client */
+static int tcp_pair(int *sender, int *receiver)
+{
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener == ERROR || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == ERROR || listen(listener, 1) == ERROR ||
+        getsockname(listener, (struct sockaddr *)&addr, &length) == ERROR)
+        return ERROR;
+    *receiver = socket(AF_INET, SOCK_STREAM, 0);
+    if (*receiver == ERROR || connect(*receiver, (struct sockaddr *)&addr, sizeof(addr)) == ERROR ||
+        (*sender = accept(listener, NULL, NULL)) == ERROR)
+        return ERROR;
+    close(listener);
+    return 0;
+}
+
+/* Send a file of size bytes rounds times behind a header: 0 sendfile from the fd,
+ * 1 writev from a copy made once (the cache before mmap), 2 writev from a mapping made once */
+static double serve_rounds(int mode, int filefd, off_t size, long rounds)
+{
+    static const char header[] = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: 1024\r\n\r\n";
+    int sender, receiver;
+    pthread_t reader;
+    char *body = NULL;
+    if (tcp_pair(&sender, &receiver) == ERROR || pthread_create(&reader, NULL, drain, &receiver) != 0)
+        return ERROR;
+    if (mode == 1 && (body = malloc(size)) != NULL && pread(filefd, body, size, 0) != size)
+        return ERROR;
+    if (mode == 2 && (body = mmap(NULL, size, PROT_READ, MAP_SHARED, filefd, 0)) == MAP_FAILED)
+        return ERROR;
+    double start = now_sec();
+    for (long i = 0; i < rounds; i++)
+    {
+        struct iovec iov[2] = {{(void *)header, sizeof(header) - 1}, {body, size}};
+        if ((mode == 0 ? write_file(sender, iov, 1, filefd, 0, size) : write_segments(sender, iov, 2)) == ERROR)
+            return ERROR;
+    }
+    double elapsed = now_sec() - start;
+    close(sender);
+    pthread_join(reader, NULL);
+    close(receiver);
+    if (mode == 1)
+        free(body);
+    if (mode == 2)
+        munmap(body, size);
+    return elapsed;
+}
+
+/* Responses per second for 1KB to 1MB files: sendfile against a copy in memory against a mapping */
+static int bench_mmap(long bytes)
+{
+    const char *names[] = {"sendfile", "copy", "mmap"};
+    char path[] = "/tmp/bench-mmap-XXXXXX";
+    int filefd = mkstemp(path);
+    if (filefd == ERROR)
+        return ERROR;
+    unlink(path);
+    for (off_t size = 1024; size <= 1024 * 1024; size *= 4)
+    {
+        char *data = malloc(size);
+        memset(data, 'x', size);
+        if (ftruncate(filefd, 0) == ERROR || pwrite(filefd, data, size, 0) != size)
+            return ERROR;
+        free(data);
+        long rounds = bytes / size;
+        for (int mode = 0; mode < 3; mode++)
+        {
+            double elapsed = serve_rounds(mode, filefd, size, rounds);
+            if (elapsed == ERROR)
+            {
+                printf("bench=mmap mode=%s size=%ld failed\n", names[mode], size);
+                return ERROR;
+            }
+            printf("bench=mmap mode=%s size=%ld responses_per_sec=%.0f us_per_response=%.2f mb_per_sec=%.0f\n",
+                   names[mode], size, rounds / elapsed, elapsed * 1e6 / rounds, rounds * size / elapsed / (1024 * 1024));
+        }
+    }
+    close(filefd);
+    return 0;
+}
+
+/* Shared by the connect clients */
+typedef struct connect_st
+{
+    int port;
+    long total;
+    atomic_long started;
+    atomic_long failed;
+} connect_t;
+
+/* One request per connection: connect, ask for /, read the whole response, close */
+static int one_connection(int port)
+{
+    static const char request[] = "GET / HTTP/1.0\r\n\r\n";
+    struct sockaddr_in server;
+    char buf[4096];
+    ssize_t bytes, sum = 0;
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return ERROR;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0 || write(fd, request, sizeof(request) - 1) < 0)
+    {
+        close(fd);
+        return ERROR;
+    }
+    while ((bytes = read(fd, buf, sizeof(buf))) > 0)
+        sum += bytes;
+    close(fd);
+    return bytes < 0 || sum == 0 ? ERROR : 0;
+}
+
+static void *connect_client(void *arg)
+{
+    connect_t *c = (connect_t *)arg;
+    while (atomic_fetch_add(&c->started, 1) < c->total)
+    {
+        if (one_connection(c->port) == ERROR)
+            atomic_fetch_add(&c->failed, 1);
+    }
+    return NULL;
+}
+
+/* New connections per second a running server accepts and answers */
+static int bench_connect(int port, long total)
+{
+    pthread_t threads[CONNECT_THREADS];
+    connect_t c = {port, total, 0, 0};
+    double start = now_sec();
+    for (int i = 0; i < CONNECT_THREADS; i++)
+    {
+        if (pthread_create(&threads[i], NULL, connect_client, &c) != 0)
+            return ERROR;
+    }
+    for (int i = 0; i < CONNECT_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now_sec() - start;
+    printf("bench=connect port=%d clients=%d connections=%ld failed=%ld connections_per_sec=%.0f\n",
+           port, CONNECT_THREADS, total, atomic_load(&c.failed), total / elapsed);
+    return atomic_load(&c.failed) == total ? ERROR : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: bench <pool|stress|resolve|parse|mime|mmap> [count] | bench connect <port> [count]\n");
+        return EXIT_FAILURE;
+    }
+    long count = argc > 2 ? atol(argv[2]) : 0;
+    if (strcmp(argv[1], "pool") == 0)
+        return bench_pool(count > 0 ? count : POOL_JOBS) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (strcmp(argv[1], "stress") == 0)
+        return bench_stress(count > 0 ? count : STRESS_JOBS) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (strcmp(argv[1], "resolve") == 0)
+        return bench_resolve(count > 0 ? count : RESOLVE_ROUNDS) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (strcmp(argv[1], "connect") == 0 && count > 0)
+    {
+        long total = argc > 3 ? atol(argv[3]) : 0;
+        return bench_connect(count, total > 0 ? total : CONNECTIONS) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (strcmp(argv[1], "parse") == 0)
+        return bench_parse(count > 0 ? count : PARSE_ROUNDS) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (strcmp(argv[1], "mmap") == 0)
+        return bench_mmap(count > 0 ? count : MMAP_BYTES) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (strcmp(argv[1], "mime") == 0)
+        return bench_mime(count > 0 ? count : MIME_ROUNDS) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    printf("Usage: bench <pool|stress|resolve|parse|mime|mmap> [count] | bench connect <port> [count]\n");
+    return EXIT_FAILURE;
+}
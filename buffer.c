@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+#define ERROR -1
+
+void buffer_init(buffer_t *buf)
+{
+    buffer_init_arena(buf, NULL);
+}
+
+void buffer_init_arena(buffer_t *buf, arena_t *arena)
+{
+    buf->data = NULL;
+    buf->len = buf->size = 0;
+    buf->arena = arena;
+}
+
+/* Make room for length more bytes and the NUL */
+static int buffer_reserve(buffer_t *buf, size_t length)
+{
+    if (buf->len + length + 1 <= buf->size)
+        return 0;
+    size_t size = buf->size ? buf->size : BUFFER_INIT;
+    while (size < buf->len + length + 1)
+        size *= 2;
+    char *data = buf->arena != NULL ? arena_grow(buf->arena, buf->data, buf->len + 1, size) : realloc(buf->data, size);
+    if (data == NULL)
+        return ERROR;
+    buf->data = data;
+    buf->size = size;
+    return 0;
+}
+
+int buffer_append(buffer_t *buf, const char *data, size_t length)
+{
+    if (buffer_reserve(buf, length) == ERROR)
+        return ERROR;
+    memcpy(buf->data + buf->len, data, length);
+    buf->len += length;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
+
+int buffer_printf(buffer_t *buf, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0 || buffer_reserve(buf, length) == ERROR)
+        return ERROR;
+    va_start(args, format);
+    vsnprintf(buf->data + buf->len, length + 1, format, args);
+    va_end(args);
+    buf->len += length;
+    return 0;
+}
+
+char *buffer_detach(buffer_t *buf)
+{
+    char *data = buf->data;
+    if (buf->arena != NULL && data != NULL && (data = malloc(buf->len + 1)) != NULL)
+        memcpy(data, buf->data, buf->len + 1);
+    buffer_init_arena(buf, buf->arena);
+    return data;
+}
+
+void buffer_free(buffer_t *buf)
+{
+    if (buf->arena == NULL)
+        free(buf->data);
+    buffer_init_arena(buf, buf->arena);
+}
@@ -0,0 +1,61 @@
+#if !defined(BUFFER_H)
+#define BUFFER_H
+#include <stdarg.h>
+#include <stddef.h>
+#include "arena.h"
+
+/**
+ * buffer.h
+ *
+ * Growable byte buffer. Appending is amortized linear: the storage
+ * doubles when it runs out, so building a response of n bytes costs
+ * O(n) instead of the O(n^2) of repeated strcat. data is always NUL
+ * terminated. The storage comes from the heap, or from an arena for a
+ * buffer that does not outlive the request.
+ */
+
+// first allocation of a buffer
+#define BUFFER_INIT 1024
+
+typedef struct buffer_st
+{
+	char *data;	 //the bytes, NULL until the first append
+	size_t len;	 //bytes used, without the NUL
+	size_t size; //bytes allocated
+	arena_t *arena; //where the storage comes from, NULL for the heap
+} buffer_t;
+
+/**
+ * buffer_init makes an empty buffer, it allocates nothing.
+ */
+void buffer_init(buffer_t *buf);
+
+/**
+ * buffer_init_arena makes an empty buffer that grows in arena, its
+ * storage is given back with the arena.
+ */
+void buffer_init_arena(buffer_t *buf, arena_t *arena);
+
+/**
+ * buffer_append copies length bytes at the end. returns 0, or -1 when
+ * the memory could not be grown (the buffer is left as it was).
+ */
+int buffer_append(buffer_t *buf, const char *data, size_t length);
+
+/**
+ * buffer_printf appends printf style formatted text. returns 0 or -1.
+ */
+int buffer_printf(buffer_t *buf, const char *format, ...);
+
+/**
+ * buffer_detach hands the storage to the caller (to free) and leaves
+ * the buffer empty. the bytes of an arena buffer are copied to the heap.
+ */
+char *buffer_detach(buffer_t *buf);
+
+/**
+ * buffer_free releases the storage.
+ */
+void buffer_free(buffer_t *buf);
+
+#endif
@@ -0,0 +1,314 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "cache.h"
+
+typedef enum
+{
+    false,
+    true
+} bool;
+
+/* FNV-1a hash of the key */
+static unsigned int hash_path(const char *path)
+{
+    unsigned int hash = 2166136261u;
+    while (*path)
+    {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Bytes a variant takes from the capacity */
+static size_t variant_cost(cache_variant_t *variant)
+{
+    return variant == NULL ? 0 : variant->length + variant->header_length + sizeof(cache_variant_t);
+}
+
+/* Bytes an entry takes from the capacity, with its variants */
+static size_t entry_cost(cache_entry_t *entry)
+{
+    size_t cost = entry->length + entry->header_length + strlen(entry->path) + sizeof(cache_entry_t);
+    for (int i = 0; i < CACHE_VARIANTS; i++)
+        cost += variant_cost(atomic_load(&entry->variants[i]));
+    return cost;
+}
+
+static void free_variant(cache_variant_t *variant)
+{
+    if (variant == NULL)
+        return;
+    free(variant->body);
+    free(variant->header);
+    free(variant);
+}
+
+static void free_body(char *body, size_t length, int mapped)
+{
+    if (mapped)
+        munmap(body, length);
+    else
+        free(body);
+}
+
+/* Free an entry once nobody uses it anymore */
+static void free_entry(cache_entry_t *entry)
+{
+    for (int i = 0; i < CACHE_VARIANTS; i++)
+        free_variant(atomic_load(&entry->variants[i]));
+    free(entry->path);
+    free_body(entry->body, entry->length, entry->mapped);
+    free(entry->header);
+    free(entry);
+}
+
+void cache_release(cache_entry_t *entry)
+{
+    if (entry != NULL && atomic_fetch_sub(&entry->refs, 1) == 1)
+        free_entry(entry);
+}
+
+/* Shard of a key, the low bits pick the bucket so use the high ones */
+static cache_shard_t *shard_of(cache_t *cache, unsigned int hash)
+{
+    return &cache->shards[(hash >> 24) % CACHE_SHARDS];
+}
+
+/* Unlink an entry from the LRU list, lock held */
+static void lru_unlink(cache_shard_t *shard, cache_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        shard->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+/* Put an entry at the head of the LRU list, lock held */
+static void lru_push(cache_shard_t *shard, cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head)
+        shard->head->prev = entry;
+    else
+        shard->tail = entry;
+    shard->head = entry;
+}
+
+/* Take an entry out of the shard and drop the cache reference, lock held */
+static void remove_entry(cache_shard_t *shard, cache_entry_t *entry)
+{
+    cache_entry_t **link = &shard->buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->hnext;
+    *link = entry->hnext;
+    lru_unlink(shard, entry);
+    shard->bytes -= entry_cost(entry);
+    cache_release(entry);
+}
+
+/* Find an entry in its bucket, lock held */
+static cache_entry_t *find(cache_shard_t *shard, const char *path, unsigned int hash)
+{
+    cache_entry_t *entry = shard->buckets[hash % CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0))
+        entry = entry->hnext;
+    return entry;
+}
+
+/* The file did not change since the entry was built */
+static bool is_fresh(cache_entry_t *entry, const struct stat *st)
+{
+    return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+cache_t *create_cache(size_t capacity)
+{
+    cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
+    if (cache == NULL)
+    {
+        fprintf(stderr, "malloc failed at create cache <cache>");
+        return NULL;
+    }
+    cache->capacity = capacity;
+    for (int i = 0; i < CACHE_SHARDS; i++)
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    atomic_init(&cache->stale, 0);
+    atomic_init(&cache->evictions, 0);
+    return cache;
+}
+
+cache_entry_t *cache_get(cache_t *cache, const char *path, const struct stat *st)
+{
+    if (cache == NULL)
+        return NULL;
+    unsigned int hash = hash_path(path);
+    cache_shard_t *shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *entry = find(shard, path, hash);
+    if (entry != NULL && is_fresh(entry, st) == false) /* The file changed on disk */
+    {
+        remove_entry(shard, entry);
+        atomic_fetch_add(&cache->stale, 1);
+        entry = NULL;
+    }
+    if (entry != NULL)
+    {
+        lru_unlink(shard, entry);
+        lru_push(shard, entry);
+        atomic_fetch_add(&entry->refs, 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add(entry != NULL ? &cache->hits : &cache->misses, 1);
+    return entry;
+}
+
+cache_entry_t *cache_put(cache_t *cache, const char *path, const struct stat *st, char *body, size_t length, int mapped, const char *header, const char *mime)
+{
+    if (cache == NULL)
+    {
+        free_body(body, length, mapped);
+        return NULL;
+    }
+    cache_entry_t *entry = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL || (entry->header = strdup(header)) == NULL)
+    {
+        if (entry)
+            free_entry(entry);
+        free_body(body, length, mapped);
+        return NULL;
+    }
+    entry->hash = hash_path(path);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->body = body;
+    entry->length = length;
+    entry->mapped = mapped;
+    entry->header_length = strlen(header);
+    entry->mime = mime;
+    atomic_init(&entry->unencoded, 0); /* Nothing looked up yet */
+    atomic_init(&entry->refs, 2); /* The cache and the caller */
+
+    cache_shard_t *shard = shard_of(cache, entry->hash);
+    size_t limit = cache->capacity / CACHE_SHARDS, cost = entry_cost(entry);
+    if (cost > limit)
+    {
+        atomic_store(&entry->refs, 1);
+        return entry; /* Too big for the cache, the caller still sends it */
+    }
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *old = find(shard, path, entry->hash);
+    if (old != NULL) /* Another thread cached it first, replace it with the newer read */
+        remove_entry(shard, old);
+    while (shard->bytes + cost > limit && shard->tail != NULL)
+    {
+        remove_entry(shard, shard->tail);
+        atomic_fetch_add(&cache->evictions, 1);
+    }
+    cache_entry_t **bucket = &shard->buckets[entry->hash % CACHE_BUCKETS];
+    entry->hnext = *bucket;
+    *bucket = entry;
+    lru_push(shard, entry);
+    shard->bytes += cost;
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+cache_variant_t *cache_variant(cache_entry_t *entry, int index)
+{
+    return atomic_load(&entry->variants[index]);
+}
+
+cache_variant_t *cache_attach(cache_t *cache, cache_entry_t *entry, int index, char *body, size_t length, const char *header)
+{
+    if (cache == NULL)
+    {
+        free(body);
+        return NULL;
+    }
+    cache_variant_t *variant = (cache_variant_t *)calloc(1, sizeof(cache_variant_t));
+    if (variant == NULL || (variant->header = strdup(header)) == NULL)
+    {
+        free(variant);
+        free(body);
+        return NULL;
+    }
+    variant->body = body;
+    variant->length = length;
+    variant->header_length = strlen(header);
+    cache_shard_t *shard = shard_of(cache, entry->hash);
+    size_t limit = cache->capacity / CACHE_SHARDS;
+    pthread_mutex_lock(&shard->lock);
+    cache_variant_t *current = atomic_load(&entry->variants[index]);
+    if (current != NULL) /* Another thread attached it first */
+    {
+        pthread_mutex_unlock(&shard->lock);
+        free_variant(variant);
+        return current;
+    }
+    atomic_store(&entry->variants[index], variant);
+    if (find(shard, entry->path, entry->hash) == entry) /* Still cached, the shard pays for it */
+    {
+        shard->bytes += variant_cost(variant);
+        while (shard->bytes > limit && shard->tail != NULL)
+        {
+            remove_entry(shard, shard->tail); /* Possibly entry itself, the caller still holds it */
+            atomic_fetch_add(&cache->evictions, 1);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return variant;
+}
+
+void cache_stats(cache_t *cache, cache_stats_t *stats)
+{
+    memset(stats, 0, sizeof(cache_stats_t));
+    if (cache == NULL)
+        return;
+    stats->hits = atomic_load(&cache->hits);
+    stats->misses = atomic_load(&cache->misses);
+    stats->stale = atomic_load(&cache->stale);
+    stats->evictions = atomic_load(&cache->evictions);
+    stats->capacity = cache->capacity;
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->bytes += shard->bytes;
+        for (cache_entry_t *entry = shard->head; entry != NULL; entry = entry->next)
+        {
+            stats->entries++;
+            if (entry->mapped)
+                stats->mapped += entry->length;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void destroy_cache(cache_t *cache)
+{
+    if (cache == NULL)
+        return;
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        cache_shard_t *shard = &cache->shards[i];
+        while (shard->tail != NULL)
+            remove_entry(shard, shard->tail);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
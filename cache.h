@@ -0,0 +1,166 @@
+#if !defined(CACHE_H)
+#define CACHE_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * cache.h
+ *
+ * Shared in-memory cache of small static files. Entries are keyed by the
+ * resolved path and hold the body, the prebuilt part of the response
+ * header and the mime type. An entry is only served while the stat data
+ * of the file (device, inode, size, mtime) still matches, stale entries
+ * are dropped on lookup. The cache is bounded in bytes and evicts the
+ * least recently used entries. It is split in shards, each one with its
+ * own lock, hash table and LRU list.
+ */
+
+// number of independent shards
+#define CACHE_SHARDS 16
+
+// buckets of the hash table of every shard
+#define CACHE_BUCKETS 256
+
+// files bigger than this are never cached (checked by the caller)
+#define CACHE_MAX_ENTRY (1024 * 1024)
+
+// other forms of the body an entry can carry, compressed ones (indexed by the caller)
+#define CACHE_VARIANTS 2
+
+/**
+ * another form of the body of an entry, with its own header lines.
+ * built once, attached to the entry and freed with it.
+ */
+typedef struct cache_variant_st
+{
+	char *body;
+	size_t length;
+	char *header; //prebuilt header lines of this form
+	size_t header_length;
+} cache_variant_t;
+
+/**
+ * a cached file. entries are reference counted: a lookup returns the
+ * entry with a reference that the caller gives back with cache_release,
+ * so the body stays valid while it is being sent even if it is evicted.
+ */
+typedef struct cache_entry_st
+{
+	char *path;					 //key
+	unsigned int hash;			 //hash of the key
+	dev_t dev;					 //stat data the entry was built from
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	char *body;					 //file content
+	int mapped;					 //body is a read only mapping of the file, unmapped instead of freed
+	size_t length;				 //body length
+	char *header;				 //prebuilt header lines (Content-Type, Content-Length)
+	size_t header_length;
+	const char *mime;			 //mime type, NULL if unknown
+	_Atomic(cache_variant_t *) variants[CACHE_VARIANTS]; //NULL until attached
+	atomic_int unencoded;		 //bit per variant index: no precompressed file on disk for it, known while the entry is valid
+	atomic_int refs;			 //1 for the cache itself + 1 per user
+	struct cache_entry_st *hnext; //hash chain
+	struct cache_entry_st *prev;  //LRU list, most recent first
+	struct cache_entry_st *next;
+} cache_entry_t;
+
+/**
+ * one shard of the cache
+ */
+typedef struct cache_shard_st
+{
+	pthread_mutex_t lock;					//lock on this shard
+	cache_entry_t *buckets[CACHE_BUCKETS]; //hash table
+	cache_entry_t *head;					//most recently used
+	cache_entry_t *tail;					//least recently used
+	size_t bytes;							//bytes held by the shard
+} cache_shard_t;
+
+/**
+ * hit and miss counters, to size the cache
+ */
+typedef struct cache_stats_st
+{
+	long hits;		 //lookups served from memory
+	long misses;	 //lookups that went to the disk
+	long stale;		 //entries dropped because the file changed
+	long evictions;	 //entries dropped to make room
+	long entries;	 //entries currently cached
+	size_t bytes;	 //bytes currently cached
+	size_t mapped;	 //bytes of those that are file mappings
+	size_t capacity; //bytes allowed
+} cache_stats_t;
+
+/**
+ * The cache
+ */
+typedef struct _cache_st
+{
+	size_t capacity;					//bytes allowed, split between the shards
+	cache_shard_t shards[CACHE_SHARDS]; //the shards
+	atomic_long hits;
+	atomic_long misses;
+	atomic_long stale;
+	atomic_long evictions;
+} cache_t;
+
+/**
+ * create_cache creates an empty cache holding up to capacity bytes of
+ * bodies and headers. returns NULL on failure.
+ */
+cache_t *create_cache(size_t capacity);
+
+/**
+ * cache_get looks up path and checks the entry against st, the current
+ * stat of the file. returns the entry with a reference taken, or NULL on
+ * a miss (including when the file changed since it was cached).
+ */
+cache_entry_t *cache_get(cache_t *cache, const char *path, const struct stat *st);
+
+/**
+ * cache_put inserts a file, evicting least recently used entries to make
+ * room. the cache takes ownership of body: malloc'd, or a mapping of
+ * length bytes (mmap) when mapped is set, which is unmapped when the
+ * entry is evicted or found stale and nobody sends it anymore. returns
+ * the entry with a reference taken, or NULL if it could not be cached,
+ * in which case body was released.
+ */
+cache_entry_t *cache_put(cache_t *cache, const char *path, const struct stat *st, char *body, size_t length, int mapped, const char *header, const char *mime);
+
+/**
+ * cache_variant returns the variant of entry at index, NULL when none
+ * was attached yet.
+ */
+cache_variant_t *cache_variant(cache_entry_t *entry, int index);
+
+/**
+ * cache_attach gives entry a variant at index, its bytes count against
+ * the capacity while the entry is cached. the cache takes ownership of
+ * body (malloc'd). returns the variant of entry at index, the one of
+ * another thread if it attached first, or NULL if out of memory, in
+ * which case body was freed.
+ */
+cache_variant_t *cache_attach(cache_t *cache, cache_entry_t *entry, int index, char *body, size_t length, const char *header);
+
+/**
+ * cache_release gives back a reference taken by cache_get or cache_put.
+ */
+void cache_release(cache_entry_t *entry);
+
+/**
+ * cache_stats fills the counters of the cache.
+ */
+void cache_stats(cache_t *cache, cache_stats_t *stats);
+
+/**
+ * destroy_cache frees every entry and the cache. no reference may be
+ * held anymore.
+ */
+void destroy_cache(cache_t *cache);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "encoding.h"
+
+typedef enum
+{
+    false,
+    true
+} bool;
+
+#define GZIP_WINDOW (15 + 16) /* Largest window, with the gzip wrapper */
+#define GZIP_MEMORY 8
+
+static const char *names[ENCODINGS] = {"identity", "gzip", "br"};
+static const char *suffixes[ENCODINGS] = {"", ".gz", ".br"};
+
+/* "q=0", "q=0.0", ... refuse the coding they follow */
+static bool refused(const char *param, size_t len)
+{
+    while (len > 0 && (*param == ' ' || *param == '\t'))
+    {
+        param++;
+        len--;
+    }
+    if (len < 3 || strncasecmp(param, "q=", 2) != 0 || param[2] != '0')
+        return false;
+    for (size_t i = 3; i < len; i++)
+        if (param[i] != '0' && param[i] != '.' && param[i] != ' ' && param[i] != '\t')
+            return false;
+    return true;
+}
+
+int accepted_encodings(const char *value, size_t len)
+{
+    int accepted = 0, named = 0;
+    bool any = false;
+    size_t at = 0;
+    while (at < len)
+    {
+        while (at < len && (value[at] == ' ' || value[at] == '\t' || value[at] == ','))
+            at++;
+        size_t name = at;
+        while (at < len && value[at] != ',' && value[at] != ';' && value[at] != ' ' && value[at] != '\t')
+            at++;
+        size_t nameLength = at - name, param = at;
+        while (at < len && value[at] != ',')
+            at++;
+        const char *semicolon = memchr(value + param, ';', at - param);
+        bool ok = semicolon == NULL || refused(semicolon + 1, value + at - semicolon - 1) == false;
+        int bit = 0;
+        if ((nameLength == 4 && strncasecmp(value + name, "gzip", 4) == 0) || (nameLength == 6 && strncasecmp(value + name, "x-gzip", 6) == 0))
+            bit = 1 << ENCODING_GZIP;
+        else if (nameLength == 2 && strncasecmp(value + name, "br", 2) == 0)
+            bit = 1 << ENCODING_BR;
+        else if (nameLength == 1 && value[name] == '*')
+            any = ok;
+        named |= bit;
+        if (ok)
+            accepted |= bit;
+    }
+    if (any) /* The wildcard covers the codings not named */
+        accepted |= ((1 << ENCODING_GZIP) | (1 << ENCODING_BR)) & ~named;
+    return accepted;
+}
+
+content_encoding preferred_encoding(int accepted)
+{
+    if (accepted & (1 << ENCODING_BR))
+        return ENCODING_BR;
+    if (accepted & (1 << ENCODING_GZIP))
+        return ENCODING_GZIP;
+    return ENCODING_IDENTITY;
+}
+
+const char *encoding_name(content_encoding encoding)
+{
+    return names[encoding];
+}
+
+const char *encoding_suffix(content_encoding encoding)
+{
+    return suffixes[encoding];
+}
+
+/* The type ends with suffix, "+xml" for application/rss+xml */
+static bool ends_with(const char *mime, const char *suffix)
+{
+    size_t length = strlen(mime), suffixLength = strlen(suffix);
+    return length >= suffixLength && strcmp(mime + length - suffixLength, suffix) == 0;
+}
+
+int compressible(const char *mime)
+{
+    if (mime == NULL)
+        return false;
+    return strncmp(mime, "text/", 5) == 0 || strcmp(mime, "application/javascript") == 0 ||
+           strcmp(mime, "application/json") == 0 || strcmp(mime, "application/xml") == 0 ||
+           strcmp(mime, "application/wasm") == 0 || ends_with(mime, "+xml") || ends_with(mime, "+json");
+}
+
+void encoder_release(encoder_t *encoder)
+{
+    if (encoder->state != NULL && encoder->encoding == ENCODING_GZIP)
+    {
+        deflateEnd(encoder->state);
+        free(encoder->state);
+    }
+    else if (encoder->state != NULL)
+        BrotliEncoderDestroyInstance(encoder->state);
+    free(encoder->out);
+    encoder->state = NULL;
+    encoder->out = NULL;
+}
+
+/* One deflate call into a buffer of the worst case size */
+static bool gzip_body(encoder_t *encoder, const char *data, size_t len, size_t *encoded)
+{
+    z_stream *stream = calloc(1, sizeof(z_stream));
+    if (stream == NULL)
+        return false;
+    if (deflateInit2(stream, ENCODING_GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW, GZIP_MEMORY, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(stream);
+        return false;
+    }
+    encoder->state = stream;
+    size_t bound = deflateBound(stream, len);
+    if ((encoder->out = malloc(bound)) == NULL)
+        return false;
+    stream->next_in = (Bytef *)data;
+    stream->avail_in = len;
+    stream->next_out = (Bytef *)encoder->out;
+    stream->avail_out = bound;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+        return false;
+    *encoded = stream->total_out;
+    return true;
+}
+
+/* The streaming encoder, unlike the one shot call its state is ours to free */
+static bool brotli_body(encoder_t *encoder, const char *data, size_t len, size_t *encoded)
+{
+    size_t bound = BrotliEncoderMaxCompressedSize(len);
+    if (bound == 0 || (encoder->state = BrotliEncoderCreateInstance(NULL, NULL, NULL)) == NULL)
+        return false;
+    BrotliEncoderSetParameter(encoder->state, BROTLI_PARAM_QUALITY, ENCODING_BROTLI_QUALITY);
+    BrotliEncoderSetParameter(encoder->state, BROTLI_PARAM_LGWIN, BROTLI_DEFAULT_WINDOW);
+    BrotliEncoderSetParameter(encoder->state, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    BrotliEncoderSetParameter(encoder->state, BROTLI_PARAM_SIZE_HINT, len < (1u << 30) ? (uint32_t)len : (1u << 30));
+    if ((encoder->out = malloc(bound)) == NULL)
+        return false;
+    const uint8_t *in = (const uint8_t *)data;
+    uint8_t *out = (uint8_t *)encoder->out;
+    size_t availableIn = len, availableOut = bound;
+    while (BrotliEncoderIsFinished(encoder->state) == BROTLI_FALSE)
+        if (BrotliEncoderCompressStream(encoder->state, BROTLI_OPERATION_FINISH, &availableIn, &in, &availableOut, &out, NULL) == BROTLI_FALSE ||
+            (availableOut == 0 && BrotliEncoderIsFinished(encoder->state) == BROTLI_FALSE))
+            return false;
+    *encoded = bound - availableOut;
+    return true;
+}
+
+char *encode_body(encoder_t *encoder, content_encoding encoding, const char *data, size_t len, size_t *encoded)
+{
+    bool done = false;
+    encoder->encoding = encoding;
+    encoder->state = NULL;
+    encoder->out = NULL;
+    if (len < ENCODING_MIN_SIZE)
+        return NULL;
+    if (encoding == ENCODING_GZIP)
+        done = gzip_body(encoder, data, len, encoded);
+    else if (encoding == ENCODING_BR)
+        done = brotli_body(encoder, data, len, encoded);
+    char *out = NULL;
+    if (done && *encoded < len) /* Otherwise already compressed data, keep the original */
+    {
+        out = encoder->out;
+        encoder->out = NULL;
+    }
+    encoder_release(encoder);
+    return out;
+}
@@ -0,0 +1,86 @@
+#if !defined(ENCODING_H)
+#define ENCODING_H
+#include <stddef.h>
+
+/**
+ * encoding.h
+ *
+ * Content codings of a response body. Accept-Encoding is reduced to a
+ * set of the codings the server has, a body is compressed with zlib
+ * (gzip) or the brotli encoder in one call. The caller keeps the result,
+ * every file is compressed once and served from memory afterwards.
+ */
+
+// bodies below this size are sent as they are, the framing eats the gain
+#define ENCODING_MIN_SIZE 256
+
+// zlib level and brotli quality of the on the fly compression
+#define ENCODING_GZIP_LEVEL 6
+#define ENCODING_BROTLI_QUALITY 6
+
+typedef enum
+{
+	ENCODING_IDENTITY, //the body as it is on disk
+	ENCODING_GZIP,
+	ENCODING_BR,
+	ENCODINGS
+} content_encoding;
+
+/**
+ * accepted_encodings parses an Accept-Encoding value of len bytes and
+ * returns the set of codings the client takes, bit 1 << ENCODING_GZIP
+ * and 1 << ENCODING_BR. "q=0" refuses a coding, "*" stands for the ones
+ * not named.
+ */
+int accepted_encodings(const char *value, size_t len);
+
+/**
+ * preferred_encoding picks from an accepted set: br, then gzip, then
+ * ENCODING_IDENTITY when the set is empty.
+ */
+content_encoding preferred_encoding(int accepted);
+
+/**
+ * encoding_name returns the Content-Encoding token, "gzip" or "br".
+ */
+const char *encoding_name(content_encoding encoding);
+
+/**
+ * encoding_suffix returns the file suffix of a precompressed sibling,
+ * ".gz" or ".br".
+ */
+const char *encoding_suffix(content_encoding encoding);
+
+/**
+ * compressible tells if a body of this mime type shrinks, text and
+ * markup do, images and media are compressed already.
+ */
+int compressible(const char *mime);
+
+/**
+ * What an encode_body call holds while it runs. It belongs to the
+ * caller, so a call that never returns (a SIGBUS on a truncated mapping
+ * jumps out of the compressor) can still be cleaned up.
+ */
+typedef struct _encoder_st
+{
+	content_encoding encoding; //coding of state
+	void *state;			   //z_stream or BrotliEncoderState, NULL when not compressing
+	char *out;				   //output buffer, NULL once given to the caller
+} encoder_t;
+
+/**
+ * encode_body compresses len bytes of data, using encoder for its
+ * state. returns a malloc'd buffer and its size in *encoded, or NULL
+ * when compression failed or did not make the body smaller. either way
+ * the encoder holds nothing when it returns.
+ */
+char *encode_body(encoder_t *encoder, content_encoding encoding, const char *data, size_t len, size_t *encoded);
+
+/**
+ * encoder_release frees what an interrupted encode_body left in the
+ * encoder, the compressor state and the output buffer.
+ */
+void encoder_release(encoder_t *encoder);
+
+#endif
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "handoff.h"
+
+#define ERROR -1
+#define FD_DIGITS 12 /* A descriptor number and its comma */
+
+extern char **environ;
+
+int handoff_inherit(int *fds, int count)
+{
+    const char *value = getenv(HANDOFF_ENV);
+    if (value == NULL)
+        return 0;
+    int found = 0;
+    const char *at = value;
+    while (*at != '\0')
+    {
+        char *end;
+        long fd = strtol(at, &end, 10);
+        int on = 0;
+        socklen_t len = sizeof(on);
+        if (end == at || fd < 0 || found == count)
+            return ERROR;
+        if (getsockopt((int)fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == ERROR || on == 0)
+            return ERROR;
+        fds[found++] = (int)fd;
+        at = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+            return ERROR;
+    }
+    if (found != count)
+        return ERROR;
+    unsetenv(HANDOFF_ENV); /* Our own successor gets a fresh list */
+    return found;
+}
+
+/* The environment of the successor: ours without any stale list, and the sockets */
+static char **successor_environ(const int *fds, int count)
+{
+    int size = 0;
+    while (environ[size] != NULL)
+        size++;
+    char **envp = malloc((size + 2) * sizeof(char *));
+    char *entry = malloc(sizeof(HANDOFF_ENV) + 1 + count * FD_DIGITS);
+    if (envp == NULL || entry == NULL)
+    {
+        free(envp);
+        free(entry);
+        return NULL;
+    }
+    int at = 0;
+    for (int i = 0; i < size; i++)
+    {
+        if (strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0)
+            envp[at++] = environ[i];
+    }
+    int len = sprintf(entry, "%s=", HANDOFF_ENV);
+    for (int i = 0; i < count; i++)
+        len += sprintf(entry + len, i == 0 ? "%d" : ",%d", fds[i]);
+    envp[at++] = entry;
+    envp[at] = NULL;
+    return envp;
+}
+
+static void free_environ(char **envp)
+{
+    int last = 0;
+    while (envp[last + 1] != NULL)
+        last++;
+    free(envp[last]); /* Only the sockets entry is ours */
+    free(envp);
+}
+
+pid_t handoff_spawn(const char *path, char *const argv[], const int *fds, int count)
+{
+    int report[2], err = 0;
+    char **envp = successor_environ(fds, count);
+    if (envp == NULL)
+        return ERROR;
+    if (pipe2(report, O_CLOEXEC) == ERROR)
+    {
+        free_environ(envp);
+        return ERROR;
+    }
+    pid_t pid = fork();
+    if (pid == 0) /* Only async signal safe calls until the exec */
+    {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC); /* The successor gets the sockets and the report pipe, nothing else */
+        for (int i = 0; i < count; i++)
+            fcntl(fds[i], F_SETFD, 0);
+        execve(path, argv, envp);
+        err = errno;
+        write(report[1], &err, sizeof(err));
+        _exit(127);
+    }
+    close(report[1]);
+    ssize_t bytes = 0;
+    if (pid != ERROR) /* EOF when the exec closed the pipe, an errno when it failed */
+    {
+        while ((bytes = read(report[0], &err, sizeof(err))) == ERROR && errno == EINTR)
+            ;
+    }
+    else
+        err = errno;
+    close(report[0]);
+    free_environ(envp);
+    if (pid != ERROR && bytes == sizeof(err))
+        waitpid(pid, NULL, 0);
+    if (pid == ERROR || bytes == sizeof(err))
+    {
+        errno = err;
+        return ERROR;
+    }
+    return pid;
+}
@@ -0,0 +1,37 @@
+#if !defined(HANDOFF_H)
+#define HANDOFF_H
+#include <sys/types.h>
+
+/**
+ * handoff.h
+ *
+ * Zero downtime restart. The running server starts its successor with
+ * fork and execve, the listening sockets stay open across the exec and
+ * their numbers are passed in an environment variable. The successor
+ * accepts on the very same sockets, so connections that arrive while it
+ * starts wait in the kernel backlog instead of being refused, and the
+ * old server only has to stop accepting and drain.
+ */
+
+// environment variable with the inherited listening sockets, "3,4,5"
+#define HANDOFF_ENV "WEBSERVER_LISTEN_FDS"
+
+/**
+ * handoff_inherit takes the listening sockets passed by a predecessor
+ * into fds and removes the variable from the environment. returns the
+ * number of sockets, 0 when the server was not started by a handoff, or
+ * -1 when the variable is malformed, does not hold exactly count
+ * sockets, or one of them is not a listening socket.
+ */
+int handoff_inherit(int *fds, int count);
+
+/**
+ * handoff_spawn starts the program at path with argv and the current
+ * environment, the count listening sockets in fds inherited. every
+ * other descriptor is closed in the new program. returns its pid once
+ * the exec succeeded, -1 with errno set when the fork or the exec
+ * failed (the caller keeps serving then).
+ */
+pid_t handoff_spawn(const char *path, char *const argv[], const int *fds, int count);
+
+#endif
@@ -0,0 +1,185 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "headers.h"
+
+typedef enum
+{
+    false,
+    true
+} bool;
+
+#define ERROR -1
+#define LINE_BUFF 64
+#define PAGE_BUFF 300
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+
+#define HTML_PAGE                    \
+    "<HTML>"                         \
+    "<HEAD><TITLE>%s</TITLE></HEAD>" \
+    "<BODY><H4>%s</H4>"              \
+    "%s."                            \
+    "</BODY>"                        \
+    "</HTML>"
+
+/* What every status says, the page is built from it once */
+static const struct
+{
+    const char *title;
+    const char *text;
+    bool keep; /* The connection may stay open */
+} statuses[HTTP_STATUSES] = {
+    [HTTP_200] = {"200 OK", "", true},
+    [HTTP_206] = {"206 Partial Content", "", true},
+    [HTTP_302] = {"302 Found", "Directories must end with a slash", true},
+    [HTTP_304] = {"304 Not Modified", "", true},
+    [HTTP_400] = {"400 Bad Request", "Bad Request", false},
+    [HTTP_403] = {"403 Forbidden", "Access denied", true},
+    [HTTP_404] = {"404 Not Found", "File not found", true},
+    [HTTP_416] = {"416 Range Not Satisfiable", "The requested range is not satisfiable", true},
+    [HTTP_500] = {"500 Internal Server Error", "Some server side error", false},
+    [HTTP_501] = {"501 Not supported", "Method is not supported", false},
+    [HTTP_503] = {"503 Service Unavailable", "Server is busy, try again later", false},
+};
+
+/* Prebuilt pieces of every status */
+typedef struct template_st
+{
+    char line[LINE_BUFF];     /* "HTTP/1.1 404 Not Found\r\nServer: ...\r\n" */
+    size_t line_len;
+    char page[PAGE_BUFF];     /* The HTML page */
+    size_t page_len;
+    char content[LINE_BUFF];  /* Content-Type and Content-Length of the page */
+    size_t content_len;
+} template_t;
+
+static template_t templates[HTTP_STATUSES];
+static char dates[DATE_SLOTS][DATE_LEN + 1];
+static atomic_int current;
+static pthread_t timer;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_stop = PTHREAD_COND_INITIALIZER;
+static bool running = false;
+
+static const char keep_alive_line[] = "Connection: keep-alive\r\n\r\n";
+static const char close_line[] = "Connection: close\r\n\r\n";
+
+/* Write the date of now into the next slot, then publish it */
+static void update_date()
+{
+    struct tm tm;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts); /* time() reads the coarse clock, still the last second when the timer wakes */
+    time_t now = ts.tv_sec;
+    int next = (atomic_load(&current) + 1) % DATE_SLOTS;
+    strftime(dates[next], sizeof(dates[next]), RFC1123FMT, gmtime_r(&now, &tm));
+    atomic_store(&current, next);
+}
+
+/* Refresh the date at the start of every second while the flag at arg is set, cleared by headers_destroy */
+static void *date_timer(void *arg)
+{
+    bool *on = (bool *)arg;
+    pthread_mutex_lock(&timer_lock);
+    while (*on)
+    {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec++;
+        wake.tv_nsec = 0;
+        pthread_cond_timedwait(&timer_stop, &timer_lock, &wake);
+        update_date();
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return NULL;
+}
+
+int headers_init(const char *server)
+{
+    for (int i = 0; i < HTTP_STATUSES; i++)
+    {
+        template_t *t = &templates[i];
+        t->line_len = snprintf(t->line, sizeof(t->line), "HTTP/1.1 %s\r\nServer: %s\r\n", statuses[i].title, server);
+        t->page_len = snprintf(t->page, sizeof(t->page), HTML_PAGE, statuses[i].title, statuses[i].title, statuses[i].text);
+        t->content_len = snprintf(t->content, sizeof(t->content), "Content-Type: text/html\r\nContent-Length: %zu\r\n", t->page_len);
+        if (t->line_len >= sizeof(t->line) || t->page_len >= sizeof(t->page))
+            return ERROR;
+    }
+    update_date();
+    running = true;
+    if (pthread_create(&timer, NULL, date_timer, &running) != 0)
+    {
+        running = false;
+        return ERROR;
+    }
+    return 0;
+}
+
+void headers_destroy()
+{
+    pthread_mutex_lock(&timer_lock);
+    if (running == false)
+    {
+        pthread_mutex_unlock(&timer_lock);
+        return;
+    }
+    running = false;
+    pthread_cond_signal(&timer_stop);
+    pthread_mutex_unlock(&timer_lock);
+    pthread_join(timer, NULL);
+}
+
+char *http_date(char *buf)
+{
+    memcpy(buf, dates[atomic_load(&current)], DATE_LEN + 1);
+    return buf;
+}
+
+int status_keeps_connection(http_status status)
+{
+    return statuses[status].keep;
+}
+
+int status_code(http_status status)
+{
+    return atoi(statuses[status].title);
+}
+
+void header_add(header_t *h, const char *data, size_t len)
+{
+    if (h->count == HEADER_SEGMENTS || len == 0)
+        return;
+    h->iov[h->count].iov_base = (void *)data;
+    h->iov[h->count].iov_len = len;
+    h->count++;
+    h->length += len;
+}
+
+void header_start(header_t *h, http_status status)
+{
+    h->count = 0;
+    h->length = 0;
+    memcpy(h->date, "Date: ", 6);
+    http_date(h->date + 6);
+    memcpy(h->date + 6 + DATE_LEN, "\r\n", 3);
+    header_add(h, templates[status].line, templates[status].line_len);
+    header_add(h, h->date, 6 + DATE_LEN + 2);
+}
+
+void header_end(header_t *h, int keep_alive)
+{
+    if (keep_alive)
+        header_add(h, keep_alive_line, sizeof(keep_alive_line) - 1);
+    else
+        header_add(h, close_line, sizeof(close_line) - 1);
+}
+
+void header_page(header_t *h, http_status status, int keep_alive)
+{
+    header_add(h, templates[status].content, templates[status].content_len);
+    header_end(h, keep_alive);
+    header_add(h, templates[status].page, templates[status].page_len);
+}
@@ -0,0 +1,108 @@
+#if !defined(HEADERS_H)
+#define HEADERS_H
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * headers.h
+ *
+ * Response header generation without formatting on the request path.
+ * The Date value is kept by a timer thread that rewrites it once per
+ * second, and the status line, Server line, Connection lines and the
+ * error page of every status are built once by headers_init. A response
+ * header is assembled as a list of segments that point at these strings
+ * and can be handed to writev as is.
+ */
+
+// length of an RFC 1123 date, "Sun, 06 Nov 1994 08:49:37 GMT"
+#define DATE_LEN 29
+
+// slots the timer rotates through, a reader copying a slot is never overwritten
+#define DATE_SLOTS 4
+
+// most segments of one response header
+#define HEADER_SEGMENTS 16
+
+/**
+ * statuses the server answers with, each one has a prebuilt status line
+ * and HTML page
+ */
+typedef enum
+{
+	HTTP_200,
+	HTTP_206,
+	HTTP_302,
+	HTTP_304,
+	HTTP_400,
+	HTTP_403,
+	HTTP_404,
+	HTTP_416,
+	HTTP_500,
+	HTTP_501,
+	HTTP_503,
+	HTTP_STATUSES
+} http_status;
+
+/**
+ * a response header being assembled. iov[0..count) are the segments,
+ * length is their total size.
+ */
+typedef struct header_st
+{
+	struct iovec iov[HEADER_SEGMENTS];
+	int count;
+	size_t length;
+	char date[DATE_LEN + 9]; //"Date: " line, copied from the current slot
+} header_t;
+
+/**
+ * headers_init builds the templates for the given Server value and
+ * starts the Date timer. returns 0 on success, -1 on failure.
+ */
+int headers_init(const char *server);
+
+/**
+ * headers_destroy stops the Date timer.
+ */
+void headers_destroy();
+
+/**
+ * http_date copies the current Date value (DATE_LEN bytes and a NUL)
+ * into buf.
+ */
+char *http_date(char *buf);
+
+/**
+ * status_keeps_connection tells if the connection may stay open after
+ * this status. after a bad request or a server error it is closed.
+ */
+int status_keeps_connection(http_status status);
+
+/**
+ * status_code returns the numeric code of a status, 404 for HTTP_404.
+ */
+int status_code(http_status status);
+
+/**
+ * header_start begins a header with the status line, Server and Date.
+ */
+void header_start(header_t *h, http_status status);
+
+/**
+ * header_add appends a segment. data must stay valid until the header
+ * is sent. extra segments beyond HEADER_SEGMENTS are dropped.
+ */
+void header_add(header_t *h, const char *data, size_t len);
+
+/**
+ * header_end appends the Connection line and the empty line.
+ */
+void header_end(header_t *h, int keep_alive);
+
+/**
+ * header_page appends the Content-Type and Content-Length of the error
+ * page of status, ends the header and appends the page itself.
+ */
+void header_page(header_t *h, http_status status, int keep_alive);
+
+#endif
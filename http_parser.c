@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include "http_parser.h"
+
+typedef enum
+{
+    false,
+    true
+} bool;
+
+/* States of the machine */
+enum
+{
+    S_METHOD,
+    S_PATH,
+    S_VERSION,
+    S_LINE_LF,
+    S_HEADER_START,
+    S_HEADER_NAME,
+    S_VALUE_START,
+    S_VALUE,
+    S_HEADER_LF,
+    S_END_LF,
+    S_DONE
+};
+
+/* Character classes, one lookup per byte in the hot loops */
+#define C_TOKEN 1   /* Allowed in a method or a header name (RFC 7230 tchar) */
+#define C_VISIBLE 2 /* Allowed in the path */
+#define C_VALUE 4   /* Allowed in a header value */
+
+static unsigned char classes[256];
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+
+/* Fill the class table, once, on the first parse */
+static void init_classes()
+{
+    for (int c = 0; c < 256; c++)
+    {
+        bool token = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                     (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+        classes[c] = (token ? C_TOKEN : 0) | (c > ' ' && c != 0x7f ? C_VISIBLE : 0) |
+                     (c >= ' ' || c == '\t' ? C_VALUE : 0);
+    }
+    classes['\0'] = 0;
+}
+
+void http_reset(http_request_t *req)
+{
+    req->state = S_METHOD;
+    req->offset = req->mark = 0;
+    req->num_headers = 0;
+    req->length = 0;
+    req->elapsed = 0;
+    req->method.data = req->path.data = req->version.data = NULL;
+    req->method.len = req->path.len = req->version.len = 0;
+}
+
+/* Close the token that started at mark */
+static void take(http_request_t *req, char *buf, size_t at, slice_t *s)
+{
+    s->data = buf + req->mark;
+    s->len = at - req->mark;
+}
+
+/* The version must look like HTTP/x.y */
+static bool valid_version(slice_t *v)
+{
+    return v->len == 8 && memcmp(v->data, "HTTP/", 5) == 0 && v->data[5] >= '0' && v->data[5] <= '9' &&
+           v->data[6] == '.' && v->data[7] >= '0' && v->data[7] <= '9';
+}
+
+http_parse_status http_parse(http_request_t *req, char *buf, size_t len)
+{
+    size_t i = req->offset;
+    http_header_t *header = &req->headers[req->num_headers];
+    if (req->state == S_DONE)
+        return HTTP_PARSE_DONE;
+    pthread_once(&classes_once, init_classes);
+    for (; i < len; i++)
+    {
+        unsigned char c = buf[i];
+        switch (req->state)
+        {
+        case S_METHOD:
+            while (classes[c] & C_TOKEN && i + 1 < len) /* Skip the run of plain bytes */
+                c = buf[++i];
+            if (c == ' ' && i > req->mark)
+            {
+                take(req, buf, i, &req->method);
+                req->mark = i + 1;
+                req->state = S_PATH;
+            }
+            else if ((classes[c] & C_TOKEN) == 0)
+                return HTTP_PARSE_ERROR;
+            break;
+        case S_PATH:
+            while (classes[c] & C_VISIBLE && i + 1 < len)
+                c = buf[++i];
+            if (c == ' ' && i > req->mark)
+            {
+                take(req, buf, i, &req->path);
+                req->mark = i + 1;
+                req->state = S_VERSION;
+            }
+            else if ((classes[c] & C_VISIBLE) == 0)
+                return HTTP_PARSE_ERROR;
+            break;
+        case S_VERSION:
+            if (c == '\r' || c == '\n')
+            {
+                take(req, buf, i, &req->version);
+                if (valid_version(&req->version) == false)
+                    return HTTP_PARSE_ERROR;
+                req->state = c == '\r' ? S_LINE_LF : S_HEADER_START;
+            }
+            else if ((classes[c] & C_VISIBLE) == 0 || i - req->mark >= 8)
+                return HTTP_PARSE_ERROR;
+            break;
+        case S_LINE_LF:
+        case S_HEADER_LF:
+            if (c != '\n')
+                return HTTP_PARSE_ERROR;
+            req->state = S_HEADER_START;
+            break;
+        case S_HEADER_START:
+            if (c == '\r')
+                req->state = S_END_LF;
+            else if (c == '\n')
+                goto DONE;
+            else if ((classes[c] & C_TOKEN) == 0)
+                return HTTP_PARSE_ERROR; /* Also rejects obsolete line folding */
+            else
+            {
+                if (req->num_headers == HTTP_MAX_HEADERS)
+                    return HTTP_PARSE_ERROR;
+                header = &req->headers[req->num_headers];
+                req->mark = i;
+                req->state = S_HEADER_NAME;
+            }
+            break;
+        case S_HEADER_NAME:
+            while (classes[c] & C_TOKEN && i + 1 < len)
+                c = buf[++i];
+            if (c == ':')
+            {
+                take(req, buf, i, &header->name);
+                req->state = S_VALUE_START;
+            }
+            else if ((classes[c] & C_TOKEN) == 0)
+                return HTTP_PARSE_ERROR;
+            break;
+        case S_VALUE_START:
+            if (c == ' ' || c == '\t')
+                break;
+            req->mark = i;
+            req->state = S_VALUE;
+            /* fall through */
+        case S_VALUE:
+            while (classes[c] & C_VALUE && i + 1 < len)
+                c = buf[++i];
+            if (c == '\r' || c == '\n')
+            {
+                size_t end = i;
+                while (end > req->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+                    end--;
+                take(req, buf, end, &header->value);
+                req->num_headers++;
+                req->state = c == '\r' ? S_HEADER_LF : S_HEADER_START;
+            }
+            else if ((classes[c] & C_VALUE) == 0)
+                return HTTP_PARSE_ERROR;
+            break;
+        case S_END_LF:
+            if (c != '\n')
+                return HTTP_PARSE_ERROR;
+            goto DONE;
+        }
+    }
+    req->offset = i;
+    return HTTP_PARSE_AGAIN;
+DONE:
+    req->state = S_DONE;
+    req->offset = req->length = i + 1;
+    return HTTP_PARSE_DONE;
+}
+
+slice_t *http_header(http_request_t *req, const char *name)
+{
+    size_t length = strlen(name);
+    for (int i = 0; i < req->num_headers; i++)
+    {
+        slice_t *n = &req->headers[i].name;
+        if (n->len == length && strncasecmp(n->data, name, length) == 0)
+            return &req->headers[i].value;
+    }
+    return NULL;
+}
+
+int slice_eq(slice_t *s, const char *str)
+{
+    size_t length = strlen(str);
+    return s->len == length && memcmp(s->data, str, length) == 0;
+}
+
+int slice_contains(slice_t *s, const char *str)
+{
+    size_t length = strlen(str);
+    for (size_t i = 0; i + length <= s->len; i++)
+    {
+        if (strncasecmp(s->data + i, str, length) == 0)
+            return 1;
+    }
+    return 0;
+}
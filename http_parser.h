@@ -0,0 +1,86 @@
+#if !defined(HTTP_PARSER_H)
+#define HTTP_PARSER_H
+#include <stddef.h>
+
+/**
+ * http_parser.h
+ *
+ * Incremental HTTP/1.x request parser. It is a byte driven state machine
+ * that can be fed a growing buffer across partial reads, it picks up
+ * where the previous call stopped. The request line and every header are
+ * returned as slices pointing into the caller's buffer: nothing is
+ * copied and nothing is allocated. The buffer must not move while a
+ * request is being parsed and used.
+ */
+
+// most headers a request may carry
+#define HTTP_MAX_HEADERS 48
+
+typedef enum
+{
+	HTTP_PARSE_DONE,  //the header block is complete, length is set
+	HTTP_PARSE_AGAIN, //need more bytes
+	HTTP_PARSE_ERROR  //malformed request
+} http_parse_status;
+
+/**
+ * a piece of the request buffer, not NUL terminated
+ */
+typedef struct slice_st
+{
+	char *data;
+	size_t len;
+} slice_t;
+
+typedef struct http_header_st
+{
+	slice_t name;
+	slice_t value; //without the surrounding white space
+} http_header_t;
+
+/**
+ * parser state and result. reset it with http_reset before the first
+ * call for every new request.
+ */
+typedef struct http_request_st
+{
+	int state;								 //where the state machine stopped
+	size_t offset;							 //bytes of the buffer already consumed
+	size_t mark;							 //start of the token being read
+	slice_t method;
+	slice_t path;
+	slice_t version;
+	http_header_t headers[HTTP_MAX_HEADERS];
+	int num_headers;
+	size_t length; //length of the header block, once done
+	long elapsed;  //nanoseconds spent parsing, added up by the caller
+} http_request_t;
+
+/**
+ * http_reset prepares the state for a new request at the start of the
+ * buffer.
+ */
+void http_reset(http_request_t *req);
+
+/**
+ * http_parse continues parsing buf, of which len bytes are valid.
+ */
+http_parse_status http_parse(http_request_t *req, char *buf, size_t len);
+
+/**
+ * http_header returns the value of the first header called name (case
+ * insensitive), or NULL.
+ */
+slice_t *http_header(http_request_t *req, const char *name);
+
+/**
+ * slice_eq compares a slice with a string, case sensitive.
+ */
+int slice_eq(slice_t *s, const char *str);
+
+/**
+ * slice_contains looks for str in the slice, case insensitive.
+ */
+int slice_contains(slice_t *s, const char *str);
+
+#endif
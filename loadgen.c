@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/* HTTP load generator for the server.
+ * Usage: loadgen gen <dir>
+ *        loadgen run <port> [-c connections] [-n requests] [-d seconds] [-k 0|1] [-p depth] [-s 0|1]
+ * gen writes a document root of small files, large files and a huge
+ * directory. run replays a URL mix over it from concurrent connections on
+ * loopback and prints one "key=value" line, like the bench binary.
+ * requests, the rate and the latencies count the answers the mix expects:
+ * 2xx, 3xx and the 404 of the missing paths. Any other status is an error,
+ * the 503 of a shedding server are also reported on their own as shed. */
+
+typedef enum
+{
+    false,
+    true
+} bool;
+
+#define ERROR -1
+#define SUCCESS 0
+#define READ_BUFF 65536
+#define PATH_BUFF 64
+#define MAX_CONNECTIONS 1024
+#define MAX_PIPELINE 64
+#define CONNECTIONS 16
+#define REQUESTS 10000
+#define SMALL_FILES 200
+#define SMALL_MAX 16384
+#define LARGE_FILES 4
+#define LARGE_SIZE (16 * 1024 * 1024)
+#define HUGE_ENTRIES 20000
+#define MIX_SIZE 100
+#define CONNECT_RETRIES 100
+
+/* What the clients ask for, out of every MIX_SIZE requests */
+#define MIX_SMALL 85
+#define MIX_LARGE 5
+#define MIX_LISTING 5 /* The rest are paths that do not exist */
+
+/* Run options */
+typedef struct options_st
+{
+    int port;
+    int connections;
+    long requests; /* Stop after this many answered requests, */
+    double seconds; /* or after this many seconds when it is set */
+    bool keep_alive;
+    int pipeline; /* Requests written before reading the responses */
+    bool small_only; /* Only the small files of the mix, to measure the request path rather than the copies */
+} options_t;
+
+/* State of one client connection */
+typedef struct client_st
+{
+    pthread_t thread;
+    unsigned int seed;
+    unsigned int *latencies; /* Microseconds of every answered request */
+    long count;
+    long size;
+    long errors; /* Failed connections and reads, and unexpected statuses */
+    long shed;   /* 503 answers, counted in errors too */
+    long bytes;
+} client_t;
+
+static options_t options = {0, CONNECTIONS, REQUESTS, 0, true, 1, false};
+static atomic_long completed;
+static double started;
+
+/* Current monotonic time in seconds */
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write a file of size bytes filled with a repeating pattern */
+static int make_file(const char *path, long size)
+{
+    char chunk[READ_BUFF];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return ERROR;
+    for (int i = 0; i < READ_BUFF; i++)
+        chunk[i] = 'a' + i % 26;
+    while (size > 0)
+    {
+        ssize_t bytes = write(fd, chunk, size < READ_BUFF ? size : READ_BUFF);
+        if (bytes <= 0)
+        {
+            close(fd);
+            return ERROR;
+        }
+        size -= bytes;
+    }
+    return close(fd);
+}
+
+/* The document root the URL mix is made for */
+static int generate(const char *dir)
+{
+    char path[PATH_BUFF + 256];
+    unsigned int seed = 1;
+    const char *subdirs[] = {"", "/small", "/large", "/huge"};
+    for (int i = 0; i < 4; i++)
+    {
+        snprintf(path, sizeof(path), "%s%s", dir, subdirs[i]);
+        if (mkdir(path, 0755) == ERROR && errno != EEXIST)
+            return ERROR;
+    }
+    for (int i = 0; i < SMALL_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "%s/small/f%03d.html", dir, i);
+        if (make_file(path, 128 + rand_r(&seed) % SMALL_MAX) == ERROR)
+            return ERROR;
+    }
+    for (int i = 0; i < LARGE_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "%s/large/l%d.bin", dir, i);
+        if (make_file(path, LARGE_SIZE) == ERROR)
+            return ERROR;
+    }
+    for (int i = 0; i < HUGE_ENTRIES; i++)
+    {
+        snprintf(path, sizeof(path), "%s/huge/entry-%05d.txt", dir, i);
+        if (make_file(path, 0) == ERROR)
+            return ERROR;
+    }
+    printf("loadgen=gen dir=%s small=%d large=%d huge_entries=%d\n", dir, SMALL_FILES, LARGE_FILES, HUGE_ENTRIES);
+    return SUCCESS;
+}
+
+/* Pick the next path of the mix */
+static void pick_url(client_t *c, char *path, size_t size)
+{
+    int r = rand_r(&c->seed) % MIX_SIZE;
+    if (r < MIX_SMALL || options.small_only)
+        snprintf(path, size, "/small/f%03d.html", rand_r(&c->seed) % SMALL_FILES);
+    else if (r < MIX_SMALL + MIX_LARGE)
+        snprintf(path, size, "/large/l%d.bin", rand_r(&c->seed) % LARGE_FILES);
+    else if (r < MIX_SMALL + MIX_LARGE + MIX_LISTING)
+        snprintf(path, size, "/huge/");
+    else
+        snprintf(path, size, "/missing/%d", rand_r(&c->seed));
+}
+
+static int connect_to(int port)
+{
+    struct sockaddr_in server;
+    int fd = socket(PF_INET, SOCK_STREAM, 0), on = 1;
+    if (fd < 0)
+        return ERROR;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0)
+    {
+        close(fd);
+        return ERROR;
+    }
+    return fd;
+}
+
+/* Read more bytes after the len buffered ones, 0 when the server closed */
+static ssize_t fill(int fd, char *buf, size_t *len)
+{
+    ssize_t bytes;
+    if (*len == READ_BUFF)
+        return ERROR;
+    while ((bytes = read(fd, buf + *len, READ_BUFF - *len)) < 0 && errno == EINTR)
+        ;
+    if (bytes > 0)
+        *len += bytes;
+    return bytes;
+}
+
+/* Drop n bytes from the start of the buffer */
+static void consume(char *buf, size_t *len, size_t n)
+{
+    memmove(buf, buf + n, *len - n);
+    *len -= n;
+}
+
+/* Discard n bytes of body, the buffered ones first */
+static int skip(int fd, char *buf, size_t *len, long n)
+{
+    while (n > 0)
+    {
+        if (*len == 0 && fill(fd, buf, len) <= 0)
+            return ERROR;
+        size_t take = (size_t)n < *len ? (size_t)n : *len;
+        consume(buf, len, take);
+        n -= take;
+    }
+    return SUCCESS;
+}
+
+/* Wait until the buffer holds a line, returns its length with the CRLF */
+static long line_length(int fd, char *buf, size_t *len, const char *end)
+{
+    char *found;
+    while ((found = memmem(buf, *len, end, strlen(end))) == NULL)
+    {
+        if (fill(fd, buf, len) <= 0)
+            return ERROR;
+    }
+    return found - buf + strlen(end);
+}
+
+/* Read one response. Returns its size in bytes, or ERROR.
+ * status is set to its status code, closing when the server announced it
+ * closes the connection after it */
+static long read_response(int fd, char *buf, size_t *len, int *status, bool *closing)
+{
+    long header = line_length(fd, buf, len, "\r\n\r\n"), body = 0, total;
+    if (header == ERROR || strncmp(buf, "HTTP/1.", 7) != 0 || header < 13 || buf[8] != ' ')
+        return ERROR;
+    *status = atoi(buf + 9);
+    if (*status < 100 || *status > 599)
+        return ERROR;
+    char saved = buf[header - 1];
+    buf[header - 1] = '\0'; /* The header lookups stop at the end of this header */
+    char *length = strcasestr(buf, "\r\nContent-Length:");
+    bool chunked = strcasestr(buf, "\r\nTransfer-Encoding: chunked") != NULL;
+    *closing = strcasestr(buf, "\r\nConnection: close") != NULL;
+    if (length != NULL)
+        body = atol(length + 17);
+    buf[header - 1] = saved;
+    consume(buf, len, header);
+    total = header + body;
+    if (chunked == false)
+        return skip(fd, buf, len, body) == ERROR ? ERROR : total;
+    while (true) /* Chunk size line, data, CRLF, until the zero chunk */
+    {
+        long line = line_length(fd, buf, len, "\r\n");
+        if (line == ERROR)
+            return ERROR;
+        long size = strtol(buf, NULL, 16);
+        consume(buf, len, line);
+        total += line;
+        if (skip(fd, buf, len, size + 2) == ERROR)
+            return ERROR;
+        total += size + 2;
+        if (size == 0)
+            return total;
+    }
+}
+
+/* Keep going until the request count or the duration is reached */
+static bool more_work()
+{
+    if (options.seconds > 0)
+        return now_sec() - started < options.seconds;
+    return atomic_load(&completed) < options.requests;
+}
+
+static void record(client_t *c, double latency)
+{
+    if (c->count == c->size)
+    {
+        long size = c->size ? c->size * 2 : 1024;
+        unsigned int *grown = realloc(c->latencies, size * sizeof(unsigned int));
+        if (grown == NULL)
+            return;
+        c->latencies = grown;
+        c->size = size;
+    }
+    c->latencies[c->count++] = (unsigned int)(latency * 1e6);
+    atomic_fetch_add(&completed, 1);
+}
+
+/* An answer the mix does not expect, it still counts towards -n so a shedding server ends the run */
+static void record_failure(client_t *c, int status)
+{
+    c->errors++;
+    if (status == 503)
+        c->shed++;
+    atomic_fetch_add(&completed, 1);
+}
+
+/* One connection: write a batch of requests, read the answers, reconnect when the server closes */
+static void *client(void *arg)
+{
+    client_t *c = (client_t *)arg;
+    char buf[READ_BUFF], out[MAX_PIPELINE * 128], path[PATH_BUFF];
+    size_t len = 0;
+    int fd = ERROR;
+    int batch = options.keep_alive ? options.pipeline : 1;
+    while (more_work())
+    {
+        size_t written = 0, size = 0;
+        if (fd == ERROR && (fd = connect_to(options.port)) == ERROR)
+        {
+            if (++c->errors >= CONNECT_RETRIES && c->count == 0) /* Nobody is listening */
+                break;
+            usleep(1000);
+            continue;
+        }
+        for (int i = 0; i < batch; i++)
+        {
+            pick_url(c, path, sizeof(path));
+            size += snprintf(out + size, sizeof(out) - size, "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+                             path, options.keep_alive ? "keep-alive" : "close");
+        }
+        double start = now_sec();
+        while (written < size)
+        {
+            ssize_t bytes = write(fd, out + written, size - written);
+            if (bytes <= 0)
+                break;
+            written += bytes;
+        }
+        bool closing = written < size;
+        for (int i = 0; i < batch && closing == false; i++)
+        {
+            int status = 0;
+            long bytes = read_response(fd, buf, &len, &status, &closing);
+            if (bytes == ERROR)
+            {
+                c->errors++;
+                closing = true;
+                break;
+            }
+            c->bytes += bytes;
+            if (status < 400 || status == 404)
+                record(c, now_sec() - start);
+            else
+                record_failure(c, status);
+        }
+        if (closing || options.keep_alive == false) /* Requests behind a closing response are sent again */
+        {
+            close(fd);
+            fd = ERROR;
+            len = 0;
+        }
+    }
+    if (fd != ERROR)
+        close(fd);
+    return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned int percentile(unsigned int *sorted, long count, double p)
+{
+    if (count == 0)
+        return 0;
+    long at = (long)(p * count);
+    return sorted[at < count ? at : count - 1];
+}
+
+static int run()
+{
+    client_t *clients = calloc(options.connections, sizeof(client_t));
+    long total = 0, errors = 0, shed = 0, bytes = 0;
+    if (clients == NULL)
+        return ERROR;
+    started = now_sec();
+    for (int i = 0; i < options.connections; i++)
+    {
+        clients[i].seed = i + 1;
+        if (pthread_create(&clients[i].thread, NULL, client, &clients[i]) != 0)
+        {
+            options.connections = i;
+            break;
+        }
+    }
+    for (int i = 0; i < options.connections; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        total += clients[i].count;
+    }
+    double elapsed = now_sec() - started;
+    unsigned int *all = malloc((total ? total : 1) * sizeof(unsigned int));
+    if (all == NULL)
+        return ERROR;
+    total = 0;
+    for (int i = 0; i < options.connections; i++)
+    {
+        memcpy(all + total, clients[i].latencies, clients[i].count * sizeof(unsigned int));
+        total += clients[i].count;
+        errors += clients[i].errors;
+        shed += clients[i].shed;
+        bytes += clients[i].bytes;
+        free(clients[i].latencies);
+    }
+    qsort(all, total, sizeof(unsigned int), compare);
+    printf("loadgen=run port=%d connections=%d keep_alive=%d pipeline=%d requests=%ld errors=%ld shed=%ld seconds=%.3f "
+           "requests_per_sec=%.0f mb_per_sec=%.1f p50_us=%u p99_us=%u p999_us=%u max_us=%u\n",
+           options.port, options.connections, options.keep_alive, options.keep_alive ? options.pipeline : 1, total, errors, shed, elapsed,
+           total / elapsed, bytes / elapsed / (1024 * 1024), percentile(all, total, 0.5), percentile(all, total, 0.99),
+           percentile(all, total, 0.999), total ? all[total - 1] : 0);
+    free(all);
+    free(clients);
+    return SUCCESS;
+}
+
+static void usage()
+{
+    printf("Usage: loadgen gen <dir> | loadgen run <port> [-c connections] [-n requests] [-d seconds] [-k 0|1] [-p depth] [-s 0|1]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "gen") == 0)
+        return generate(argv[2]) == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (argc < 3 || argc % 2 == 0 || strcmp(argv[1], "run") != 0 || (options.port = atoi(argv[2])) <= 0)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+    for (int i = 3; i < argc; i += 2)
+    {
+        long value = atol(argv[i + 1]);
+        if (strcmp(argv[i], "-c") == 0 && value > 0 && value <= MAX_CONNECTIONS)
+            options.connections = value;
+        else if (strcmp(argv[i], "-n") == 0 && value > 0)
+            options.requests = value;
+        else if (strcmp(argv[i], "-d") == 0 && atof(argv[i + 1]) > 0)
+            options.seconds = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-k") == 0 && (value == 0 || value == 1))
+            options.keep_alive = value;
+        else if (strcmp(argv[i], "-p") == 0 && value > 0 && value <= MAX_PIPELINE)
+            options.pipeline = value;
+        else if (strcmp(argv[i], "-s") == 0 && (value == 0 || value == 1))
+            options.small_only = value;
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    return run() == ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+}
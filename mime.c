@@ -0,0 +1,270 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mime.h"
+
+#define ERROR -1
+#define SUCCESS 0
+#define SPACES " \t\r"
+
+typedef struct mime_st
+{
+    const char *ext; /* Lower case, without the dot */
+    const char *type;
+} mime_t;
+
+/* Sorted by extension (strcmp order), bsearch depends on it */
+static const mime_t builtin[] = {
+    {"7z", "application/x-7z-compressed"},
+    {"aac", "audio/aac"},
+    {"au", "audio/basic"},
+    {"avi", "video/x-msvideo"},
+    {"bin", "application/octet-stream"},
+    {"bmp", "image/bmp"},
+    {"bz2", "application/x-bzip2"},
+    {"css", "text/css"},
+    {"csv", "text/csv"},
+    {"doc", "application/msword"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"epub", "application/epub+zip"},
+    {"flac", "audio/flac"},
+    {"gif", "image/gif"},
+    {"gz", "application/gzip"},
+    {"htm", "text/html"},
+    {"html", "text/html"},
+    {"ico", "image/x-icon"},
+    {"ics", "text/calendar"},
+    {"jar", "application/java-archive"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "text/javascript"},
+    {"json", "application/json"},
+    {"jsonld", "application/ld+json"},
+    {"m4a", "audio/mp4"},
+    {"m4v", "video/x-m4v"},
+    {"map", "application/json"},
+    {"md", "text/markdown"},
+    {"mid", "audio/midi"},
+    {"midi", "audio/midi"},
+    {"mjs", "text/javascript"},
+    {"mkv", "video/x-matroska"},
+    {"mov", "video/quicktime"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"mpeg", "video/mpeg"},
+    {"mpg", "video/mpeg"},
+    {"oga", "audio/ogg"},
+    {"ogg", "audio/ogg"},
+    {"ogv", "video/ogg"},
+    {"otf", "font/otf"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"rar", "application/vnd.rar"},
+    {"rss", "application/rss+xml"},
+    {"rtf", "application/rtf"},
+    {"sh", "application/x-sh"},
+    {"svg", "image/svg+xml"},
+    {"tar", "application/x-tar"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"ts", "video/mp2t"},
+    {"ttf", "font/ttf"},
+    {"txt", "text/plain"},
+    {"wasm", "application/wasm"},
+    {"wav", "audio/wav"},
+    {"weba", "audio/webm"},
+    {"webm", "video/webm"},
+    {"webmanifest", "application/manifest+json"},
+    {"webp", "image/webp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xhtml", "application/xhtml+xml"},
+    {"xls", "application/vnd.ms-excel"},
+    {"xml", "application/xml"},
+    {"zip", "application/zip"},
+};
+
+static mime_t *loaded = NULL; /* Sorted, the strings point into text */
+static int numLoaded = 0;
+static char *text = NULL;     /* The mime.types file, cut into strings in place */
+static const mime_t **slots = NULL; /* Open addressing index of both tables, built by mime_load */
+static unsigned int mask = 0;
+
+/* FNV-1a of an extension already in lower case */
+static unsigned int hash_ext(const char *ext)
+{
+    unsigned int hash = 2166136261u;
+    while (*ext)
+    {
+        hash ^= (unsigned char)*ext++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int compare(const void *a, const void *b)
+{
+    return strcmp(((const mime_t *)a)->ext, ((const mime_t *)b)->ext);
+}
+
+/* Same extension: the one from the earlier line first, the strings of a line come later in text */
+static int compare_lines(const void *a, const void *b)
+{
+    int res = compare(a, b);
+    if (res != 0)
+        return res;
+    return ((const mime_t *)a)->type < ((const mime_t *)b)->type ? -1 : 1;
+}
+
+/* Read the whole file, NUL terminated */
+static char *read_file(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == ERROR)
+        return NULL;
+    char *data = fstat(fd, &st) == ERROR ? NULL : malloc(st.st_size + 1);
+    off_t sum = 0;
+    while (data != NULL && sum < st.st_size)
+    {
+        ssize_t bytes = read(fd, data + sum, st.st_size - sum);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        sum += bytes;
+    }
+    close(fd);
+    if (data != NULL)
+        data[sum] = '\0';
+    return data;
+}
+
+/* Slot of ext, the empty one where it would go when it is not indexed */
+static const mime_t **find_slot(const char *ext, unsigned int hash)
+{
+    unsigned int i = hash & mask;
+    while (slots[i] != NULL && strcmp(slots[i]->ext, ext) != 0)
+        i = (i + 1) & mask;
+    return &slots[i];
+}
+
+/* Index the loaded table, then the built in extensions it does not have. Half the slots stay empty */
+static int build_index()
+{
+    size_t numBuiltin = sizeof(builtin) / sizeof(builtin[0]), size = 16;
+    while (size < 2 * (numLoaded + numBuiltin))
+        size *= 2;
+    if ((slots = calloc(size, sizeof(mime_t *))) == NULL)
+        return ERROR;
+    mask = size - 1;
+    for (int i = 0; i < numLoaded; i++)
+        *find_slot(loaded[i].ext, hash_ext(loaded[i].ext)) = &loaded[i];
+    for (size_t i = 0; i < numBuiltin; i++)
+    {
+        const mime_t **slot = find_slot(builtin[i].ext, hash_ext(builtin[i].ext));
+        if (*slot == NULL)
+            *slot = &builtin[i];
+    }
+    return SUCCESS;
+}
+
+int mime_load(const char *path)
+{
+    char *data = read_file(path), *line, *saveLine = NULL;
+    int capacity = 0;
+    mime_destroy();
+    if (data == NULL)
+    {
+        build_index(); /* The built in table alone */
+        return ERROR;
+    }
+    text = data;
+    for (line = strtok_r(data, "\n", &saveLine); line != NULL; line = strtok_r(NULL, "\n", &saveLine))
+    {
+        char *saveWord = NULL, *type = strtok_r(line, SPACES, &saveWord), *ext;
+        if (type == NULL || type[0] == '#')
+            continue;
+        while ((ext = strtok_r(NULL, SPACES, &saveWord)) != NULL)
+        {
+            if (numLoaded == capacity)
+            {
+                mime_t *grown = realloc(loaded, (capacity = capacity ? capacity * 2 : 256) * sizeof(mime_t));
+                if (grown == NULL)
+                {
+                    mime_destroy();
+                    build_index();
+                    return ERROR;
+                }
+                loaded = grown;
+            }
+            for (char *c = ext; *c; c++)
+                *c = tolower((unsigned char)*c);
+            loaded[numLoaded].ext = ext;
+            loaded[numLoaded].type = type;
+            numLoaded++;
+        }
+    }
+    qsort(loaded, numLoaded, sizeof(mime_t), compare_lines);
+    int kept = 0;
+    for (int i = 0; i < numLoaded; i++) /* Keep the first type of every extension */
+        if (kept == 0 || strcmp(loaded[kept - 1].ext, loaded[i].ext) != 0)
+            loaded[kept++] = loaded[i];
+    numLoaded = kept;
+    return build_index();
+}
+
+const char *mime_type(const char *name)
+{
+    char ext[MIME_EXT_MAX + 1];
+    const char *dot = strrchr(name, '.'), *slash = strrchr(name, '/');
+    unsigned int hash = 2166136261u;
+    size_t length = 0;
+    if (dot == NULL || (slash != NULL && slash > dot))
+        return NULL;
+    for (dot++; *dot != '\0'; dot++) /* Lower case and hash in one pass */
+    {
+        if (length == MIME_EXT_MAX)
+            return NULL;
+        ext[length] = tolower((unsigned char)*dot);
+        hash ^= (unsigned char)ext[length++];
+        hash *= 16777619u;
+    }
+    ext[length] = '\0';
+    if (slots != NULL)
+    {
+        const mime_t *found = *find_slot(ext, hash);
+        return found != NULL ? found->type : NULL;
+    }
+    mime_t key = {ext, NULL}; /* Nothing loaded, search the built in table */
+    const mime_t *found = bsearch(&key, builtin, sizeof(builtin) / sizeof(builtin[0]), sizeof(mime_t), compare);
+    return found != NULL ? found->type : NULL;
+}
+
+int mime_count()
+{
+    int count = 0;
+    if (slots == NULL)
+        return sizeof(builtin) / sizeof(builtin[0]);
+    for (unsigned int i = 0; i <= mask; i++)
+        count += slots[i] != NULL;
+    return count;
+}
+
+void mime_destroy()
+{
+    free(slots);
+    slots = NULL;
+    mask = 0;
+    free(loaded);
+    free(text);
+    loaded = NULL;
+    text = NULL;
+    numLoaded = 0;
+}
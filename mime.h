@@ -0,0 +1,46 @@
+#if !defined(MIME_H)
+#define MIME_H
+
+/**
+ * mime.h
+ *
+ * File extension to mime type lookup. A built in table sorted by
+ * extension covers the common web types, a mime.types file (the
+ * /etc/mime.types format: a type followed by its extensions) can be
+ * loaded at startup and takes precedence. mime_load indexes both in one
+ * hash table, a lookup lower cases and hashes the extension in one pass
+ * and probes a slot or two. The tables are read only once the server
+ * runs, lookups take no lock.
+ */
+
+// the system table, loaded when it exists
+#define MIME_TYPES_FILE "/etc/mime.types"
+
+// longest extension looked up, longer ones have no type
+#define MIME_EXT_MAX 16
+
+/**
+ * mime_load reads a mime.types file and builds the index. the first
+ * type given to an extension wins. returns 0 on success, -1 if the file
+ * cannot be read, the built in table is indexed alone then. without a
+ * call the built in table is binary searched.
+ */
+int mime_load(const char *path);
+
+/**
+ * mime_type returns the type of a file name from its extension, NULL
+ * when it has none or it is unknown. the string lives until mime_destroy.
+ */
+const char *mime_type(const char *name);
+
+/**
+ * mime_count returns the number of extensions known.
+ */
+int mime_count();
+
+/**
+ * mime_destroy frees the loaded table, no lookup may run anymore.
+ */
+void mime_destroy();
+
+#endif
@@ -0,0 +1,83 @@
+#include <string.h>
+#include "range.h"
+
+#define ERROR -1
+#define UNIT "bytes="
+#define MAX_DIGITS 18 /* Still fits in an off_t */
+
+/* Read a decimal number at *at, returns ERROR when there is none */
+static off_t number(const char *value, size_t len, size_t *at)
+{
+    off_t n = 0;
+    size_t first = *at;
+    while (*at < len && value[*at] >= '0' && value[*at] <= '9')
+    {
+        if (*at - first == MAX_DIGITS)
+            return ERROR;
+        n = n * 10 + (value[*at] - '0');
+        (*at)++;
+    }
+    return *at == first ? ERROR : n;
+}
+
+static void skip_spaces(const char *value, size_t len, size_t *at)
+{
+    while (*at < len && (value[*at] == ' ' || value[*at] == '\t'))
+        (*at)++;
+}
+
+range_status parse_ranges(const char *value, size_t len, off_t size, range_t *ranges, int *count)
+{
+    size_t at = sizeof(UNIT) - 1;
+    int specs = 0;
+    *count = 0;
+    if (len < at || strncmp(value, UNIT, at) != 0)
+        return RANGE_NONE;
+    while (at < len)
+    {
+        off_t first, last = size - 1;
+        skip_spaces(value, len, &at);
+        if (at < len && value[at] == ',') /* Empty list elements are allowed */
+        {
+            at++;
+            continue;
+        }
+        if (++specs > MAX_RANGES)
+            return RANGE_NONE;
+        if (at < len && value[at] == '-') /* The last n bytes */
+        {
+            at++;
+            off_t suffix = number(value, len, &at);
+            if (suffix == ERROR)
+                return RANGE_NONE;
+            first = suffix < size ? size - suffix : 0;
+            if (suffix == 0)
+                first = size; /* Asks for nothing, unsatisfiable */
+        }
+        else
+        {
+            if ((first = number(value, len, &at)) == ERROR || at == len || value[at++] != '-')
+                return RANGE_NONE;
+            if (at < len && value[at] >= '0' && value[at] <= '9')
+            {
+                off_t end = number(value, len, &at);
+                if (end == ERROR || end < first)
+                    return RANGE_NONE;
+                if (end < last)
+                    last = end;
+            }
+        }
+        skip_spaces(value, len, &at);
+        if (at < len && value[at++] != ',')
+            return RANGE_NONE;
+        if (first < size) /* Past the end ranges are left out */
+        {
+            ranges[*count].start = first;
+            ranges[*count].length = last - first + 1;
+            (*count)++;
+        }
+    }
+    if (specs == 0)
+        return RANGE_NONE;
+    return *count == 0 ? RANGE_UNSATISFIABLE : RANGE_OK;
+}
@@ -0,0 +1,42 @@
+#if !defined(RANGE_H)
+#define RANGE_H
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * range.h
+ *
+ * Parsing of the Range request header (RFC 7233), byte ranges only.
+ * "bytes=0-99", "bytes=500-" and the suffix form "bytes=-500" are
+ * resolved against the size of the file into offset and length pairs
+ * that can go straight to sendfile or be cut out of a cached body.
+ */
+
+// most ranges of one request, a longer list is ignored and the whole file sent
+#define MAX_RANGES 16
+
+typedef enum
+{
+	RANGE_NONE,			//no usable Range, answer with the whole file
+	RANGE_OK,			//ranges[0..count) are to be sent
+	RANGE_UNSATISFIABLE //every range starts past the end of the file
+} range_status;
+
+/**
+ * one satisfiable range, clipped to the file
+ */
+typedef struct range_st
+{
+	off_t start;  //first byte
+	off_t length; //bytes from start, at least 1
+} range_t;
+
+/**
+ * parse_ranges reads the Range value of len bytes for a file of size
+ * bytes. ranges that start past the end are dropped, a malformed value
+ * or a unit other than bytes gives RANGE_NONE as the header is then to
+ * be ignored.
+ */
+range_status parse_ranges(const char *value, size_t len, off_t size, range_t *ranges, int *count);
+
+#endif
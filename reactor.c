@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "reactor.h"
+#include "stats.h"
+#include "admission.h"
+
+typedef enum
+{
+    false,
+    true
+} bool;
+#define ERROR -1
+#define MAX_EVENTS 256
+#define LOOP_TIMEOUT 500 /* ms between checks of the stop flag */
+
+/**
+ * one event loop: its epoll set and the connections it still owns.
+ * pending is ordered by activity, most recent first, so idle connections
+ * expire from the tail. lock guards the list against reactor_resume.
+ */
+typedef struct event_loop_st
+{
+    reactor *owner;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int epfd;
+    int listening; /* 1 while the listening socket is in the epoll set */
+    int closed;    /* 1 once the loop stopped taking connections back */
+    conn_t *pending;
+    conn_t *tail;
+} event_loop_t;
+
+static slab_t *conns = NULL; /* Every connection of the process, created on first use and kept */
+static pthread_once_t connsOnce = PTHREAD_ONCE_INIT;
+
+static void create_conns()
+{
+    conns = create_slab(sizeof(conn_t));
+}
+
+/* Seconds on the monotonic clock */
+static time_t now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Set or clear O_NONBLOCK on a descriptor */
+static int set_nonblocking(int fd, bool on)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == ERROR)
+        return ERROR;
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+conn_t *conn_alloc(int fd)
+{
+    pthread_once(&connsOnce, create_conns);
+    conn_t *conn = conns != NULL ? slab_alloc(conns) : malloc(sizeof(conn_t));
+    if (conn == NULL)
+        return NULL;
+    conn->fd = fd;
+    conn->len = 0;
+    conn->served = 0;
+    conn->loop = NULL;
+    conn->ring = NULL;
+    conn->operating = 0;
+    conn->context = NULL;
+    http_reset(&conn->request);
+    arena_init(&conn->arena);
+    conn->buf[0] = '\0';
+    conn->last_active = now_sec();
+    conn->admitted = admission_enter();
+    return conn;
+}
+
+void conn_free(conn_t *conn)
+{
+    admission_leave();
+    arena_free(&conn->arena);
+    if (conns != NULL)
+        slab_free(conns, conn);
+    else
+        free(conn);
+}
+
+/* Put a connection at the head of the pending list, lock held */
+static void link_head(event_loop_t *loop, conn_t *conn)
+{
+    conn->loop = loop;
+    conn->prev = NULL;
+    conn->next = loop->pending;
+    if (loop->pending)
+        loop->pending->prev = conn;
+    else
+        loop->tail = conn;
+    loop->pending = conn;
+}
+
+/* Take a connection out of the pending list, lock held */
+static void unlink_conn(event_loop_t *loop, conn_t *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->pending = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    else
+        loop->tail = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+/* Remove a connection from the loop, without closing it */
+static void detach(event_loop_t *loop, conn_t *conn)
+{
+    pthread_mutex_lock(&loop->lock);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    unlink_conn(loop, conn);
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/* Close a connection that is not waiting for anything anymore, lock held */
+static void drop_locked(event_loop_t *loop, conn_t *conn)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    unlink_conn(loop, conn);
+    close(conn->fd);
+    conn_free(conn);
+}
+
+/* Drop a connection that never completed its request */
+static void drop(event_loop_t *loop, conn_t *conn)
+{
+    pthread_mutex_lock(&loop->lock);
+    drop_locked(loop, conn);
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/* The first bytes of a request arrived: its headers are due idle_timeout from now.
+ * Called once per request, later reads of the same request keep the deadline */
+static void touch(event_loop_t *loop, conn_t *conn)
+{
+    pthread_mutex_lock(&loop->lock);
+    unlink_conn(loop, conn);
+    link_head(loop, conn);
+    conn->last_active = now_sec();
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/* Close the connections idle for too long, and idle keep-alives when draining */
+static void expire(event_loop_t *loop, bool draining)
+{
+    reactor *r = loop->owner;
+    time_t now = now_sec();
+    pthread_mutex_lock(&loop->lock);
+    while (r->idle_timeout > 0 && loop->tail != NULL && now - loop->tail->last_active >= r->idle_timeout)
+        drop_locked(loop, loop->tail);
+    for (conn_t *conn = loop->pending, *next; draining && conn != NULL; conn = next)
+    {
+        next = conn->next;
+        if (conn->len == 0 && conn->served > 0) /* Between requests, a new one still gets its first */
+            drop_locked(loop, conn);
+    }
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/* Accept every pending connection on the listening socket */
+static void accept_all(event_loop_t *loop)
+{
+    reactor *r = loop->owner;
+    while (atomic_load(&r->stop) == 0)
+    {
+        int fd = accept4(r->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == ERROR)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            break;
+        }
+        conn_t *conn = conn_alloc(fd);
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_mutex_lock(&loop->lock);
+        link_head(loop, conn);
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == ERROR)
+        {
+            perror("epoll_ctl");
+            drop_locked(loop, conn);
+        }
+        pthread_mutex_unlock(&loop->lock);
+    }
+}
+
+/* Hand a connection with a complete request to the pool, or run it here */
+static void ready(event_loop_t *loop, conn_t *conn)
+{
+    reactor *r = loop->owner;
+    detach(loop, conn);
+    set_nonblocking(conn->fd, false); /* The handlers write with blocking calls */
+    if (conn->admitted == 0) /* Over the admission cap, turned away here without queueing */
+    {
+        if (r->overload != NULL)
+        {
+            r->overload(conn);
+            return;
+        }
+        close(conn->fd);
+        conn_free(conn);
+        return;
+    }
+    if (r->pool == NULL)
+    {
+        r->handler(conn);
+        return;
+    }
+    if (dispatch(r->pool, r->handler, conn) == ERROR)
+        r->overload(conn);
+}
+
+/* Read whatever the socket has, edge triggered so read until EAGAIN */
+static void read_conn(event_loop_t *loop, conn_t *conn)
+{
+    while (true)
+    {
+        bool started = conn->len > 0; /* Part of the request is in, its deadline runs already */
+        ssize_t bytes = read(conn->fd, conn->buf + conn->len, CONN_BUFF - conn->len);
+        if (bytes > 0)
+        {
+            conn->len += bytes;
+            conn->buf[conn->len] = '\0';
+            long start = stats_now();
+            http_parse_status status = http_parse(&conn->request, conn->buf, conn->len);
+            conn->request.elapsed += stats_now() - start;
+            if (status != HTTP_PARSE_AGAIN || conn->len == CONN_BUFF) /* Complete, malformed or full */
+            {
+                ready(loop, conn);
+                return;
+            }
+            if (started == false)
+                touch(loop, conn);
+            continue;
+        }
+        if (bytes == ERROR && errno == EINTR)
+            continue;
+        if (bytes == ERROR && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        drop(loop, conn); /* Peer closed or read failed */
+        return;
+    }
+}
+
+/* Stop watching the listening socket once the reactor stops accepting */
+static void stop_listening(event_loop_t *loop)
+{
+    if (loop->listening == 0)
+        return;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->owner->listenfd, NULL);
+    loop->listening = 0;
+}
+
+/* The event loop thread */
+static void *event_loop(void *p)
+{
+    event_loop_t *loop = (event_loop_t *)p;
+    reactor *r = loop->owner;
+    struct epoll_event events[MAX_EVENTS];
+    while (true)
+    {
+        int stop = atomic_load(&r->stop);
+        if (stop != 0)
+            stop_listening(loop);
+        expire(loop, stop != 0);
+        pthread_mutex_lock(&loop->lock);
+        if (stop == 2 || (stop == 1 && loop->pending == NULL)) /* Dropped or drained, refuse resumed connections from now on */
+        {
+            loop->closed = 1;
+            pthread_mutex_unlock(&loop->lock);
+            break;
+        }
+        pthread_mutex_unlock(&loop->lock);
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, LOOP_TIMEOUT);
+        if (n == ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            conn_t *conn = (conn_t *)events[i].data.ptr;
+            if (conn == NULL)
+                accept_all(loop);
+            else if (events[i].events & EPOLLERR)
+                drop(loop, conn);
+            else
+                read_conn(loop, conn); /* EPOLLIN, or EPOLLRDHUP with the last bytes still to read */
+        }
+    }
+    while (loop->pending != NULL)
+        drop(loop, loop->pending);
+    return NULL;
+}
+
+void reactor_resume(conn_t *conn)
+{
+    event_loop_t *loop = conn->loop;
+    set_nonblocking(conn->fd, true);
+    pthread_mutex_lock(&loop->lock);
+    if (loop->closed == 1 || atomic_load(&loop->owner->stop) != 0) /* Stopping, do not keep idle connections */
+    {
+        pthread_mutex_unlock(&loop->lock);
+        close(conn->fd);
+        conn_free(conn);
+        return;
+    }
+    conn->last_active = now_sec();
+    link_head(loop, conn);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = conn}; /* Reports data that is already waiting */
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->fd, &ev) == ERROR)
+    {
+        perror("epoll_ctl");
+        unlink_conn(loop, conn);
+        close(conn->fd);
+        conn_free(conn);
+    }
+    pthread_mutex_unlock(&loop->lock);
+}
+
+reactor *create_reactor(int listenfd, int num_loops, threadpool *pool, dispatch_fn handler, dispatch_fn overload, int idle_timeout)
+{
+    if (num_loops <= 0 || num_loops > MAX_EVENT_LOOPS || handler == NULL || (pool != NULL && overload == NULL))
+        return NULL;
+    if (set_nonblocking(listenfd, true) == ERROR)
+        return NULL;
+    reactor *r = (reactor *)malloc(sizeof(reactor));
+    if (r == NULL)
+    {
+        fprintf(stderr, "malloc failed at create reactor <reactor>");
+        return NULL;
+    }
+    r->listenfd = listenfd;
+    r->num_loops = 0;
+    r->pool = pool;
+    r->handler = handler;
+    r->overload = overload;
+    r->idle_timeout = idle_timeout;
+    atomic_init(&r->stop, 0);
+    r->loops = (event_loop_t *)calloc(num_loops, sizeof(event_loop_t));
+    if (r->loops == NULL)
+    {
+        fprintf(stderr, "malloc failed at create reactor <loops>");
+        free(r);
+        return NULL;
+    }
+    for (int i = 0; i < num_loops; i++)
+    {
+        event_loop_t *loop = &r->loops[i];
+        loop->owner = r;
+        loop->pending = loop->tail = NULL;
+        pthread_mutex_init(&loop->lock, NULL);
+        if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == ERROR)
+        {
+            perror("epoll_create1");
+            break;
+        }
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL}; /* Wake one loop per new connection */
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev) == ERROR)
+        {
+            perror("epoll_ctl");
+            close(loop->epfd);
+            break;
+        }
+        loop->listening = 1;
+        if (pthread_create(&loop->thread, NULL, event_loop, loop))
+        {
+            fprintf(stderr, "failed to init event loop");
+            close(loop->epfd);
+            break;
+        }
+        r->num_loops++;
+    }
+    if (r->num_loops != num_loops)
+    {
+        destroy_reactor(r);
+        return NULL;
+    }
+    return r;
+}
+
+void reactor_stop(reactor *r)
+{
+    int running = 0;
+    atomic_compare_exchange_strong(&r->stop, &running, 1); /* The loops see it within LOOP_TIMEOUT */
+}
+
+void reactor_wait(reactor *r)
+{
+    if (r == NULL)
+        return;
+    for (int i = 0; i < r->num_loops; i++)
+    {
+        if (r->loops[i].epfd != ERROR)
+        {
+            pthread_join(r->loops[i].thread, NULL);
+            close(r->loops[i].epfd);
+            r->loops[i].epfd = ERROR;
+        }
+    }
+}
+
+void destroy_reactor(reactor *r)
+{
+    if (r == NULL)
+        return;
+    atomic_store(&r->stop, 2);
+    reactor_wait(r);
+    for (int i = 0; i < r->num_loops; i++)
+        pthread_mutex_destroy(&r->loops[i].lock);
+    free(r->loops);
+    free(r);
+}
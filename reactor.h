@@ -0,0 +1,118 @@
+#if !defined(REACTOR_H)
+#define REACTOR_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <time.h>
+#include "threadpool.h"
+#include "http_parser.h"
+#include "arena.h"
+
+/**
+ * reactor.h
+ *
+ * Event driven connection engine. A reactor runs one or more event
+ * loops, each one a thread with its own edge-triggered epoll set. The
+ * loops accept connections from a shared non-blocking listening socket,
+ * read the request headers incrementally without blocking any thread,
+ * and hand only complete requests to the threadpool (or run the handler
+ * inline when the reactor has no pool).
+ */
+
+// maximum number of event loops in a reactor
+#define MAX_EVENT_LOOPS 64
+
+// size of the per connection request buffer
+#define CONN_BUFF 4000
+
+/**
+ * a client connection, owned by one event loop until its request headers
+ * are complete, then by the handler it was dispatched to. a keep-alive
+ * connection goes back to the same loop with reactor_resume, keeping
+ * whatever pipelined bytes are left in buf. buf is always NUL terminated.
+ * connections come from a slab, see conn_alloc.
+ */
+typedef struct conn_st
+{
+	int fd;						//client socket
+	size_t len;					//bytes read into buf
+	int served;					//requests answered on this connection
+	int admitted;				//0 when it came in over the admission cap, answered 503 once its request is read
+	time_t last_active;			//accept or resume, then the first bytes of the request: the idle timeout runs from there
+	struct event_loop_st *loop; //the loop that owns the connection
+	struct ring_st *ring;		//or the io_uring ring, see uring.h
+	struct conn_st *prev;		//pending connections of the owning loop
+	struct conn_st *next;
+	int operating;				//io_uring: an operation of the handler is in flight instead of the recv
+	void *context;				//io_uring: what the handler keeps across its operations
+	http_request_t request;	 //parser state of the request in buf
+	arena_t arena;			 //memory of the request being answered, reset after each one
+	char buf[CONN_BUFF + 1]; //request bytes read so far
+} conn_t;
+
+/**
+ * conn_alloc takes a connection from the per thread slab and sets it up
+ * for the socket fd, NULL when out of memory. it is counted by the
+ * admission control (admission.h) until conn_free. conn_free closes
+ * nothing, it frees the arena and gives the connection back, from any
+ * thread.
+ */
+conn_t *conn_alloc(int fd);
+void conn_free(conn_t *conn);
+
+/**
+ * The reactor
+ */
+typedef struct _reactor_st
+{
+	int listenfd;		   //shared listening socket, non-blocking
+	int num_loops;		   //number of event loops
+	struct event_loop_st *loops; //event loop threads
+	threadpool *pool;	   //where ready requests are dispatched, NULL to run inline
+	dispatch_fn handler;   //called with a conn_t * when its headers are complete
+	dispatch_fn overload;  //called with a conn_t * when the pool rejects it or it is over the admission cap
+	int idle_timeout;	   //seconds a connection may wait in a loop, 0 for no limit
+	atomic_int stop;	   //1 stop accepting and drain, 2 drop pending connections
+} reactor;
+
+/**
+ * create_reactor builds a reactor over an already bound and listening
+ * socket and starts its event loops. the socket is switched to
+ * non-blocking mode. handler and overload own the conn_t they get: they
+ * must either close conn->fd and free the conn, or give it back with
+ * reactor_resume. a connection that sends nothing for idle_timeout
+ * seconds is closed, and so is one whose request headers are not
+ * complete idle_timeout seconds after their first byte, however often
+ * it sends a part of them. returns NULL on failure.
+ */
+reactor *create_reactor(int listenfd, int num_loops, threadpool *pool, dispatch_fn handler, dispatch_fn overload, int idle_timeout);
+
+/**
+ * reactor_resume gives a connection back to its event loop, to wait for
+ * the next request. safe to call from any thread. if the reactor is
+ * stopping the connection is closed and freed instead.
+ */
+void reactor_resume(conn_t *conn);
+
+/**
+ * reactor_stop drains the reactor, safe to call from any thread: the
+ * loops stop accepting (the listening socket is left open), the requests
+ * already read are answered, idle keep-alives are closed and new
+ * connections get their first request. reactor_wait returns once every
+ * loop is empty.
+ */
+void reactor_stop(reactor *r);
+
+/**
+ * reactor_wait blocks until the reactor was stopped and every loop has
+ * exited. the reactor accepts for as long as it is not stopped.
+ */
+void reactor_wait(reactor *r);
+
+/**
+ * destroy_reactor stops the event loops, closes the connections that
+ * are still waiting for their headers and frees the reactor.
+ */
+void destroy_reactor(reactor *r);
+
+#endif
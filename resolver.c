@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "resolver.h"
+
+#define ERROR -1
+
+/* Map a failed open or stat to the response */
+static resolve_status from_errno(int error)
+{
+    if (error == ENOENT || error == ENOTDIR || error == ENAMETOOLONG || error == ELOOP)
+        return RESOLVE_NOT_FOUND;
+    if (error == EACCES || error == EPERM)
+        return RESOLVE_FORBIDDEN;
+    return RESOLVE_ERROR;
+}
+
+/* Reject ".." components so a request cannot climb out of the root */
+static int escapes_root(const char *name)
+{
+    for (const char *part = name; *part != '\0';)
+    {
+        size_t length = strcspn(part, "/");
+        if (length == 2 && part[0] == '.' && part[1] == '.')
+            return 1;
+        part += length;
+        while (*part == '/')
+            part++;
+    }
+    return 0;
+}
+
+/* Close what the resolution opened and end it with status */
+static resolve_status fail(resolved_t *res, resolve_status status)
+{
+    close(res->fd);
+    res->fd = ERROR;
+    return status;
+}
+
+/* Every parent directory of the target must be searchable by others: stat the next one, then open the target */
+static resolve_status next_call(resolve_walk_t *walk)
+{
+    char *name = walk->res->name;
+    for (size_t i = walk->next; i < walk->last; i++)
+    {
+        if (name[i] != '/' || i == 0 || name[i - 1] == '/')
+            continue;
+        name[i] = '\0';
+        walk->cut = i;
+        walk->next = i + 1;
+        walk->call = RESOLVE_CALL_STAT;
+        walk->dirfd = walk->rootfd;
+        walk->path = name;
+        return RESOLVE_AGAIN;
+    }
+    walk->next = walk->last;
+    walk->cut = walk->end;
+    name[walk->end] = '\0';
+    walk->call = RESOLVE_CALL_OPEN;
+    walk->dirfd = walk->rootfd;
+    walk->path = walk->end > 0 ? name : ".";
+    return RESOLVE_AGAIN;
+}
+
+int open_root(const char *path)
+{
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+resolve_status resolve_begin(resolve_walk_t *walk, int rootfd, const char *path, resolved_t *res)
+{
+    res->fd = ERROR;
+    while (*path == '/')
+        path++;
+    size_t length = strlen(path);
+    if (length >= RESOLVE_PATH_MAX - sizeof(INDEX_FILE))
+        return RESOLVE_NOT_FOUND;
+    if (escapes_root(path))
+        return RESOLVE_FORBIDDEN;
+    memcpy(res->name, path, length + 1);
+    walk->res = res;
+    walk->rootfd = rootfd;
+    walk->index = 0;
+    walk->next = 0;
+    walk->slash = length > 0 && res->name[length - 1] == '/';
+    walk->end = length;
+    while (walk->end > 0 && res->name[walk->end - 1] == '/')
+        walk->end--;
+    walk->last = walk->end; /* Start of the last component */
+    while (walk->last > 0 && res->name[walk->last - 1] != '/')
+        walk->last--;
+    return next_call(walk);
+}
+
+resolve_status resolve_step(resolve_walk_t *walk, int result, const struct stat *st)
+{
+    resolved_t *res = walk->res;
+    if (walk->call == RESOLVE_CALL_STAT) /* A parent directory */
+    {
+        res->name[walk->cut] = '/';
+        if (result < 0)
+            return from_errno(-result);
+        if (!S_ISDIR(st->st_mode))
+            return RESOLVE_NOT_FOUND;
+        if ((st->st_mode & S_IXOTH) == 0)
+            return RESOLVE_FORBIDDEN;
+        return next_call(walk);
+    }
+    if (walk->index == 0) /* The target */
+    {
+        if (walk->slash)
+            res->name[walk->end] = '/';
+        if (result < 0)
+            return from_errno(-result);
+        res->fd = result;
+        res->st = *st;
+        if (S_ISREG(res->st.st_mode))
+            return walk->slash ? fail(res, RESOLVE_NOT_FOUND) : RESOLVE_FILE; /* "file.html/" */
+        if (!S_ISDIR(res->st.st_mode))
+            return fail(res, RESOLVE_FORBIDDEN);
+        if (walk->slash == 0 && walk->end > 0)
+            return fail(res, RESOLVE_REDIRECT);
+        if ((res->st.st_mode & S_IXOTH) == 0)
+            return fail(res, RESOLVE_FORBIDDEN);
+        walk->index = 1;
+        walk->dirfd = res->fd;
+        walk->path = INDEX_FILE;
+        return RESOLVE_AGAIN;
+    }
+    if (result < 0) /* No index, list the directory */
+    {
+        resolve_status status = from_errno(-result);
+        return status == RESOLVE_NOT_FOUND ? RESOLVE_DIRECTORY : fail(res, status);
+    }
+    if (!S_ISREG(st->st_mode))
+    {
+        close(result);
+        return RESOLVE_DIRECTORY;
+    }
+    close(res->fd);
+    res->fd = result;
+    res->st = *st;
+    strcat(res->name, INDEX_FILE);
+    return RESOLVE_FILE;
+}
+
+resolve_status resolve_path(int rootfd, const char *path, resolved_t *res)
+{
+    resolve_walk_t walk;
+    struct stat st;
+    resolve_status status = resolve_begin(&walk, rootfd, path, res);
+    while (status == RESOLVE_AGAIN)
+    {
+        int result;
+        if (walk.call == RESOLVE_CALL_STAT)
+            result = fstatat(walk.dirfd, walk.path, &st, 0) == ERROR ? -errno : 0;
+        else if ((result = openat(walk.dirfd, walk.path, RESOLVE_OPEN_FLAGS)) == ERROR)
+            result = -errno;
+        else if (fstat(result, &st) == ERROR)
+        {
+            int error = errno;
+            close(result);
+            result = -error;
+        }
+        status = resolve_step(&walk, result, &st);
+    }
+    return status;
+}
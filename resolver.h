@@ -0,0 +1,107 @@
+#if !defined(RESOLVER_H)
+#define RESOLVER_H
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * resolver.h
+ *
+ * Maps a request path to an open file below the document root in one
+ * pass. Every directory on the way must have the execute bit for others,
+ * the target must be readable, a directory is served through its
+ * index.html when it has one. The work is done with fstatat/openat
+ * relative to a root directory descriptor opened once at startup, so a
+ * file request costs an openat and an fstat (plus one fstatat per parent
+ * directory) and the descriptor goes straight to the send path.
+ */
+
+// longest path the resolver accepts
+#define RESOLVE_PATH_MAX 4096
+
+// the file served for a directory that has it
+#define INDEX_FILE "index.html"
+
+// flags of every open of the resolver, never block on a fifo
+#define RESOLVE_OPEN_FLAGS (O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK)
+
+typedef enum
+{
+	RESOLVE_FILE,	   //fd is a readable regular file
+	RESOLVE_DIRECTORY, //fd is a directory without an index file, to be listed
+	RESOLVE_REDIRECT,  //a directory asked for without the trailing slash
+	RESOLVE_NOT_FOUND, //no such path
+	RESOLVE_FORBIDDEN, //no permission, not a regular file or escaping the root
+	RESOLVE_ERROR,	   //system error
+	RESOLVE_AGAIN	   //resolve_begin and resolve_step only: the caller makes walk->call next
+} resolve_status;
+
+/**
+ * the system call a resolution driven by its caller waits for
+ */
+typedef enum
+{
+	RESOLVE_CALL_STAT, //fstatat(dirfd, path) of a parent directory
+	RESOLVE_CALL_OPEN  //openat(dirfd, path, RESOLVE_OPEN_FLAGS), then fstat of the descriptor
+} resolve_call;
+
+/**
+ * result of a resolution. fd is only open for RESOLVE_FILE and
+ * RESOLVE_DIRECTORY, the caller closes it.
+ */
+typedef struct resolved_st
+{
+	int fd;						 //open target
+	struct stat st;				 //its stat
+	char name[RESOLVE_PATH_MAX]; //target relative to the root, index file included
+} resolved_t;
+
+/**
+ * a resolve_path whose system calls are made by the caller, for an
+ * engine that submits them instead (the io_uring one). resolve_begin
+ * starts it, then as long as the status is RESOLVE_AGAIN the caller
+ * makes walk->call and hands its result to resolve_step: 0 for a stat,
+ * the new descriptor for an open, -errno when the call failed (the
+ * caller closes a descriptor whose fstat failed). res ends up as
+ * resolve_path fills it, it is the same resolution.
+ */
+typedef struct resolve_walk_st
+{
+	resolved_t *res;   //the result being built
+	resolve_call call; //the call to make next
+	int dirfd;		   //directory the call is relative to
+	const char *path;  //name to stat or open, cut out of res->name
+	int rootfd;		   //the document root
+	size_t end;		   //end of the target in res->name, trailing slashes excluded
+	size_t last;	   //start of its last component
+	size_t next;	   //where the search for the next parent directory goes on
+	size_t cut;		   //where the name was cut for the call
+	int slash;		   //the path ends with a slash
+	int index;		   //1 while the index file of a directory is opened
+} resolve_walk_t;
+
+/**
+ * open_root opens the document root for resolve_path, -1 on failure.
+ */
+int open_root(const char *path);
+
+/**
+ * resolve_path resolves a request path ("/a/b.html", "/dir/", "/")
+ * against the root descriptor and fills res.
+ */
+resolve_status resolve_path(int rootfd, const char *path, resolved_t *res);
+
+/**
+ * resolve_begin starts the resolution of path for a caller that makes
+ * the system calls, see resolve_walk_t.
+ */
+resolve_status resolve_begin(resolve_walk_t *walk, int rootfd, const char *path, resolved_t *res);
+
+/**
+ * resolve_step takes the result of walk->call, st is the stat it got
+ * (unused when it failed). returns RESOLVE_AGAIN with the next call, or
+ * how the resolution ended.
+ */
+resolve_status resolve_step(resolve_walk_t *walk, int result, const struct stat *st);
+
+#endif
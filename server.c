@@ -1,5 +1,9 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <stdatomic.h>
 #include <assert.h>
+#include <stdint.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -14,7 +18,30 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <setjmp.h>
 #include "threadpool.h"
+#include "reactor.h"
+#include "uring.h"
+#include "cache.h"
+#include "buffer.h"
+#include "resolver.h"
+#include "http_parser.h"
+#include "headers.h"
+#include "writer.h"
+#include "stats.h"
+#include "range.h"
+#include "encoding.h"
+#include "mime.h"
+#include "arena.h"
+#include "admission.h"
+#include "handoff.h"
 
 /* DEFINES */
 
@@ -24,117 +51,221 @@ typedef enum
     true
 } bool;
 
-#define NO_PERMISSON -403
 #define ERROR -1
 #define TIME_BUFF 128
-#define HTML_BUFF 300
-#define PATH_MAX 4096
-#define ENTITY_LINE 600
+#define CONTENT_BUFF 128
+#define VALIDATORS_BUFF 160
+#define ETAG_BUFF 96
+#define BOUNDARY_BUFF 20
 #define SUCCESS 0
 #define FILE 1
 #define DIRECTORY 2
-#define ALLOC_ERROR -2
 #define BUFF 4000
 #define LOCATION_BUFF 20
+#define QUEUE_SIZE 1024 /* Requests waiting for a thread before new ones get a 503 */
+#define BACKLOG 511     /* Connections the kernel holds before they are accepted */
+#define QUEUE_WAIT 5    /* Milliseconds a request may wait for a thread before the pool grows */
+#define IDLE_WORKER 10  /* Seconds a thread added on load may stay idle before it retires */
+#define RETRY_AFTER "Retry-After: 1\r\n" /* Sent with every 503, seconds to wait */
+#define CHUNK_SIZE 65536
+#define KEEPALIVE_TIMEOUT 5 /* Seconds a persistent connection may stay idle */
+#define KEEPALIVE_MAX 100   /* Requests served on one connection before closing it */
+#define CACHE_SIZE 64 /* Megabytes of small files kept in memory */
+#define MMAP_LIMIT 1024 /* Kilobytes up to which a cached file is mapped instead of copied */
+#define MMAP_MIN 16384  /* Smaller files are copied, a mapping takes whole pages and one of the limited VMAs */
+#define MAX_LISTENERS 64
+#define RING_IOV 64          /* Memory segments of a response sent with one sendmsg by the io_uring engine */
+#define RING_PIPE (1 << 20)  /* Bytes of a file the io_uring engine moves through its pipe at once */
 #define SERVER_PROTOCOL "webserver/1.1"
-#define SERVER_HTTP "HTTP/1.1"
+#define STATS_PATH "/__stats"
+#define ADMISSION_PATH "/__admission"
 #define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
-
-#define HTTP_HEADER             \
-    "%s %s\r\n"                 \
-    "Server: %s\r\n"            \
-    "Date: %s\r\n"              \
-    "Content-Type: %s\r\n"      \
-    "Content-Length: %ld\r\n"   \
-    "Connection: close\r\n\r\n" \
-    "%s"
-
-#define HTML_PAGE                    \
-    "<HTML>"                         \
-    "<HEAD><TITLE>%s</TITLE></HEAD>" \
-    "<BODY><H4>%s</H4>"              \
-    "%s."                            \
-    "</BODY>"                        \
-    "</HTML>"
+#define CHUNKED_LISTING "Content-Type: text/html\r\nTransfer-Encoding: chunked\r\nLast-Modified: "
 
 #define DIR_CONTENT_TEMPLATE
 
+/* A piece of a response the io_uring engine sends: length bytes at data, or of the file fd from offset */
+typedef struct segment_st
+{
+    const char *data; /* NULL for a file segment */
+    int fd;
+    off_t offset;
+    size_t length;
+    bool owned; /* data is a copy in the request arena, more bytes can be appended */
+} segment_t;
+
+/* A response collected whole before the ring sends it. The header lines are copied into the request arena,
+ * a body in memory is sent from the cache entry it belongs to and a file body from its descriptor */
+typedef struct output_st
+{
+    segment_t *segments;
+    int count, capacity;
+    bool borrowed;        /* A segment points into the body of a cache entry */
+    cache_entry_t *entry; /* That entry, held until the response is sent */
+    int file;             /* Descriptor the file segments send from, closed once sent, ERROR for none */
+} output_t;
+
+/* A request being answered on a client connection */
+typedef struct request_st
+{
+    int fd;               /* Client socket */
+    http_request_t *http; /* The parsed request line and headers */
+    bool keep_alive;      /* Keep the connection open after the response */
+    bool http11;          /* The client speaks HTTP/1.1 (chunked bodies allowed) */
+    bool started;         /* Part of the response went out, a failure can only close the connection */
+    http_status status;   /* Status of the response, for the metrics */
+    size_t sent;          /* Bytes of the response written so far */
+    long resolve;         /* Nanoseconds spent resolving the path */
+    arena_t *arena;       /* Scratch memory of the request, reset once it is answered */
+    output_t *output;     /* io_uring: the response is collected here and sent by the ring, NULL to write it at once */
+    bool resolving;       /* io_uring: the path is left for the ring to resolve */
+} request_t;
+
+/* A listening socket with the workers that answer its connections */
+typedef struct listener_st
+{
+    int fd;             /* Listening socket, SO_REUSEPORT when there are several */
+    threadpool *pool;   /* Workers of this listener only */
+    pthread_t thread;   /* Runs accept_loop */
+} listener_t;
+
 /* END DEFINES */
 
-/* Wrinting to the socket */
-int write_to_socket(int sock, char *msg, size_t length)
+int keepAliveTimeout = KEEPALIVE_TIMEOUT, keepAliveMax = KEEPALIVE_MAX;
+cache_t *fileCache = NULL; /* NULL when the cache is disabled */
+int rootFd = ERROR;        /* The document root, every path is resolved below it */
+off_t mmapLimit = MMAP_LIMIT * 1024L; /* Cached files up to this size are mmap'ed, 0 copies them all */
+__thread sigjmp_buf *busGuard = NULL; /* Set while this thread reads a mapped body itself */
+listener_t listeners[MAX_LISTENERS];
+int numListeners = 1;
+int drainFd = ERROR;   /* eventfd, readable for good once the server drains */
+atomic_int draining;   /* 1 once the server stopped accepting */
+pthread_mutex_t engineLock = PTHREAD_MUTEX_INITIALIZER; /* Guards the engine the drain has to stop */
+reactor *activeReactor = NULL;
+uring *activeUring = NULL;
+char exePath[PATH_MAX]; /* The binary started by SIGUSR2, the one at the path the server was run with */
+char **serverArgv;
+
+/* Usage message */
+void usage_message()
+{
+    printf("Usage: server <port> <pool-size> <max-number-of-request> [-e <event-loops> | -u <rings> | -l <listeners>] [-k <keep-alive-seconds>] [-r <requests-per-connection>] [-c <cache-megabytes>] [-M <mmap-kilobytes>] [-m <mime.types>] [-a <max-connections>] [-q <queue-depth>] [-b <backlog>] [-T <max-pool-size>] [-W <queue-wait-ms>]\n");
+}
+
+/* One more segment at the end of the collected response, NULL when out of memory */
+segment_t *add_segment(request_t *req)
 {
-    int bytes = 0, sum = 0;
-    while (true)
+    output_t *output = req->output;
+    if (output->count == output->capacity)
     {
-        bytes = write(sock, msg, length);
-        sum += bytes;
-        if (sum == strlen(msg))
-            break;
-        if (bytes < 0)
-        {
-            perror("write");
-            return ERROR;
-        }
+        int capacity = output->capacity > 0 ? output->capacity * 2 : 8;
+        segment_t *segments = arena_grow(req->arena, output->segments, output->capacity * sizeof(segment_t), capacity * sizeof(segment_t));
+        if (segments == NULL)
+            return NULL;
+        output->segments = segments;
+        output->capacity = capacity;
     }
-    return sum;
+    segment_t *segment = &output->segments[output->count++];
+    memset(segment, 0, sizeof(segment_t));
+    segment->fd = ERROR;
+    return segment;
 }
 
-/* Usage message */
-void usage_message()
+/* Copy what the iovecs hold to the end of the collected response, appended to the last copy when it is one */
+int collect(request_t *req, struct iovec *iov, int count)
 {
-    printf("Usage: server <port> <pool-size> <max-number-of-request>\n");
+    output_t *output = req->output;
+    segment_t *last = output->count > 0 ? &output->segments[output->count - 1] : NULL;
+    size_t length = 0, old = 0;
+    for (int i = 0; i < count; i++)
+        length += iov[i].iov_len;
+    if (length == 0)
+        return SUCCESS;
+    if (last != NULL && last->owned)
+        old = last->length;
+    else if ((last = add_segment(req)) == NULL)
+        return ERROR;
+    char *data = arena_grow(req->arena, (void *)last->data, old, old + length); /* In place while nothing came in between */
+    if (data == NULL)
+        return ERROR;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(data + old, iov[i].iov_base, iov[i].iov_len);
+        old += iov[i].iov_len;
+    }
+    last->data = data;
+    last->length = old;
+    last->owned = true;
+    return SUCCESS;
 }
 
-char *make_302(const char *title, const char *path, const char *http)
+/* Done with a cache entry, the collected response keeps it while it sends from its body */
+void release_entry(request_t *req, cache_entry_t *entry)
 {
-    char timebuf[TIME_BUFF];
-    char *html = (char *)malloc(HTML_BUFF + strlen(path) + 1);
-    if (!html)
-        return NULL;
-    time_t now = time(NULL);
-    int length = 0;
-    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
-    length = snprintf(html, HTML_BUFF + strlen(path), "%s %s\r\n"
-                                                      "Server: %s\r\n"
-                                                      "Date: %s\r\n"
-                                                      "%s%s\\\r\n"
-                                                      "Content-Type: %s; charset=utf-8\r\n"
-                                                      "Content-Length: %ld\r\n"
-                                                      "Connection: close\r\n\r\n"
-                                                      "%s",
-                      SERVER_HTTP, title, SERVER_PROTOCOL, timebuf, "Location: /", path, "text/html", strlen(http), http);
-    html[length] = '\0';
-    return html;
-}
-
-void *regular_reponse(const char *title, const char *http)
+    if (req->output != NULL && req->output->borrowed && req->output->entry == NULL)
+        req->output->entry = entry;
+    else
+        cache_release(entry);
+}
+
+/* Done with a descriptor, the collected response keeps it while it sends from it */
+void release_file(request_t *req, int fd)
 {
-    char timebuf[TIME_BUFF];
-    char *html = (char *)malloc(HTML_BUFF + 1);
-    if (!html)
-        return NULL;
-    time_t now = time(NULL);
-    int length = 0;
-    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
-    length = snprintf(html, HTML_BUFF, HTTP_HEADER, SERVER_HTTP, title, SERVER_PROTOCOL, timebuf, "text/html", strlen(http), http);
-    html[length] = '\0';
-    return html;
+    if (req->output == NULL || req->output->file != fd)
+        close(fd);
+}
+
+/* Send a response built in memory and account it to the request */
+int send_segments(request_t *req, header_t *h, http_status status)
+{
+    req->status = status;
+    req->started = true;
+    if (req->output != NULL) /* Counted in sent as the ring sends it */
+        return collect(req, h->iov, h->count);
+    ssize_t bytes = write_segments(req->fd, h->iov, h->count);
+    if (bytes == ERROR)
+        return ERROR;
+    req->sent += bytes;
+    return SUCCESS;
 }
 
-/* Handle all the other HTTP response */
-void server_response(int socket, const char *title, const char *body, char *path)
+/* Handle all the other HTTP response, the page of the status is prebuilt.
+ * path is the Location of a redirect, the client is sent to path + "/" */
+void server_response(request_t *req, http_status status, char *path)
 {
-    char http[HTML_BUFF], *response;
-    snprintf(http, sizeof(http), HTML_PAGE, title, title, body);
+    header_t h;
+    if (status_keeps_connection(status) == false)
+        req->keep_alive = false; /* After a bad request or a server error the connection state is unknown */
+    header_start(&h, status);
     if (strlen(path) > 0)
-        response = make_302(title, path, http);
+    {
+        header_add(&h, "Location: ", 10);
+        header_add(&h, path, strlen(path));
+        header_add(&h, "/\r\n", 3);
+    }
+    if (status == HTTP_503) /* Overloaded, tell the client when to come back */
+        header_add(&h, RETRY_AFTER, sizeof(RETRY_AFTER) - 1);
+    header_page(&h, status, req->keep_alive);
+    send_segments(req, &h, status);
+}
+
+/* Answer a request that failed with 500, unless part of its response is already out:
+ * a second status line would land in the middle of that body, so the connection is closed */
+void server_error(request_t *req)
+{
+    if (req->started)
+        req->keep_alive = false;
     else
-        response = regular_reponse(title, http);
-    if (!response)
-        return;
-    write_to_socket(socket, response, strlen(response));
-    free(response);
+        server_response(req, HTTP_500, "");
+}
+
+/* A mapped file was truncated under a reader: back to its guard, anywhere else crash as usual */
+void on_sigbus(int sig)
+{
+    if (busGuard != NULL)
+        siglongjmp(*busGuard, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
 /* Convert string to int */
@@ -151,526 +282,1469 @@ int get_int(char *argv)
     return num;
 }
 
-/* Get the mime type of a file */
-char *get_mime_type(char *name)
+/* Get date and time */
+char *get_time(time_t t, char *str, int size)
 {
-    char *ext = strrchr(name, '.');
-    if (!ext)
-        return NULL;
-    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
-        return "text/html";
-    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
-        return "image/jpeg";
-    if (strcmp(ext, ".gif") == 0)
-        return "image/gif";
-    if (strcmp(ext, ".png") == 0)
-        return "image/png";
-    if (strcmp(ext, ".css") == 0)
-        return "text/css";
-    if (strcmp(ext, ".au") == 0)
-        return "audio/basic";
-    if (strcmp(ext, ".wav") == 0)
-        return "audio/wav";
-    if (strcmp(ext, ".avi") == 0)
-        return "video/x-msvideo";
-    if (strcmp(ext, ".mpeg") == 0 || strcmp(ext, ".mpg") == 0)
-        return "video/mpeg";
-    if (strcmp(ext, ".mp3") == 0)
-        return "audio/mpeg";
-    return NULL;
+    struct tm temp;
+    strftime(str, size, RFC1123FMT, gmtime_r(&t, &temp));
+    return str;
 }
 
-/* Checking for Directory */
-bool is_directory(const char *path)
+/* Header lines that only depend on the file, shared by every response for it */
+char *content_headers(char *buf, size_t size, const char *mime, off_t length)
 {
-    struct stat stats;
-    stat(path, &stats);
-    if (S_ISDIR(stats.st_mode) && S_IXOTH)
-        return true;
-    return false;
+    if (mime == NULL)
+        snprintf(buf, size, "Content-Length: %ld\r\n", length);
+    else
+        snprintf(buf, size, "Content-Type: %s\r\n"
+                            "Content-Length: %ld\r\n",
+                 mime, length);
+    return buf;
 }
 
-/* Checking for file */
-bool is_file(const char *path)
+/* Strong entity tag of a file version, it changes with the inode, the size or the mtime */
+char *get_etag(struct stat *st, char *buf, size_t size)
 {
-    struct stat stats;
-    stat(path, &stats);
-    if (S_ISREG(stats.st_mode))
-        return true;
-    return false;
+    snprintf(buf, size, "\"%lx-%lx-%lx.%lx\"", (unsigned long)st->st_ino, (unsigned long)st->st_size,
+             (unsigned long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec);
+    return buf;
 }
 
-/* Checking for path existent */
-bool is_exist(const char *path)
+/* ETag and Last-Modified lines of a file version */
+char *validators(char *buf, size_t size, const char *etag, struct stat *st)
 {
-    struct stat st;
-    if (stat(path, &st) == -1)
-        return false;
-    return true;
+    char modified[TIME_BUFF];
+    snprintf(buf, size, "ETag: %s\r\nLast-Modified: %s\r\n", etag, get_time(st->st_mtime, modified, TIME_BUFF));
+    return buf;
 }
 
-/* Get the size of the file using lseek */
-off_t get_size(int file)
+/* If-None-Match is "*" or a list of entity tags, compared weakly (a W/ prefix is ignored) */
+bool etag_matches(slice_t *list, const char *etag)
 {
-    off_t currentPos = lseek(file, (size_t)0, SEEK_CUR);
-    off_t length = lseek(file, (size_t)0, SEEK_END);
-    if (currentPos == (off_t)-1 || length == (off_t)-1)
+    size_t at = 0, length = strlen(etag);
+    while (at < list->len)
     {
-        close(file);
-        return (off_t)ERROR;
+        while (at < list->len && (list->data[at] == ' ' || list->data[at] == '\t' || list->data[at] == ','))
+            at++;
+        size_t end = at;
+        while (end < list->len && list->data[end] != ',')
+            end++;
+        size_t last = end;
+        while (last > at && (list->data[last - 1] == ' ' || list->data[last - 1] == '\t'))
+            last--;
+        if (last - at == 1 && list->data[at] == '*')
+            return true;
+        if (last - at > 2 && strncmp(list->data + at, "W/", 2) == 0)
+            at += 2;
+        if (last - at == length && strncmp(list->data + at, etag, length) == 0)
+            return true;
+        at = end;
     }
-    if (lseek(file, currentPos, SEEK_SET) == -1)
+    return false;
+}
+
+/* The client already has this version: If-None-Match names it, or without one If-Modified-Since is not older */
+bool not_modified(request_t *req, struct stat *st, const char *etag)
+{
+    char since[TIME_BUFF];
+    struct tm tm;
+    slice_t *match = http_header(req->http, "If-None-Match");
+    if (match != NULL)
+        return etag_matches(match, etag);
+    slice_t *modified = http_header(req->http, "If-Modified-Since");
+    if (modified == NULL || modified->len >= TIME_BUFF)
+        return false;
+    memcpy(since, modified->data, modified->len);
+    since[modified->len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(since, RFC1123FMT, &tm) == NULL)
+        return false; /* Not a date we know, send the file */
+    time_t date = timegm(&tm);
+    if (date > time(NULL))
+        return false; /* A date in the future is invalid (RFC 9110 13.1.3), ignore it */
+    return st->st_mtime <= date;
+}
+
+/* The codings the client takes for a body of this mime type */
+int client_encodings(request_t *req, const char *mime)
+{
+    slice_t *accept = http_header(req->http, "Accept-Encoding");
+    if (accept == NULL || compressible(mime) == false)
+        return 0;
+    return accepted_encodings(accept->data, accept->len);
+}
+
+/* Lines a compressed body adds to the header, caches must keep one copy per coding */
+char *encoding_headers(char *buf, size_t size, content_encoding encoding, bool vary)
+{
+    if (encoding != ENCODING_IDENTITY)
+        snprintf(buf, size, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", encoding_name(encoding));
+    else
+        snprintf(buf, size, "%s", vary ? "Vary: Accept-Encoding\r\n" : "");
+    return buf;
+}
+
+/* The compressed form of a cached body, built by the first request that takes it and kept with the entry.
+ * tags are the lines of the header after Content-Encoding, NULL when compression does not pay */
+cache_variant_t *encoded_variant(cache_entry_t *entry, content_encoding encoding, const char *tags)
+{
+    char header[CONTENT_BUFF + VALIDATORS_BUFF];
+    size_t encodedLength = 0, length;
+    cache_variant_t *variant = cache_variant(entry, encoding - ENCODING_GZIP);
+    if (variant == NULL)
     {
-        close(file);
-        return (off_t)ERROR;
+        sigjmp_buf guard;
+        encoder_t encoder = {.state = NULL, .out = NULL};
+        if (entry->mapped && sigsetjmp(guard, 1) != 0) /* Truncated while compressing, the entry is stale now. Free what the encoder held */
+        {
+            busGuard = NULL;
+            encoder_release(&encoder);
+            return NULL;
+        }
+        busGuard = entry->mapped ? &guard : NULL; /* The kernel copies for writev fail with EFAULT instead, only user space reads need it */
+        char *body = encode_body(&encoder, encoding, entry->body, entry->length, &encodedLength);
+        busGuard = NULL;
+        length = strlen(content_headers(header, CONTENT_BUFF, entry->mime, encodedLength));
+        length += strlen(encoding_headers(header + length, sizeof(header) - length, encoding, true));
+        snprintf(header + length, sizeof(header) - length, "%s", tags);
+        variant = cache_attach(fileCache, entry, encoding - ENCODING_GZIP, body, encodedLength, header); /* An empty one remembers it does not pay */
     }
-    return length;
+    return variant != NULL && variant->body != NULL ? variant : NULL;
 }
 
-/* Get date and time */
-char *get_time(time_t t, char *str, int size)
+/* Open the precompressed sibling (name.br, name.gz) of the best coding the client takes that has one.
+ * The codings the cache entry of name knows to have none are not looked up, the ones found
+ * missing now are added to *unencoded (a bit per variant index) for the caller to remember */
+content_encoding precompressed(const char *name, int accepted, cache_entry_t *entry, int *unencoded, resolved_t *sibling)
 {
-    struct tm temp;
-    strftime(str, size, RFC1123FMT, gmtime_r(&t, &temp));
-    return str;
+    char path[RESOLVE_PATH_MAX];
+    content_encoding encoding;
+    int known = entry != NULL ? atomic_load_explicit(&entry->unencoded, memory_order_relaxed) : 0;
+    *unencoded = 0;
+    while ((encoding = preferred_encoding(accepted)) != ENCODING_IDENTITY)
+    {
+        int bit = 1 << (encoding - ENCODING_GZIP);
+        accepted &= ~(1 << encoding);
+        if (known & bit) /* Looked up while the file had this version, nothing there */
+            continue;
+        if (snprintf(path, sizeof(path), "/%s%s", name, encoding_suffix(encoding)) >= (int)sizeof(path))
+            continue;
+        resolve_status status = resolve_path(rootFd, path, sibling);
+        if (status == RESOLVE_FILE)
+            return encoding;
+        if (status == RESOLVE_DIRECTORY)
+            close(sibling->fd);
+        *unencoded |= bit;
+    }
+    return ENCODING_IDENTITY;
 }
 
-/* Secure open directory */
-DIR *opendir_s(const char *path)
+/* Copy a file into memory */
+char *read_body(int filefd, off_t size)
 {
-    DIR *directory;
-    if (strcmp(path, "/") == 0)
+    ssize_t bytes;
+    off_t sum = 0;
+    char *body = malloc(size + 1);
+    if (body == NULL)
+        return NULL;
+    while (sum < size)
     {
-        if ((directory = opendir("./")) == NULL)
+        bytes = pread(filefd, body + sum, size - sum, sum);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0) /* Error, or the file was truncated under us */
         {
-            perror("opendir");
+            free(body);
             return NULL;
         }
+        sum += bytes;
     }
-    else
+    return body;
+}
+
+/* Bring a small file into memory and add it to the file cache, the entry keeps its mime type.
+ * From MMAP_MIN to mmapLimit the file is mapped: no copy, the pages are the page cache ones shared by every request */
+cache_entry_t *load_file(int filefd, char *name, const char *mime, struct stat *st)
+{
+    char content[CONTENT_BUFF + VALIDATORS_BUFF], etag[ETAG_BUFF];
+    char *body = NULL;
+    bool mapped = false;
+    if (st->st_size >= MMAP_MIN && st->st_size <= mmapLimit)
+    {
+        body = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, filefd, 0);
+        mapped = body != MAP_FAILED;
+    }
+    if (mapped == false && (body = read_body(filefd, st->st_size)) == NULL)
+        return NULL;
+    size_t length = strlen(content_headers(content, CONTENT_BUFF, mime, st->st_size));
+    length += strlen(encoding_headers(content + length, sizeof(content) - length, ENCODING_IDENTITY, compressible(mime)));
+    validators(content + length, sizeof(content) - length, get_etag(st, etag, sizeof(etag)), st); /* Valid as long as the entry is */
+    return cache_put(fileCache, name, st, body, st->st_size, mapped, content, mime);
+}
+
+/* Send what h holds followed by length bytes of the body from offset, then empty h.
+ * The bytes are cut out of body when it is in memory, sendfile sends them from filefd otherwise */
+int send_with_body(request_t *req, header_t *h, http_status status, const char *body, int filefd, off_t offset, off_t length)
+{
+    int res;
+    if (req->output != NULL)
     {
-        if ((directory = opendir(path)) == NULL)
+        segment_t *segment = NULL;
+        req->status = status;
+        req->started = true;
+        res = collect(req, h->iov, h->count) == ERROR || (segment = add_segment(req)) == NULL ? ERROR : SUCCESS;
+        if (segment != NULL && body != NULL) /* Not copied, sent from the cache entry */
         {
-            perror("opendir");
-            return NULL;
+            segment->data = body + offset;
+            req->output->borrowed = true;
+        }
+        else if (segment != NULL)
+        {
+            segment->fd = filefd;
+            segment->offset = offset;
+            req->output->file = filefd;
         }
+        if (segment != NULL)
+            segment->length = length;
     }
-    return directory;
+    else if (body != NULL)
+    {
+        header_add(h, body + offset, length);
+        res = send_segments(req, h, status);
+    }
+    else
+    {
+        req->status = status;
+        req->started = true;
+        if ((res = write_file(req->fd, h->iov, h->count, filefd, offset, length)) != ERROR)
+            req->sent += h->length + length;
+    }
+    h->count = 0;
+    h->length = 0;
+    return res;
+}
+
+/* The ranges of the Range header to answer with, the whole body when If-Range names another version */
+range_status requested_ranges(request_t *req, struct stat *st, off_t size, const char *etag, range_t *ranges, int *count)
+{
+    char modified[TIME_BUFF];
+    slice_t *range = http_header(req->http, "Range");
+    if (range == NULL)
+        return RANGE_NONE;
+    slice_t *ifRange = http_header(req->http, "If-Range");
+    if (ifRange != NULL && slice_eq(ifRange, etag) == false && slice_eq(ifRange, get_time(st->st_mtime, modified, TIME_BUFF)) == false)
+        return RANGE_NONE;
+    return parse_ranges(range->data, range->len, size, ranges, count);
 }
 
-/* Secure open file */
-int open_s(char *file)
+/* 206 with one range, or a multipart/byteranges body with a part per range.
+ * The ranges are of the body that is sent (compressed or not) of size bytes */
+int send_ranges(request_t *req, const char *body, off_t size, const char *mime, const char *tags, int filefd, range_t *ranges, int count)
 {
-    int filefd;
-    if (file[0] == '/')
-        ++file;
-    if ((filefd = open(file, O_RDONLY)) == ERROR)
+    char content[CONTENT_BUFF], contentRange[CONTENT_BUFF], boundary[BOUNDARY_BUFF];
+    char parts[MAX_RANGES][CONTENT_BUFF * 2];
+    int partLength[MAX_RANGES];
+    off_t length = 0;
+    header_t h;
+    header_start(&h, HTTP_206);
+    if (count == 1)
     {
-        perror("open");
-        return ERROR;
+        header_add(&h, content, strlen(content_headers(content, sizeof(content), mime, ranges[0].length)));
+        header_add(&h, contentRange, snprintf(contentRange, sizeof(contentRange), "Content-Range: bytes %ld-%ld/%ld\r\n", ranges[0].start, ranges[0].start + ranges[0].length - 1, size));
+        header_add(&h, tags, strlen(tags));
+        header_add(&h, "Accept-Ranges: bytes\r\n", 22);
+        header_end(&h, req->keep_alive);
+        return send_with_body(req, &h, HTTP_206, body, filefd, ranges[0].start, ranges[0].length);
+    }
+    snprintf(boundary, sizeof(boundary), "%016lx", (unsigned long)stats_now() ^ (unsigned long)size);
+    for (int i = 0; i < count; i++) /* Every part header up front, the Content-Length covers them all */
+    {
+        partLength[i] = snprintf(parts[i], sizeof(parts[i]), "\r\n--%s\r\n%s%s%sContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                                 boundary, mime ? "Content-Type: " : "", mime ? mime : "", mime ? "\r\n" : "",
+                                 ranges[i].start, ranges[i].start + ranges[i].length - 1, size);
+        length += partLength[i] + ranges[i].length;
+    }
+    int closeLength = snprintf(contentRange, sizeof(contentRange), "\r\n--%s--\r\n", boundary);
+    header_add(&h, content, snprintf(content, sizeof(content), "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                                                               "Content-Length: %ld\r\n",
+                                     boundary, length + closeLength));
+    header_add(&h, tags, strlen(tags));
+    header_add(&h, "Accept-Ranges: bytes\r\n", 22);
+    header_end(&h, req->keep_alive);
+    for (int i = 0; i < count; i++) /* The first part leaves with the header */
+    {
+        header_add(&h, parts[i], partLength[i]);
+        if (send_with_body(req, &h, HTTP_206, body, filefd, ranges[i].start, ranges[i].length) == ERROR)
+            return ERROR;
     }
-    return filefd;
+    header_add(&h, contentRange, closeLength);
+    return send_segments(req, &h, HTTP_206);
 }
 
-/* Check for file permission */
-bool file_permission(char *file)
+/* 416 with the size of the body, no range of the request is inside it */
+int range_not_satisfiable(request_t *req, off_t size)
 {
-    if (file[0] == '/')
-        ++file;
-    int fileFd;
-    if ((fileFd = open(file, O_RDONLY)) >= 0)
+    char contentRange[CONTENT_BUFF];
+    header_t h;
+    header_start(&h, HTTP_416);
+    header_add(&h, contentRange, snprintf(contentRange, sizeof(contentRange), "Content-Range: bytes */%ld\r\n", size));
+    header_page(&h, HTTP_416, req->keep_alive);
+    return send_segments(req, &h, HTTP_416);
+}
+
+/* 304 with the validators and no body */
+int send_not_modified(request_t *req, const char *tags)
+{
+    header_t h;
+    header_start(&h, HTTP_304);
+    header_add(&h, tags, strlen(tags));
+    header_end(&h, req->keep_alive);
+    return send_segments(req, &h, HTTP_304);
+}
+
+/* Transfer file via socket, filefd and st come from the path resolver.
+ * A cached file goes out with its header in one writev, any other one with sendfile.
+ * A client that takes compression gets the precompressed sibling (name.br, name.gz) when there is one,
+ * or else the compressed copy kept with the cache entry.
+ * A Range request gets only the bytes it asks for, from the same sources,
+ * a conditional request for the version the client has gets a 304 */
+int send_file_via_socket(request_t *req, char *name, int filefd, struct stat *st)
+{
+    int res, count;
+    char content[CONTENT_BUFF], etag[ETAG_BUFF], tags[CONTENT_BUFF + VALIDATORS_BUFF];
+    cache_entry_t *entry = cache_get(fileCache, name, st);
+    const char *mime = entry != NULL ? entry->mime : mime_type(name); /* Looked up once per cached file */
+    int accepted = client_encodings(req, mime);
+    content_encoding encoding = ENCODING_IDENTITY;
+    cache_variant_t *variant = NULL;
+    resolved_t sibling;
+    range_t ranges[MAX_RANGES];
+    header_t h;
+    int unencoded = 0;
+    if (accepted != 0 && (encoding = precompressed(name, accepted, entry, &unencoded, &sibling)) != ENCODING_IDENTITY)
     {
-        close(fileFd);
-        return true;
+        if (entry != NULL && unencoded != 0)
+            atomic_fetch_or(&entry->unencoded, unencoded);
+        cache_release(entry);
+        entry = NULL;
+        filefd = sibling.fd; /* Sent from the disk like any big file, compressed once ahead of time */
+        st = &sibling.st;
     }
-    close(fileFd);
-    return false;
+    else if (entry == NULL && fileCache != NULL && st->st_size <= CACHE_MAX_ENTRY)
+        entry = load_file(filefd, name, mime, st);
+    if (encoding == ENCODING_IDENTITY && entry != NULL && unencoded != 0) /* Remembered until the file changes and the entry with it */
+        atomic_fetch_or(&entry->unencoded, unencoded);
+    get_etag(st, etag, sizeof(etag));
+    size_t length = strlen(encoding_headers(tags, sizeof(tags), encoding, compressible(mime)));
+    validators(tags + length, sizeof(tags) - length, etag, st);
+    if (entry != NULL && accepted != 0)
+    {
+        char encodedTags[VALIDATORS_BUFF];
+        encoding = preferred_encoding(accepted);
+        snprintf(etag + strlen(etag) - 1, sizeof(etag) - strlen(etag) + 1, "-%s\"", encoding_name(encoding)); /* One strong tag per coding */
+        if ((variant = encoded_variant(entry, encoding, validators(encodedTags, sizeof(encodedTags), etag, st))) != NULL)
+        {
+            length = strlen(encoding_headers(tags, sizeof(tags), encoding, true));
+            snprintf(tags + length, sizeof(tags) - length, "%s", encodedTags);
+        }
+        else /* Does not shrink, the identity body and tag */
+        {
+            encoding = ENCODING_IDENTITY;
+            get_etag(st, etag, sizeof(etag));
+        }
+    }
+    const char *body = variant != NULL ? variant->body : entry != NULL ? entry->body : NULL;
+    off_t size = variant != NULL ? (off_t)variant->length : st->st_size;
+    if (not_modified(req, st, etag))
+        res = send_not_modified(req, tags);
+    else
+        switch (requested_ranges(req, st, size, etag, ranges, &count))
+        {
+        case RANGE_OK:
+            res = send_ranges(req, body, size, mime, tags, filefd, ranges, count);
+            break;
+        case RANGE_UNSATISFIABLE:
+            res = range_not_satisfiable(req, size);
+            break;
+        default:
+            header_start(&h, HTTP_200);
+            if (variant != NULL) /* The cached header lines carry the validators */
+                header_add(&h, variant->header, variant->header_length);
+            else if (entry != NULL)
+                header_add(&h, entry->header, entry->header_length);
+            else
+            {
+                header_add(&h, content, strlen(content_headers(content, sizeof(content), mime, size)));
+                header_add(&h, tags, strlen(tags));
+            }
+            header_add(&h, "Accept-Ranges: bytes\r\n", 22);
+            header_end(&h, req->keep_alive);
+            res = send_with_body(req, &h, HTTP_200, body, filefd, 0, size);
+        }
+    release_entry(req, entry);
+    if (st == &sibling.st)
+        release_file(req, sibling.fd);
+    return res == ERROR ? ERROR : SUCCESS;
 }
 
-/* Checking for execution bit */
-bool dir_permission(char *path)
+/* Add directory item to the HTML */
+int set_list(buffer_t *contents, int dirfd, char *fileName)
 {
-    struct stat st;
-    if (stat(path, &st) == ERROR)
+    struct stat sd;
+    char timebuf[TIME_BUFF];
+    if (fstatat(dirfd, fileName, &sd, 0) == ERROR) /* Relative to the open directory, no path to build */
+        return SUCCESS;                              /* Vanished or dangling entry, leave it out */
+    get_time(sd.st_mtime, timebuf, TIME_BUFF);
+    if (S_ISDIR(sd.st_mode))
+        return buffer_printf(contents, "<tr><td><A HREF=\"%s\">%s/</A></td><td>%s</td><td></td></tr>", fileName, fileName, timebuf);
+    if (S_ISREG(sd.st_mode))
+        return buffer_printf(contents, "<tr><td><A HREF=\"%s\">%s</A></td><td>%s</td><td>%ld bytes</td></tr>", fileName, fileName, timebuf, sd.st_size);
+    return SUCCESS;
+}
+
+/* Send the part of the listing that was not sent yet as one HTTP chunk, behind what h holds.
+ * The first chunk leaves with the header, the last one with the terminating chunk */
+int flush_chunk(request_t *req, header_t *h, buffer_t *contents, size_t *sent, bool last)
+{
+    char size[LOCATION_BUFF];
+    if (contents->len > *sent)
+    {
+        header_add(h, size, snprintf(size, sizeof(size), "%lx\r\n", contents->len - *sent));
+        header_add(h, contents->data + *sent, contents->len - *sent);
+        header_add(h, "\r\n", 2);
+    }
+    if (last)
+        header_add(h, "0\r\n\r\n", 5);
+    if (send_segments(req, h, HTTP_200) == ERROR)
         return ERROR;
-    int execBit = st.st_mode & S_IXOTH;
-    if (execBit == 1)
-        return true;
-    return false;
+    h->count = 0; /* Whatever follows is a bare chunk */
+    h->length = 0;
+    *sent = contents->len;
+    return SUCCESS;
 }
 
-/* Transfer file via socket */
-int send_file_via_socket(int newfd, char *file)
+/* Build the file list of directory in one readdir pass.
+ * When streaming, h holds the header and the HTML goes out in chunks while the directory is still being read */
+int get_dir_content(request_t *req, header_t *h, char *path, DIR *directory, buffer_t *contents, bool streaming)
 {
-    int filefd, bytes, textLength;
-    char response[HTML_BUFF], timebuf[TIME_BUFF];
-    memset(response, 0, HTML_BUFF);
-    memset(timebuf, 0, TIME_BUFF);
-    if ((filefd = open_s(file)) == ERROR)
+    struct dirent *entry = NULL;
+    size_t sent = 0;
+    if (buffer_printf(contents, "<HTML>"
+                                "<HEAD><TITLE>Index of %s</TITLE></HEAD>"
+                                "<BODY>"
+                                "<H4>Index of %s</H4>"
+                                "<table CELLSPACING=8>"
+                                "<tr>"
+                                "<th>Name</th><th>Last Modified</th><th>Size</th>",
+                      path, path) == ERROR)
         return ERROR;
-    off_t length = get_size(filefd);
-    if (length == ERROR)
+    while ((entry = readdir(directory)) != NULL)
     {
-        close(filefd);
-        return ERROR;
+        if (set_list(contents, dirfd(directory), entry->d_name) == ERROR)
+            return ERROR;
+        if (streaming && contents->len - sent >= CHUNK_SIZE && flush_chunk(req, h, contents, &sent, false) == ERROR)
+            return ERROR;
     }
-    time_t now = time(NULL);
-    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
-    char *mime = get_mime_type(file);
-    if (mime == NULL)
+    if (buffer_printf(contents, "</table><HR><ADDRESS>webserver/1.1</ADDRESS></BODY></HTML>") == ERROR)
+        return ERROR;
+    if (streaming && flush_chunk(req, h, contents, &sent, true) == ERROR)
+        return ERROR;
+    return SUCCESS;
+}
+
+/* Send a listing kept in the cache, compressed when the client takes it */
+int send_listing(request_t *req, cache_entry_t *listing, int accepted, const char *modified)
+{
+    char tags[VALIDATORS_BUFF];
+    cache_variant_t *variant = NULL;
+    header_t h;
+    if (accepted != 0)
     {
-        textLength = snprintf(response, sizeof(response), "%s %s\r\n"
-                                                          "Server: %s\r\n"
-                                                          "Date: %s\r\n"
-                                                          "Content-Length: %ld\r\n"
-                                                          "Connection: close\r\n\r\n"
-                                                          "%s",
-                              SERVER_HTTP, "200 OK", SERVER_PROTOCOL, timebuf, length, "");
+        snprintf(tags, sizeof(tags), "Last-Modified: %s\r\n", modified);
+        variant = encoded_variant(listing, preferred_encoding(accepted), tags);
     }
+    header_start(&h, HTTP_200);
+    if (variant != NULL)
+        header_add(&h, variant->header, variant->header_length);
     else
+        header_add(&h, listing->header, listing->header_length);
+    header_end(&h, req->keep_alive);
+    if (variant != NULL)
+        return send_with_body(req, &h, HTTP_200, variant->body, ERROR, 0, variant->length);
+    return send_with_body(req, &h, HTTP_200, listing->body, ERROR, 0, listing->length);
+}
+
+/* Getting all the files within a directory, dirFd and st come from the path resolver */
+int dir_content(char *path, request_t *req, int dirFd, struct stat *dirStat)
+{
+    struct stat st = *dirStat;
+    char modified[TIME_BUFF], content[CONTENT_BUFF];
+    header_t h;
+    int accepted = fileCache != NULL ? client_encodings(req, "text/html") : 0; /* A compressed listing is built whole and kept */
+    bool streaming = req->http11 && accepted == 0;
+    get_time(st.st_mtime, modified, TIME_BUFF);
+    cache_entry_t *cached = cache_get(fileCache, path, &st); /* Same listing while the directory mtime does not move */
+    if (cached != NULL) /* Before fdopendir, which allocates the directory stream */
     {
-        textLength = snprintf(response, sizeof(response), HTTP_HEADER, SERVER_HTTP, "200 OK", SERVER_PROTOCOL, timebuf, mime, length, "");
-    }  
-    if (write_to_socket(newfd, response, textLength) == ERROR)
+        close(dirFd);
+        int res = send_listing(req, cached, accepted, modified);
+        release_entry(req, cached);
+        return res == ERROR ? ERROR : !ERROR;
+    }
+    DIR *directory = fdopendir(dirFd);
+    if (directory == NULL)
+    {
+        perror("fdopendir");
+        close(dirFd);
         return ERROR;
-    char *indexHtml = malloc(length * sizeof(char) + 1);
-    if (indexHtml == NULL)
+    }
+    buffer_t contents;
+    buffer_init_arena(&contents, req->arena); /* Copied to the heap only when the cache keeps it */
+    if (streaming) /* Stream the listing, the first bytes leave before the whole directory is read */
+    {
+        header_start(&h, HTTP_200);
+        header_add(&h, CHUNKED_LISTING, sizeof(CHUNKED_LISTING) - 1);
+        header_add(&h, modified, strlen(modified));
+        header_add(&h, "\r\nVary: Accept-Encoding\r\n", 25);
+        header_end(&h, req->keep_alive); /* Sent with the first chunk */
+    }
+    int res = get_dir_content(req, &h, path, directory, &contents, streaming);
+    closedir(directory);
+    if (res == ERROR)
     {
-        close(filefd);
+        buffer_free(&contents);
         return ERROR;
     }
-    indexHtml[length] = '\0';
-    while ((bytes = read(filefd, indexHtml, length)) > 0)
+    content_headers(content, sizeof(content), "text/html", contents.len);
+    snprintf(content + strlen(content), sizeof(content) - strlen(content), "Last-Modified: %s\r\nVary: Accept-Encoding\r\n", modified);
+    if (streaming == false && accepted == 0) /* HTTP/1.0 has no chunks, send it whole */
     {
-        if (write_to_socket(newfd, indexHtml, length) == ERROR)
+        header_start(&h, HTTP_200);
+        header_add(&h, content, strlen(content));
+        header_end(&h, req->keep_alive);
+        header_add(&h, contents.data, contents.len);
+        if (send_segments(req, &h, HTTP_200) == ERROR)
         {
-            perror("write");
-            free(indexHtml);
-            close(filefd);
+            buffer_free(&contents);
             return ERROR;
         }
     }
-    free(indexHtml);
-    close(filefd);
+    size_t length = contents.len;
+    if (fileCache == NULL)
+    {
+        buffer_free(&contents);
+        return res == ERROR ? ERROR : !ERROR;
+    }
+    cached = cache_put(fileCache, path, &st, buffer_detach(&contents), length, false, content, "text/html");
+    if (accepted != 0) /* Not sent yet, compressed from the entry */
+        res = cached != NULL ? send_listing(req, cached, accepted, modified) : ERROR;
+    release_entry(req, cached);
+    return res == ERROR ? ERROR : !ERROR;
+}
+
+/* Answer a request whose path resolved to status and res */
+void answer_resolved(request_t *req, char *path, resolve_status status, resolved_t *res)
+{
+    int sent = SUCCESS;
+    switch (status)
+    {
+    case RESOLVE_NOT_FOUND: /* Return error -> 404 not found */
+        server_response(req, HTTP_404, "");
+        break;
+    case RESOLVE_FORBIDDEN: /* No exec permission on the way, no read permission, or not a regular file */
+        server_response(req, HTTP_403, "");
+        break;
+    case RESOLVE_REDIRECT:
+        server_response(req, HTTP_302, path);
+        break;
+    case RESOLVE_ERROR:
+    case RESOLVE_AGAIN:
+        server_response(req, HTTP_500, "");
+        break;
+    case RESOLVE_FILE: /* A file, or the index.html within the folder */
+        sent = send_file_via_socket(req, res->name, res->fd, &res->st);
+        release_file(req, res->fd);
+        break;
+    case RESOLVE_DIRECTORY: /* Return the content dir, dir_content owns the descriptor */
+        sent = dir_content(path[1] != '\0' ? path + 1 : path, req, res->fd, &res->st);
+        break;
+    }
+    if (sent == ERROR)
+        server_error(req);
+}
+
+/* Handle all the path proccess logic */
+int path_proccesor(char *path, request_t *req)
+{
+    resolved_t res;
+    if (req->output != NULL) /* The ring submits the calls of the resolution, then answers it */
+    {
+        req->resolving = true;
+        return SUCCESS;
+    }
+    long start = stats_now();
+    resolve_status status = resolve_path(rootFd, path, &res);
+    req->resolve = stats_now() - start;
+    answer_resolved(req, path, status, &res);
     return SUCCESS;
 }
 
-/* Add directory item to the HTML */
-int set_list(char **contents, char *path, char *fileName)
+/* HTTP/1.1 keeps the connection by default, HTTP/1.0 only when asked to */
+bool wants_keep_alive(http_request_t *http)
 {
-    struct stat sd;
-    char fileSize[TIME_BUFF], entity[ENTITY_LINE];
-    memset(fileSize, 0, TIME_BUFF);
-    memset(entity, 0, ENTITY_LINE);
-    if (stat(path, &sd) == ERROR)
+    slice_t *connection = http_header(http, "Connection");
+    if (connection != NULL)
+    {
+        if (slice_contains(connection, "close"))
+            return false;
+        if (slice_contains(connection, "keep-alive"))
+            return true;
+    }
+    return slice_eq(&http->version, "HTTP/1.1");
+}
+
+/* The metrics, as text at STATS_PATH or as JSON at STATS_PATH?format=json */
+int stats_page(request_t *req, char *path)
+{
+    char content[CONTENT_BUFF];
+    header_t h;
+    buffer_t report;
+    bool json = strcmp(path, STATS_PATH "?format=json") == 0;
+    if (json == false && strcmp(path, STATS_PATH) != 0)
     {
-        perror("stat");
+        server_response(req, HTTP_404, "");
+        return SUCCESS;
+    }
+    pool_stats_t pools = {0}, pool;
+    for (int i = 0; i < numListeners; i++) /* The pools of every listener, as one */
+    {
+        if (listeners[i].pool == NULL)
+            continue;
+        threadpool_stats(listeners[i].pool, &pool);
+        pools.threads += pool.threads;
+        pools.idle += pool.idle;
+        pools.min_threads += pool.min_threads;
+        pools.max_threads += pool.max_threads;
+        pools.queued += pool.queued;
+        pools.grown += pool.grown;
+        pools.retired += pool.retired;
+    }
+    buffer_init_arena(&report, req->arena);
+    if (stats_report(&report, fileCache, &pools, json) == ERROR)
+    {
+        buffer_free(&report);
         return ERROR;
     }
-    snprintf(fileSize, sizeof(fileSize), "%ld bytes", sd.st_size);
-    if (S_ISDIR(sd.st_mode))
-        snprintf(entity, ENTITY_LINE, "<tr><td><A HREF=\"%s\">%s/</A></td><td>%s</td><td>%s</td></tr>", fileName, fileName, ctime(&sd.st_mtime), "");
-    else if (S_ISREG(sd.st_mode))
-        snprintf(entity, ENTITY_LINE, "<tr><td><A HREF=\"%s\">%s</A></td><td>%s</td><td>%s</td></tr>", fileName, fileName, ctime(&sd.st_mtime), fileSize);
-    strcat(*contents, entity);
-    return SUCCESS;
+    header_start(&h, HTTP_200);
+    header_add(&h, content, strlen(content_headers(content, sizeof(content), json ? "application/json" : "text/plain", report.len)));
+    header_add(&h, "Cache-Control: no-store\r\n", 25);
+    header_end(&h, req->keep_alive);
+    header_add(&h, report.data, report.len);
+    int res = send_segments(req, &h, HTTP_200);
+    buffer_free(&report);
+    return res;
 }
 
-/* Get the file list of directory */
-char *get_dir_content(char *path, DIR *directory)
+/* The peer of the socket is this host */
+bool from_loopback(int fd)
 {
-    int length = 0, counter = 0;
-    struct dirent *entry = NULL;
-    char *contents;
-    while ((entry = readdir(directory)) != NULL) /* Count the number of entities */
-        counter++;
-    length = (ENTITY_LINE * counter + HTML_BUFF + strlen(path) + 1);
-    contents = malloc(length);
-    if (contents == NULL)
-        return NULL;
-    memset(contents, 0, length);
-    snprintf(contents, HTML_BUFF, "<HTML>"
-                                  "<HEAD><TITLE>Index of %s</TITLE></HEAD>"
-                                  "<BODY>"
-                                  "<H4>Index of %s</H4>"
-                                  "<table CELLSPACING=8>"
-                                  "<tr>"
-                                  "<th>Name</th><th>Last Modified</th><th>Size</th>",
-             path, path);
-    rewinddir(directory);
-    char *temp = malloc(strlen(path) + ENTITY_LINE + 2);
-    if (temp == NULL)
-    {
-        closedir(directory);
-        free(contents);
-        free(temp);
-        return NULL;
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr *)&peer, &len) == ERROR || peer.sin_family != AF_INET)
+        return false;
+    return (ntohl(peer.sin_addr.s_addr) >> 24) == 127;
+}
+
+/* The admission counters at ADMISSION_PATH, ADMISSION_PATH?limit=N changes the cap (0 for none).
+ * Only answered to clients on this host */
+int admission_page(request_t *req, char *path)
+{
+    char content[CONTENT_BUFF];
+    header_t h;
+    buffer_t report;
+    if (from_loopback(req->fd) == false)
+    {
+        server_response(req, HTTP_403, "");
+        return SUCCESS;
     }
-    memset(temp, 0, strlen(path) + ENTITY_LINE + 2);
-    while ((entry = readdir(directory)) != NULL)
+    char *query = path + sizeof(ADMISSION_PATH) - 1;
+    if (strncmp(query, "?limit=", 7) == 0)
     {
-        if (path[0] == '/')
-            strcpy(temp, ".");
-        else
-            strcpy(temp, "./");
-        strcat(temp, path);
-        strcat(temp, entry->d_name);
-        if (set_list(&contents, temp, entry->d_name) == ERROR)
+        char *end;
+        long limit = strtol(query + 7, &end, 10);
+        if (end == query + 7 || *end != '\0' || limit < 0 || limit > INT_MAX)
         {
-            closedir(directory);
-            free(contents);
-            free(temp);
-            return NULL;
+            server_response(req, HTTP_400, "");
+            return SUCCESS;
         }
+        admission_set((int)limit);
     }
-    strcat(contents, "</table><HR><ADDRESS>webserver/1.1</ADDRESS></BODY></HTML>");
-    closedir(directory);
-    free(temp);
-    return contents;
+    else if (*query != '\0')
+    {
+        server_response(req, HTTP_404, "");
+        return SUCCESS;
+    }
+    buffer_init_arena(&report, req->arena);
+    if (buffer_printf(&report, "limit %d\nactive %d\nrejected %ld\n", admission_limit(), admission_active(), admission_rejected()) == ERROR)
+        return ERROR;
+    header_start(&h, HTTP_200);
+    header_add(&h, content, strlen(content_headers(content, sizeof(content), "text/plain", report.len)));
+    header_add(&h, "Cache-Control: no-store\r\n", 25);
+    header_end(&h, req->keep_alive);
+    header_add(&h, report.data, report.len);
+    int res = send_segments(req, &h, HTTP_200);
+    buffer_free(&report);
+    return res;
 }
 
-/* Getting all the files within a directory */
-int dir_content(char *path, int newfd)
+/* Add a finished request to the metrics, start is when its handling began */
+void count_response(request_t *req, long start)
 {
-    DIR *directory = opendir_s(path);
-    struct stat st;
-    if (stat(path, &st) == ERROR)
-        return ERROR;
-    int execBit = st.st_mode & S_IXOTH;
-    if (directory == NULL)
+    long end = stats_now();
+    if (req->resolve > 0)
+        stats_record(STAGE_RESOLVE, req->resolve);
+    stats_record(STAGE_SEND, end - start - req->resolve);
+    stats_record(STAGE_TOTAL, end - start + req->http->elapsed);
+    stats_response(req->status, req->sent);
+}
+
+/* Answer a request whose request line was parsed into req->http */
+void handle_request(request_t *req)
+{
+    http_request_t *http = req->http;
+    if (req->keep_alive == true)
+        req->keep_alive = wants_keep_alive(http);
+    req->http11 = slice_eq(&http->version, "HTTP/1.1");
+    if (slice_eq(&http->method, "POST")) /* Only support the get method */
     {
-        perror("opendir");
-        return NO_PERMISSON;
+        server_response(req, HTTP_501, "");
+        return;
     }
-    if (execBit == 0)
+    if (http->path.data[0] != '/') /* Bad requast -> HTTP_400 */
     {
-        closedir(directory);
-        return NO_PERMISSON;
+        server_response(req, HTTP_400, "");
+        return;
     }
-    char response[HTML_BUFF], timebuf[TIME_BUFF], *contents = NULL;
-    memset(response, 0, HTML_BUFF);
-    memset(timebuf, 0, TIME_BUFF);
-    contents = get_dir_content(path, directory);
-    if (contents == NULL)
-        return ERROR;
-    get_time((time_t)st.st_mtime, timebuf, TIME_BUFF);
-    int length = snprintf(response, HTML_BUFF,
-                          "%s %s\r\n"
-                          "Server: %s\r\n"
-                          "Date: %s\r\n"
-                          "Content-Type: %s\r\n"
-                          "Content-Length: %ld\r\n"
-                          "Last-Modified: %s"
-                          "Connection: close\r\n\r\n",
-                          SERVER_HTTP, "200 OK", SERVER_PROTOCOL, timebuf, "text/html", strlen(contents), ctime(&st.st_mtime));
-    if (write_to_socket(newfd, response, length) == ERROR) /* Send the header */
-    {
-        free(contents);
-        return ERROR;
+    http->path.data[http->path.len] = '\0'; /* Overwrites the space after the path, no copy needed */
+    if (strncmp(http->path.data, STATS_PATH, sizeof(STATS_PATH) - 1) == 0)
+    {
+        if (stats_page(req, http->path.data) == ERROR)
+            server_error(req);
+        return;
     }
-    if (write_to_socket(newfd, contents, strlen(contents)) == ERROR) /* Send the html */
+    if (strncmp(http->path.data, ADMISSION_PATH, sizeof(ADMISSION_PATH) - 1) == 0)
     {
-        free(contents);
-        return ERROR;
+        if (admission_page(req, http->path.data) == ERROR)
+            server_error(req);
+        return;
     }
-    free(contents);
-    return !ERROR;
+    path_proccesor(http->path.data, req);
 }
 
-/* Searching for the index.html within a directory */
-char *get_index(char *path, char *file)
+/* Answer every complete (pipelined) request at the start of the connection buffer.
+ * http keeps the parser state, so a request split over several reads is scanned once.
+ * The answered bytes are dropped from buf and len is updated, a partial request stays.
+ * Returns ERROR when the connection has to be closed, SUCCESS to keep reading it. */
+int serve_requests(int fd, char *buf, size_t *len, size_t size, int *served, http_request_t *http, arena_t *arena)
 {
-    DIR *directory = opendir_s(path);
-    if (directory == NULL)
-    {
-        perror("opendir");
-        return NULL;
-    }
-    struct dirent *entry;
-    while ((entry = readdir(directory)) != NULL)
+    while (true)
     {
-        if (strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
-            continue;
-        if (strcmp(entry->d_name, file) == 0)
+        long start = stats_now();
+        http_parse_status status = http_parse(http, buf, *len);
+        request_t req = {.fd = fd, .http = http, .keep_alive = *served + 1 < keepAliveMax && status == HTTP_PARSE_DONE && atomic_load(&draining) == 0};
+        req.arena = arena;
+        http->elapsed += stats_now() - start;
+        if (status == HTTP_PARSE_AGAIN && *len < size) /* Wait for the rest of the request */
+            return SUCCESS;
+        stats_record(STAGE_PARSE, http->elapsed);
+        start = stats_now();
+        if (status == HTTP_PARSE_ERROR || http->version.len == 0) /* Bad requast -> HTTP_400 */
         {
-            closedir(directory);
-            return strncat(path, file, PATH_MAX + strlen(file));
+            server_response(&req, HTTP_400, "");
+            count_response(&req, start);
+            arena_reset(arena);
+            return ERROR;
         }
+        handle_request(&req); /* Headers too big for the buffer are answered by the request line, then closed */
+        count_response(&req, start);
+        arena_reset(arena);
+        if (status != HTTP_PARSE_DONE)
+            return ERROR;
+        memmove(buf, buf + http->length, *len - http->length);
+        *len -= http->length;
+        buf[*len] = '\0';
+        http_reset(http);
+        (*served)++;
+        if (req.keep_alive == false)
+            return ERROR;
     }
-    closedir(directory);
-    return NULL;
 }
 
-/* Identify if every directory in the path have exec permission */
-bool recursive_permission(char *path)
+/* New sockets will processed by thread in this function */
+int process_request(void *arg)
 {
-    char posix[PATH_MAX];
-    memset(posix, 0, PATH_MAX);
-    int i = 0;
-    size_t length = strlen(path);
-    bool res = true;
-    while (i < length)
+    int newfd = (int)(intptr_t)arg, served = 0;
+    ssize_t bytes;
+    size_t length = 0;
+    char buffer[BUFF];
+    http_request_t http;
+    arena_t arena;
+    http_reset(&http);
+    arena_init(&arena);
+    if (job_wait() > 0)
+        stats_record(STAGE_QUEUE, job_wait());
+    memset(buffer, 0, BUFF);
+    struct timeval timeout = {keepAliveTimeout, 0};
+    struct pollfd idle[2] = {{newfd, POLLIN, 0}, {drainFd, POLLIN, 0}};
+    setsockopt(newfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)); /* Idle keep-alive connections time out */
+    while (true)
     {
-        if (path[i] != '/')
-            posix[i] = path[i];
-        else
+        if (length == 0 && served > 0) /* Between requests, wait for the next one unless the server drains */
         {
-            posix[i] = '/';
-            res = dir_permission(posix);
-            if (res == false)
+            int ready = poll(idle, 2, keepAliveTimeout > 0 ? keepAliveTimeout * 1000 : -1);
+            if (ready == ERROR && errno == EINTR)
+                continue;
+            if (ready <= 0 || (idle[1].revents & POLLIN))
                 break;
         }
-        i++;
+        if ((bytes = read(newfd, buffer + length, sizeof(buffer) - length - 1)) <= 0) /* Read from socket */
+        {
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && served == 0)
+            {
+                perror("read");
+                request_t req = {.fd = newfd};
+                server_response(&req, HTTP_500, "");
+                stats_response(req.status, req.sent);
+            }
+            break; /* Peer closed, idle timeout or error */
+        }
+        length += bytes;
+        buffer[length] = '\0';
+        if (serve_requests(newfd, buffer, &length, sizeof(buffer) - 1, &served, &http, &arena) == ERROR)
+            break;
     }
-    return res;
+    arena_free(&arena);
+    close(newfd);
+    admission_leave();
+    return !ERROR;
 }
 
-/* Handle all the path proccess logic */
-int path_proccesor(char *path, int newfd)
+/* Answer the requests of a connection an engine finished reading, false when it was closed */
+bool serve_conn(conn_t *conn)
 {
-    char *index = NULL;
-    if (is_directory(path) == true) /* If path is a directory */
+    if (job_wait() > 0)
+        stats_record(STAGE_QUEUE, job_wait());
+    if (serve_requests(conn->fd, conn->buf, &conn->len, CONN_BUFF, &conn->served, &conn->request, &conn->arena) == ERROR)
     {
-        if (path[strlen(path) - 1] != '/')
+        close(conn->fd);
+        conn_free(conn);
+        return false;
+    }
+    return true;
+}
+
+/* Requests that the reactor finished reading are processed here */
+int process_ready_request(void *arg)
+{
+    conn_t *conn = (conn_t *)arg;
+    if (serve_conn(conn))
+        reactor_resume(conn); /* Keep-alive, the event loop waits for the next request */
+    return !ERROR;
+}
+
+/* The system call a request of the io_uring engine waits for */
+typedef enum
+{
+    RING_STAT,      /* statx of a parent directory */
+    RING_OPEN,      /* openat of the target */
+    RING_FSTAT,     /* statx of the descriptor it opened */
+    RING_SEND,      /* sendmsg of the segments in memory */
+    RING_SPLICE_IN, /* splice of the file into the pipe */
+    RING_SPLICE_OUT /* splice of the pipe to the socket */
+} ring_state;
+
+/* A request the io_uring engine answers, in the arena of its connection. The handler only builds the response,
+ * the ring resolves the path before and sends the response after, each completion submits the next call */
+typedef struct ring_request_st
+{
+    request_t req;
+    output_t output;
+    conn_t *conn;
+    ring_state state;
+    http_parse_status parsed; /* HTTP_PARSE_DONE when the connection can go on with the next request */
+    long start;               /* When its handling began */
+    long resolveStart;        /* When the ring started to resolve the path */
+    resolve_walk_t walk;
+    resolve_status resolved;
+    resolved_t res;
+    struct statx stx;
+    int fd;           /* Opened by RING_OPEN */
+    int segment;      /* First segment not sent yet */
+    int pipe[2];      /* From the file to the socket, created by the first file segment */
+    size_t pipeSize;
+    size_t piped;     /* Bytes in the pipe */
+    struct msghdr msg;
+    struct iovec iov[RING_IOV];
+} ring_request_t;
+
+/* The stat of a statx, as fstatat fills it */
+void stat_from_statx(struct stat *st, struct statx *stx)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* A new request on a ring connection, its response is collected in the connection arena */
+ring_request_t *ring_begin(conn_t *conn, http_parse_status parsed)
+{
+    ring_request_t *ring = arena_alloc(&conn->arena, sizeof(ring_request_t));
+    if (ring == NULL)
+        return NULL;
+    memset(ring, 0, sizeof(ring_request_t));
+    ring->req.fd = conn->fd;
+    ring->req.http = &conn->request;
+    ring->req.keep_alive = conn->served + 1 < keepAliveMax && parsed == HTTP_PARSE_DONE && atomic_load(&draining) == 0;
+    ring->req.arena = &conn->arena;
+    ring->req.output = &ring->output;
+    ring->output.file = ERROR;
+    ring->conn = conn;
+    ring->parsed = parsed;
+    ring->start = stats_now();
+    ring->fd = ERROR;
+    ring->pipe[0] = ring->pipe[1] = ERROR;
+    conn->context = ring;
+    return ring;
+}
+
+/* The request is answered, or its connection failed: free what it held and go on with the connection */
+void ring_finish(ring_request_t *ring, bool sent)
+{
+    conn_t *conn = ring->conn;
+    if (ring->pipe[0] != ERROR)
+    {
+        close(ring->pipe[0]);
+        close(ring->pipe[1]);
+    }
+    if (ring->output.file != ERROR)
+        close(ring->output.file);
+    cache_release(ring->output.entry);
+    if (ring->req.http != NULL)
+        count_response(&ring->req, ring->start);
+    else
+        stats_response(ring->req.status, ring->req.sent);
+    bool keep = sent && ring->parsed == HTTP_PARSE_DONE && ring->req.keep_alive;
+    conn->context = NULL;
+    arena_reset(&conn->arena);
+    if (keep == false)
+    {
+        uring_close(conn);
+        return;
+    }
+    memmove(conn->buf, conn->buf + conn->request.length, conn->len - conn->request.length);
+    conn->len -= conn->request.length;
+    conn->buf[conn->len] = '\0';
+    http_reset(&conn->request);
+    conn->served++;
+    if (conn->len > 0) /* Pipelined, the next request is in the buffer already */
+        uring_ready(conn);
+    else
+        uring_resume(conn);
+}
+
+/* The pipe a file segment goes through, as large as the system lets it be */
+int ring_pipe(ring_request_t *ring)
+{
+    if (pipe2(ring->pipe, O_CLOEXEC) == ERROR)
+    {
+        perror("pipe2");
+        ring->pipe[0] = ring->pipe[1] = ERROR;
+        return ERROR;
+    }
+    fcntl(ring->pipe[1], F_SETPIPE_SZ, RING_PIPE); /* Keeps the default size when over the limit of the user */
+    int size = fcntl(ring->pipe[1], F_GETPIPE_SZ);
+    ring->pipeSize = size > 0 ? (size_t)size : 4096;
+    return SUCCESS;
+}
+
+/* Submit the next send of the collected response: what the pipe holds, a run of segments in memory
+ * with one sendmsg, or the next bytes of a file into the pipe. Finishes the request once it is all out */
+void ring_send(ring_request_t *ring)
+{
+    output_t *output = &ring->output;
+    conn_t *conn = ring->conn;
+    int submitted;
+    if (ring->piped > 0)
+    {
+        bool more = output->segments[ring->segment].length > 0 || ring->segment + 1 < output->count;
+        ring->state = RING_SPLICE_OUT;
+        submitted = uring_splice(conn, ring->pipe[0], -1, conn->fd, ring->piped, more ? SPLICE_F_MORE : 0);
+    }
+    else
+    {
+        while (ring->segment < output->count && output->segments[ring->segment].length == 0)
+            ring->segment++;
+        if (ring->segment == output->count)
         {
-            server_response(newfd, "302 Found", "Directories must end with a slash", path);
-            return SUCCESS;
+            ring_finish(ring, true);
+            return;
         }
-        if (recursive_permission(path) == false)
+        segment_t *segment = &output->segments[ring->segment];
+        if (segment->data != NULL)
         {
-            server_response(newfd, "403 Forbidden", "Access denied", "");
-            return SUCCESS;
+            int count = 0;
+            for (int i = ring->segment; i < output->count && output->segments[i].data != NULL && count < RING_IOV; i++)
+            {
+                ring->iov[count].iov_base = (void *)output->segments[i].data;
+                ring->iov[count++].iov_len = output->segments[i].length;
+            }
+            memset(&ring->msg, 0, sizeof(ring->msg));
+            ring->msg.msg_iov = ring->iov;
+            ring->msg.msg_iovlen = count;
+            ring->state = RING_SEND;
+            submitted = uring_sendmsg(conn, &ring->msg, ring->segment + count < output->count ? MSG_MORE : 0);
         }
-        if ((index = get_index(path, "index.html")) != NULL) /* Return index.html within the folder */
+        else
         {
-            if (send_file_via_socket(newfd, index) == ERROR)
-                server_response(newfd, "500 Internal Server Error", "Some server side error", "");
-            return SUCCESS;
+            if (ring->pipe[0] == ERROR && ring_pipe(ring) == ERROR)
+            {
+                ring_finish(ring, false);
+                return;
+            }
+            ring->state = RING_SPLICE_IN;
+            submitted = uring_splice(conn, segment->fd, segment->offset, ring->pipe[1],
+                                     segment->length < ring->pipeSize ? segment->length : ring->pipeSize, 0);
         }
-        int res = dir_content(path, newfd);
-        if (res == ERROR) /* Return the content dir */
-            server_response(newfd, "500 Internal Server Error", "Some server side error", "");
-        else if (res == NO_PERMISSON)
-            server_response(newfd, "403 Forbidden", "Access denied", "");
-        return SUCCESS;
     }
-    if (is_file(path) == true) /* If path is a file */
+    if (submitted == ERROR)
+        ring_finish(ring, false);
+}
+
+/* sendmsg sent bytes, from the first segment not sent yet on */
+void ring_sent(ring_request_t *ring, size_t bytes)
+{
+    ring->req.sent += bytes;
+    while (bytes > 0)
+    {
+        segment_t *segment = &ring->output.segments[ring->segment];
+        size_t part = bytes < segment->length ? bytes : segment->length;
+        segment->data += part;
+        segment->length -= part;
+        bytes -= part;
+        if (segment->length == 0)
+            ring->segment++;
+    }
+}
+
+/* Answer the request once the ring resolved its path, on a worker: a cache miss reads the file */
+int ring_answer(void *arg)
+{
+    ring_request_t *ring = (ring_request_t *)((conn_t *)arg)->context;
+    answer_resolved(&ring->req, ring->req.http->path.data, ring->resolved, &ring->res);
+    ring_send(ring);
+    return !ERROR;
+}
+
+/* Submit the next call of the resolution, or answer the request once it ended */
+void ring_walk(ring_request_t *ring, resolve_status status)
+{
+    resolve_walk_t *walk = &ring->walk;
+    while (status == RESOLVE_AGAIN)
     {
-        if (file_permission(path) == false)
+        int submitted;
+        if (walk->call == RESOLVE_CALL_STAT)
         {
-            server_response(newfd, "403 Forbidden", "Access denied", "");
-            return SUCCESS;
+            ring->state = RING_STAT;
+            submitted = uring_statx(ring->conn, walk->dirfd, walk->path, 0, &ring->stx);
         }
-        if (send_file_via_socket(newfd, path) == ERROR)
-            server_response(newfd, "500 Internal Server Error", "Some server side error", "");
-        return SUCCESS;
+        else
+        {
+            ring->state = RING_OPEN;
+            submitted = uring_openat(ring->conn, walk->dirfd, walk->path, RESOLVE_OPEN_FLAGS);
+        }
+        if (submitted == SUCCESS)
+            return;
+        status = resolve_step(walk, -EBUSY, NULL);
     }
-    if ((is_file(path) == false || file_permission(path) == false)) /* If path is not a regular file or file has no read permission */
+    ring->resolved = status;
+    ring->req.resolve = stats_now() - ring->resolveStart;
+    uring_run(ring->conn, ring_answer);
+}
+
+/* An operation of a ring request completed with res, the result of its system call or -errno */
+void ring_complete(conn_t *conn, int res)
+{
+    ring_request_t *ring = (ring_request_t *)conn->context;
+    struct stat st;
+    switch (ring->state)
     {
-        server_response(newfd, "403 Forbidden", "Access denied", "");
-        return SUCCESS;
+    case RING_STAT:
+        if (res == 0)
+            stat_from_statx(&st, &ring->stx);
+        ring_walk(ring, resolve_step(&ring->walk, res, &st));
+        break;
+    case RING_OPEN:
+        if (res < 0)
+        {
+            ring_walk(ring, resolve_step(&ring->walk, res, NULL));
+            break;
+        }
+        ring->fd = res;
+        ring->state = RING_FSTAT;
+        if (uring_statx(conn, res, "", AT_EMPTY_PATH, &ring->stx) == ERROR)
+        {
+            close(res);
+            ring_walk(ring, resolve_step(&ring->walk, -EBUSY, NULL));
+        }
+        break;
+    case RING_FSTAT:
+        if (res < 0)
+        {
+            close(ring->fd);
+            ring_walk(ring, resolve_step(&ring->walk, res, NULL));
+            break;
+        }
+        stat_from_statx(&st, &ring->stx);
+        ring_walk(ring, resolve_step(&ring->walk, ring->fd, &st));
+        break;
+    case RING_SEND:
+        if (res > 0)
+            ring_sent(ring, res);
+        if (res > 0 || res == -EINTR || res == -EAGAIN)
+            ring_send(ring);
+        else
+            ring_finish(ring, false);
+        break;
+    case RING_SPLICE_IN:
+        if (res > 0)
+        {
+            segment_t *segment = &ring->output.segments[ring->segment];
+            segment->offset += res;
+            segment->length -= res;
+            ring->piped = res;
+        }
+        if (res > 0 || res == -EINTR || res == -EAGAIN)
+            ring_send(ring);
+        else
+            ring_finish(ring, false); /* 0: truncated under the request */
+        break;
+    case RING_SPLICE_OUT:
+        if (res > 0)
+        {
+            ring->piped -= res;
+            ring->req.sent += res;
+        }
+        if (res > 0 || res == -EINTR || res == -EAGAIN)
+            ring_send(ring);
+        else
+            ring_finish(ring, false);
+        break;
     }
-    return SUCCESS;
 }
 
-/* Parsing the requast */
-int parsing(char req[], char *method[], char *path[], char *version[])
+/* Answer the next request in the buffer of a ring connection, or give the connection back to read the rest */
+void ring_next(conn_t *conn)
 {
-    char *temp;
-    char **parsed = malloc(BUFF * sizeof(char *));
-    if (parsed == NULL)
-        return ALLOC_ERROR;
-    int position = 0;
-    char *end = strstr(req, "\r\n");
-    end[0] = '\0';
-    temp = strtok(req, " ");
-    while (temp != NULL && temp < end)
+    long start = stats_now();
+    http_parse_status status = http_parse(&conn->request, conn->buf, conn->len);
+    conn->request.elapsed += stats_now() - start;
+    if (status == HTTP_PARSE_AGAIN && conn->len < CONN_BUFF)
+    {
+        uring_resume(conn);
+        return;
+    }
+    stats_record(STAGE_PARSE, conn->request.elapsed);
+    ring_request_t *ring = ring_begin(conn, status);
+    if (ring == NULL)
     {
-        parsed[position] = temp;
-        position++;
-        temp = strtok(NULL, " ");
+        uring_close(conn);
+        return;
     }
-    parsed[position] = NULL;
-    *method = parsed[0], *path = parsed[1], *version = parsed[2];
-    if (strlen(*path) == 0)
-        *path = "/";
-    if (*method == NULL || *path == NULL || *version == NULL)
+    if (status == HTTP_PARSE_ERROR || conn->request.version.len == 0) /* Bad requast -> HTTP_400 */
     {
-        free(parsed);
-        return ERROR;
+        server_response(&ring->req, HTTP_400, "");
+        ring->parsed = HTTP_PARSE_ERROR;
     }
-    free(parsed);
+    else
+        handle_request(&ring->req); /* Headers too big for the buffer are answered by the request line, then closed */
+    if (ring->req.resolving)
+    {
+        ring->resolveStart = stats_now();
+        ring_walk(ring, resolve_begin(&ring->walk, rootFd, ring->req.http->path.data, &ring->res));
+    }
+    else
+        ring_send(ring);
+}
+
+/* Same for the io_uring engine, the ring resolves the path and sends the response */
+int process_ring_request(void *arg)
+{
+    if (job_wait() > 0)
+        stats_record(STAGE_QUEUE, job_wait());
+    ring_next((conn_t *)arg);
     return !ERROR;
 }
 
-/* Free the new fd and close the socket */
-void clean(int newfd, void *arg)
+/* The threadpool queue is full, shed the connection */
+int reject_busy(void *arg)
 {
-    if (arg != NULL)
-        free(arg);
-    close(newfd);
+    conn_t *conn = (conn_t *)arg;
+    request_t req = {.fd = conn->fd};
+    server_response(&req, HTTP_503, "");
+    stats_response(req.status, req.sent);
+    close(conn->fd);
+    conn_free(conn);
+    return !ERROR;
 }
 
-/* New sockets will processed by thread in this function */
-int process_request(void *arg)
+/* Same for the io_uring engine, the 503 goes out through the ring */
+int reject_ring(void *arg)
 {
-    int newfd = *(int *)arg, bytes;
-    char buffer[BUFF];
-    memset(buffer, 0, BUFF);
-    char *method = NULL, *path = NULL, *version = NULL;
-    while (true)
+    conn_t *conn = (conn_t *)arg;
+    ring_request_t *ring = ring_begin(conn, HTTP_PARSE_ERROR);
+    if (ring == NULL)
     {
-        if ((bytes = read(newfd, buffer, sizeof(buffer))) == -1) /* Read from socket */
-        {
-            perror("read");
-            server_response(newfd, "500 Internal Server Error", "Some server side error", "");
-            goto CLOSE;
-        }
-        if (strchr(buffer, '\n') != NULL) /* Identify the end of the first line */
-            break;
+        uring_close(conn);
+        return !ERROR;
+    }
+    ring->req.http = NULL; /* Not parsed, only the response is counted */
+    server_response(&ring->req, HTTP_503, "");
+    ring_send(ring);
+    return !ERROR;
+}
+
+/* Let the event loops hold as many connections as the hard limit allows */
+void raise_fd_limit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == ERROR)
+        return;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == ERROR)
+        perror("setrlimit");
+}
+
+/* Open a listening socket on port. With reuseport several sockets share the port
+ * and the kernel spreads the new connections over them */
+int open_listener(int port, int backlog, bool reuseport)
+{
+    struct sockaddr_in server;
+    int fd, on = 1;
+    if ((fd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("socket");
+        return ERROR;
     }
-    int parse = parsing(buffer, &method, &path, &version);
-    if (parse == ALLOC_ERROR)
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == ERROR)
     {
-        server_response(newfd, "500 Internal Server Error", "Some server side error", "");
-        goto CLOSE;
+        perror("setsockopt");
+        close(fd);
+        return ERROR;
     }
-    if (parse == ERROR) /* Bad requast -> HTTP_400 */
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_ANY);
+    // server.sin_addr.s_addr = inet_addr("192.168.1.22");
+    if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0)
     {
-        server_response(newfd, "400 Bad Request", "Bad Request", "");
-        goto CLOSE;
+        perror("bind");
+        close(fd);
+        return ERROR;
     }
-    if (strcmp(method, "POST") == 0) /* Only support the get method */
+    if (listen(fd, backlog) < 0)
     {
-        server_response(newfd, "501 Not supported", "Method is not supported", "");
-        goto CLOSE;
+        perror("listen");
+        close(fd);
+        return ERROR;
     }
-    if (is_exist(++path) == false && strcmp(--path, "/") != 0) /* Return error -> 404 not found */
+    return fd;
+}
+
+/* Stop accepting and let the connections finish: the accept loops and the idle keep-alives of the
+ * threadpool wake on drainFd, the engines drain on their own. The listening sockets stay open for a successor */
+void drain_server()
+{
+    pthread_mutex_lock(&engineLock);
+    if (atomic_exchange(&draining, 1) == 0)
     {
-        server_response(newfd, "404 Not Found", "File not found", "");
-        goto CLOSE;
+        uint64_t one = 1;
+        if (write(drainFd, &one, sizeof(one)) == ERROR)
+            perror("write");
+        if (activeReactor != NULL)
+            reactor_stop(activeReactor);
+        if (activeUring != NULL)
+            uring_stop(activeUring);
     }
-    path_proccesor(path, newfd);
-CLOSE:
-    clean(newfd, arg);
-    return !ERROR;
+    pthread_mutex_unlock(&engineLock);
+}
+
+/* SIGTERM drains the server, SIGUSR2 starts a successor on the same sockets first.
+ * A second SIGTERM while draining exits at once */
+void *signal_loop(void *arg)
+{
+    sigset_t *set = (sigset_t *)arg;
+    int sig, fds[MAX_LISTENERS];
+    while (sigwait(set, &sig) == 0)
+    {
+        if (sig == SIGTERM && atomic_load(&draining) == 1)
+            _exit(EXIT_FAILURE);
+        if (sig == SIGUSR2)
+        {
+            if (atomic_load(&draining) == 1) /* Handed over already */
+                continue;
+            for (int i = 0; i < numListeners; i++)
+                fds[i] = listeners[i].fd;
+            pid_t pid = handoff_spawn(exePath, serverArgv, fds, numListeners);
+            if (pid == ERROR)
+            {
+                perror(exePath); /* Keep serving */
+                continue;
+            }
+            printf("Started %d on the listening sockets, draining\n", (int)pid);
+            fflush(stdout);
+        }
+        else
+            printf("Draining\n");
+        drain_server();
+    }
+    return NULL;
+}
+
+/* Set or clear O_NONBLOCK on a listening socket, inherited ones keep the mode of the previous server */
+int set_listen_nonblocking(int fd, bool on)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == ERROR)
+        return ERROR;
+    return fcntl(fd, F_SETFL, on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+/* Accept connections on one listening socket and hand them to its own pool, until the server drains */
+void *accept_loop(void *arg)
+{
+    listener_t *listener = (listener_t *)arg;
+    struct sockaddr_in client;
+    socklen_t cli_len = sizeof(client);
+    struct pollfd ready[2] = {{listener->fd, POLLIN, 0}, {drainFd, POLLIN, 0}};
+    while (true)
+    {
+        if (poll(ready, 2, -1) == ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (ready[1].revents & POLLIN) /* Draining */
+            break;
+        int newfd = accept(listener->fd, (struct sockaddr *)&client, &cli_len);
+        if (newfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) /* EAGAIN: a successor took it */
+                continue;
+            perror("accept");
+            break;
+        }
+        /* Over the admission cap or the queue is full -> shed the connection */
+        if (admission_enter() == false || dispatch(listener->pool, process_request, (void *)(intptr_t)newfd) == ERROR)
+        {
+            request_t req = {.fd = newfd};
+            server_response(&req, HTTP_503, "");
+            stats_response(req.status, req.sent);
+            close(newfd);
+            admission_leave();
+        }
+    }
+    drain_server(); /* Wake the other listeners */
+    return NULL;
 }
 
 /* Main */
 int main(int argc, char *argv[])
 {
-    if (argc != 4) /* Verify for right input */
+    if (argc < 4 || argc % 2 != 0) /* Verify for right input */
     {
         usage_message();
         return EXIT_FAILURE;
     }
-    signal(SIGPIPE, SIG_IGN);                        /* Prevent SIG_PIPE */
-    struct sockaddr_in server, client;               /* Used by bind() , Used by accept() */
-    int fd, port, poolSize, maxClients, counter = 0; /* Socket descriptor , New socket descriptor , Port handle ,  Pool-size handle , Max-clients handle */
-    unsigned int cli_len = sizeof(client);
-    server.sin_family = AF_INET;
+    signal(SIGPIPE, SIG_IGN); /* Prevent SIG_PIPE */
+    signal(SIGBUS, on_sigbus); /* A mapped file truncated while it is read */
+    int port, poolSize;       /* Port handle ,  Pool-size handle */
+    int maxClients;           /* Connections held at once, 0 for no limit */
+    int maxConnections = ERROR; /* Set by -a, max-number-of-request otherwise */
+    int eventLoops = 0;       /* Number of epoll event loops, 0 for the blocking accept loop */
+    int rings = 0;            /* Number of io_uring rings, instead of the event loops */
+    int cacheSize = CACHE_SIZE; /* File cache size in megabytes, 0 to disable it */
+    int queueSize = QUEUE_SIZE; /* Requests a pool queues */
+    int backlog = BACKLOG;      /* Listen backlog of every socket */
+    int maxPoolSize = 0;        /* The pool grows up to this many threads, 0 keeps pool-size */
+    int targetWait = QUEUE_WAIT; /* Milliseconds a request may wait for a thread before one is added */
+    char *mimeFile = NULL;      /* mime.types given with -m, the system one otherwise */
 
-    for (int i = 1; i < argc; i++)
+    for (int i = 4; i < argc; i += 2) /* Optional flags */
+    {
+        if (strcmp(argv[i], "-m") == 0) /* The only flag that takes a path */
+        {
+            mimeFile = argv[i + 1];
+            continue;
+        }
+        int temp = get_int(argv[i + 1]);
+        if (temp == ERROR)
+            return EXIT_FAILURE;
+        if (strcmp(argv[i], "-e") == 0 && temp > 0 && temp <= MAX_EVENT_LOOPS)
+            eventLoops = temp;
+        else if (strcmp(argv[i], "-u") == 0 && temp > 0 && temp <= MAX_RINGS)
+            rings = temp;
+        else if (strcmp(argv[i], "-l") == 0 && temp > 0 && temp <= MAX_LISTENERS)
+            numListeners = temp;
+        else if (strcmp(argv[i], "-k") == 0 && temp >= 0)
+            keepAliveTimeout = temp;
+        else if (strcmp(argv[i], "-r") == 0 && temp > 0)
+            keepAliveMax = temp;
+        else if (strcmp(argv[i], "-c") == 0 && temp >= 0)
+            cacheSize = temp;
+        else if (strcmp(argv[i], "-M") == 0 && temp >= 0)
+            mmapLimit = temp * 1024L;
+        else if (strcmp(argv[i], "-a") == 0 && temp >= 0)
+            maxConnections = temp;
+        else if (strcmp(argv[i], "-q") == 0 && temp > 0)
+            queueSize = temp;
+        else if (strcmp(argv[i], "-b") == 0 && temp > 0)
+            backlog = temp;
+        else if (strcmp(argv[i], "-T") == 0 && temp > 0 && temp <= MAXT_IN_POOL)
+            maxPoolSize = temp;
+        else if (strcmp(argv[i], "-W") == 0 && temp > 0)
+            targetWait = temp;
+        else
+        {
+            usage_message();
+            return EXIT_FAILURE;
+        }
+    }
+    if ((eventLoops > 0) + (rings > 0) + (numListeners > 1) > 1) /* The event loops and the rings share one socket */
+    {
+        usage_message();
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < 4; i++)
     {
         int temp = get_int(argv[i]);
         if (temp == ERROR)
@@ -682,53 +1756,171 @@ int main(int argc, char *argv[])
         else if (i == 3)
             maxClients = temp;
     }
+    if (maxPoolSize > 0 && maxPoolSize < poolSize) /* The pool starts at pool-size and grows from there */
+    {
+        usage_message();
+        return EXIT_FAILURE;
+    }
+    admission_set(maxConnections != ERROR ? maxConnections : maxClients); /* A cap on the connections in flight, the server runs until SIGTERM */
 
-    if ((fd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+    static sigset_t handled; /* Taken by the signal thread only, every thread inherits the mask */
+    pthread_t signals;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &handled, NULL);
+    serverArgv = argv;
+    if (strchr(argv[0], '/') == NULL || realpath(argv[0], exePath) == NULL)
+        snprintf(exePath, sizeof(exePath), "/proc/self/exe");
+    if ((drainFd = eventfd(0, EFD_CLOEXEC)) == ERROR || pthread_create(&signals, NULL, signal_loop, &handled) != 0)
     {
-        perror("socket");
+        perror("signals");
         return EXIT_FAILURE;
     }
+    pthread_detach(signals);
 
-    server.sin_port = htons(port);
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    // server.sin_addr.s_addr = inet_addr("192.168.1.22");
-    if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0)
+    int inherited[MAX_LISTENERS];
+    int numInherited = handoff_inherit(inherited, numListeners);
+    if (numInherited == ERROR)
     {
-        perror("bind");
+        fprintf(stderr, "%s does not hold %d listening socket%s\n", HANDOFF_ENV, numListeners, numListeners > 1 ? "s" : "");
         return EXIT_FAILURE;
     }
+    for (int i = 0; i < numListeners; i++) /* From the server that handed over, or new ones */
+    {
+        if (numInherited > 0)
+            listeners[i].fd = inherited[i];
+        else if ((listeners[i].fd = open_listener(port, backlog, numListeners > 1)) == ERROR)
+            return EXIT_FAILURE;
+    }
 
-    threadpool *threadpool = create_threadpool(poolSize);
-    assert(threadpool != NULL);
-    if (listen(fd, maxClients) < 0)
+    if ((rootFd = open_root(".")) == ERROR)
     {
-        perror("listen");
-        destroy_threadpool(threadpool);
+        perror("open");
         return EXIT_FAILURE;
     }
-    char ip[32];
-    printf("Server is listening on %s:%d\n", inet_ntop(AF_INET, &(server.sin_addr.s_addr), ip, 32), port);
-    while (true)
+    if (mime_load(mimeFile != NULL ? mimeFile : MIME_TYPES_FILE) == ERROR && mimeFile != NULL)
     {
-        if (counter >= maxClients)
+        perror(mimeFile);
+        return EXIT_FAILURE;
+    }
+    printf("%d mime types\n", mime_count());
+    stats_init();
+    if (headers_init(SERVER_PROTOCOL) == ERROR)
+    {
+        fprintf(stderr, "failed to build the response headers\n");
+        return EXIT_FAILURE;
+    }
+    if (arenas_init() == ERROR)
+    {
+        fprintf(stderr, "failed to create the request arenas\n");
+        return EXIT_FAILURE;
+    }
+    if (cacheSize > 0)
+    {
+        fileCache = create_cache((size_t)cacheSize * 1024 * 1024);
+        assert(fileCache != NULL);
+    }
+    for (int i = 0; i < numListeners; i++) /* Every listener has its own workers and queue */
+    {
+        listeners[i].pool = maxPoolSize > poolSize ? create_threadpool_adaptive(poolSize, maxPoolSize, queueSize, targetWait * 1000000L, IDLE_WORKER * 1000)
+                                                   : create_threadpool(poolSize, queueSize);
+        assert(listeners[i].pool != NULL);
+    }
+    printf("Server is listening on 0.0.0.0:%d with %d %slistener%s\n", port, numListeners, numInherited > 0 ? "inherited " : "", numListeners > 1 ? "s" : "");
+    if (rings > 0 && uring_supported() == false)
+    {
+        fprintf(stderr, "io_uring is not available, using the threadpool\n");
+        rings = 0;
+    }
+    if (rings > 0) /* Completion driven mode, the rings read the requests and the pool answers them */
+    {
+        raise_fd_limit();
+        set_listen_nonblocking(listeners[0].fd, false); /* The accepts wait in the kernel */
+        uring *engine = create_uring(listeners[0].fd, rings, poolSize > 0 ? listeners[0].pool : NULL, process_ring_request, reject_ring, ring_complete, keepAliveTimeout);
+        if (engine == NULL)
         {
-            //Handle ERROR <cannot accept connetion>
-            break;
+            fprintf(stderr, "failed to start the rings\n");
+            destroy_threadpool(listeners[0].pool);
+            close(listeners[0].fd);
+            return EXIT_FAILURE;
         }
-        int *newfd = malloc(sizeof(int));
-        assert(newfd != NULL);
-        if ((*newfd = accept(fd, (struct sockaddr *)&client, &cli_len)) < 0)
+        pthread_mutex_lock(&engineLock);
+        if (atomic_load(&draining) == 1) /* A signal came while it started */
+            uring_stop(engine);
+        activeUring = engine;
+        pthread_mutex_unlock(&engineLock);
+        uring_wait(engine);
+        pthread_mutex_lock(&engineLock);
+        activeUring = NULL;
+        pthread_mutex_unlock(&engineLock);
+        destroy_threadpool(listeners[0].pool); /* The responses still being sent give their connection back to the ring */
+        listeners[0].pool = NULL;
+        destroy_uring(engine);
+    }
+    else if (eventLoops > 0) /* Event driven mode, the loops read the requests and the pool answers them */
+    {
+        raise_fd_limit();
+        reactor *reactor = create_reactor(listeners[0].fd, eventLoops, poolSize > 0 ? listeners[0].pool : NULL, process_ready_request, reject_busy, keepAliveTimeout);
+        if (reactor == NULL)
         {
-            perror("accept");
-            break;
+            fprintf(stderr, "failed to start the event loops\n");
+            destroy_threadpool(listeners[0].pool);
+            close(listeners[0].fd);
+            return EXIT_FAILURE;
         }
-        dispatch(threadpool, process_request, newfd);
-        counter++;
+        pthread_mutex_lock(&engineLock);
+        if (atomic_load(&draining) == 1)
+            reactor_stop(reactor);
+        activeReactor = reactor;
+        pthread_mutex_unlock(&engineLock);
+        reactor_wait(reactor);
+        pthread_mutex_lock(&engineLock);
+        activeReactor = NULL;
+        pthread_mutex_unlock(&engineLock);
+        destroy_threadpool(listeners[0].pool); /* Same for the event loops */
+        listeners[0].pool = NULL;
+        destroy_reactor(reactor);
+    }
+    else
+    {
+        for (int i = 0; i < numListeners; i++) /* Polled with drainFd, a successor may take a connection first */
+            set_listen_nonblocking(listeners[i].fd, true);
+        for (int i = 1; i < numListeners; i++)
+        {
+            if (pthread_create(&listeners[i].thread, NULL, accept_loop, &listeners[i]) != 0)
+            {
+                perror("pthread_create");
+                for (int j = i; j < numListeners; j++) /* Do not leave sockets nobody accepts on */
+                {
+                    close(listeners[j].fd);
+                    destroy_threadpool(listeners[j].pool);
+                }
+                numListeners = i;
+                break;
+            }
+        }
+        accept_loop(&listeners[0]); /* The main thread is the first listener */
+        for (int i = 1; i < numListeners; i++)
+            pthread_join(listeners[i].thread, NULL);
     }
 
     /* Destructors */
-    destroy_threadpool(threadpool);
-    shutdown(fd, SHUT_RDWR);
-    close(fd);
+    for (int i = 0; i < numListeners; i++)
+        destroy_threadpool(listeners[i].pool);
+    if (fileCache != NULL)
+    {
+        cache_stats_t stats;
+        cache_stats(fileCache, &stats);
+        printf("File cache: %ld hits, %ld misses, %ld stale, %ld evictions, %ld entries, %zu/%zu bytes\n",
+               stats.hits, stats.misses, stats.stale, stats.evictions, stats.entries, stats.bytes, stats.capacity);
+        destroy_cache(fileCache);
+    }
+    headers_destroy();
+    mime_destroy();
+    arenas_destroy();
+    for (int i = 0; i < numListeners; i++) /* Closed, not shut down: a successor may accept on them */
+        close(listeners[i].fd);
+    close(drainFd);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,158 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "slab.h"
+#include "stats.h"
+
+#define ALIGN 16 /* Objects and the chunk header keep malloc's alignment */
+
+static atomic_int slabs = 0;                 /* Ids handed out, never reused */
+static slab_t *_Atomic live[SLAB_MAX];       /* The slab of every id until it is destroyed */
+static __thread void *lists[SLAB_MAX];       /* Free objects of the calling thread, per slab */
+static __thread int counts[SLAB_MAX];
+static __thread int holding = 0;             /* The exit hook is set for the calling thread */
+static pthread_key_t owner;                  /* Its destructor returns the lists of an exiting thread */
+static pthread_once_t owner_once = PTHREAD_ONCE_INIT;
+
+/* The next object of a free list is kept in its first word */
+#define NEXT(object) (*(void **)(object))
+
+/* A thread exits: its free objects go back to the depots, nobody else could ever take them */
+static void release_lists(void *held)
+{
+    void **free_lists = (void **)held;
+    for (int id = 0; id < SLAB_MAX; id++)
+    {
+        slab_t *slab = atomic_load(&live[id]);
+        if (slab == NULL || free_lists[id] == NULL)
+            continue;
+        pthread_mutex_lock(&slab->lock);
+        while (free_lists[id] != NULL)
+        {
+            void *object = free_lists[id];
+            free_lists[id] = NEXT(object);
+            NEXT(object) = slab->depot;
+            slab->depot = object;
+        }
+        slab->free += counts[id];
+        counts[id] = 0;
+        pthread_mutex_unlock(&slab->lock);
+    }
+    holding = 0;
+}
+
+static void create_owner()
+{
+    pthread_key_create(&owner, release_lists);
+}
+
+/* Set the exit hook the first time the calling thread keeps objects */
+static void hold()
+{
+    pthread_setspecific(owner, lists);
+    holding = 1;
+}
+
+slab_t *create_slab(size_t size)
+{
+    int id = atomic_fetch_add(&slabs, 1);
+    if (id >= SLAB_MAX)
+        return NULL;
+    slab_t *slab = (slab_t *)malloc(sizeof(slab_t));
+    if (slab == NULL)
+        return NULL;
+    slab->id = id;
+    slab->size = ((size < sizeof(void *) ? sizeof(void *) : size) + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    pthread_mutex_init(&slab->lock, NULL);
+    slab->depot = NULL;
+    slab->free = 0;
+    slab->chunks = NULL;
+    pthread_once(&owner_once, create_owner);
+    atomic_store(&live[id], slab);
+    return slab;
+}
+
+/* Move up to SLAB_BATCH objects from the depot to the calling thread, a new chunk when it is empty. Lock held */
+static void refill(slab_t *slab)
+{
+    if (slab->depot == NULL)
+    {
+        char *chunk = malloc(ALIGN + SLAB_BATCH * slab->size);
+        if (chunk == NULL)
+            return;
+        NEXT(chunk) = slab->chunks;
+        slab->chunks = chunk;
+        for (int i = SLAB_BATCH - 1; i >= 0; i--)
+        {
+            void *object = chunk + ALIGN + i * slab->size;
+            NEXT(object) = slab->depot;
+            slab->depot = object;
+        }
+        slab->free += SLAB_BATCH;
+    }
+    for (int i = 0; i < SLAB_BATCH && slab->depot != NULL; i++)
+    {
+        void *object = slab->depot;
+        slab->depot = NEXT(object);
+        slab->free--;
+        NEXT(object) = lists[slab->id];
+        lists[slab->id] = object;
+        counts[slab->id]++;
+    }
+}
+
+void *slab_alloc(slab_t *slab)
+{
+    if (holding == 0)
+        hold();
+    if (lists[slab->id] == NULL)
+    {
+        pthread_mutex_lock(&slab->lock);
+        refill(slab);
+        pthread_mutex_unlock(&slab->lock);
+        if (lists[slab->id] == NULL)
+            return NULL;
+    }
+    void *object = lists[slab->id];
+    lists[slab->id] = NEXT(object);
+    counts[slab->id]--;
+    stats_alloc(ALLOC_SLAB);
+    return object;
+}
+
+void slab_free(slab_t *slab, void *object)
+{
+    if (holding == 0)
+        hold();
+    NEXT(object) = lists[slab->id];
+    lists[slab->id] = object;
+    if (++counts[slab->id] < 2 * SLAB_BATCH)
+        return;
+    pthread_mutex_lock(&slab->lock); /* Give a batch back, for the threads that allocate what this one frees */
+    for (int i = 0; i < SLAB_BATCH; i++)
+    {
+        object = lists[slab->id];
+        lists[slab->id] = NEXT(object);
+        NEXT(object) = slab->depot;
+        slab->depot = object;
+    }
+    counts[slab->id] -= SLAB_BATCH;
+    slab->free += SLAB_BATCH;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+void destroy_slab(slab_t *slab)
+{
+    if (slab == NULL)
+        return;
+    while (slab->chunks != NULL)
+    {
+        void *chunk = slab->chunks;
+        slab->chunks = NEXT(chunk);
+        free(chunk);
+    }
+    atomic_store(&live[slab->id], NULL);
+    lists[slab->id] = NULL; /* Only the calling thread's list can be cleared */
+    counts[slab->id] = 0;
+    pthread_mutex_destroy(&slab->lock);
+    free(slab);
+}
@@ -0,0 +1,57 @@
+#if !defined(SLAB_H)
+#define SLAB_H
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * slab.h
+ *
+ * Pools of fixed size objects. Every thread keeps a short free list per
+ * slab and allocates and frees from it without a lock. A thread that
+ * runs out takes a batch from the shared depot, a thread that holds too
+ * many gives a batch back, so objects allocated by one thread and freed
+ * by another (a connection accepted by an event loop, closed by a
+ * worker) return to circulation. A thread that exits gives its lists
+ * back to the depot. The depot grows by whole chunks from the heap and
+ * only gives them back in destroy_slab.
+ */
+
+// objects moved between a thread and the depot at once
+#define SLAB_BATCH 16
+
+// slabs a process can create, every thread has a free list per slab
+#define SLAB_MAX 8
+
+typedef struct slab_st
+{
+	int id;				  //index of the per thread free lists
+	size_t size;		  //object size, rounded up to 16 bytes
+	pthread_mutex_t lock; //guards the depot and the chunk list
+	void *depot;		  //free objects, linked through their first word
+	size_t free;		  //objects in the depot
+	void *chunks;		  //every chunk taken from the heap
+} slab_t;
+
+/**
+ * create_slab makes a pool of objects of size bytes. returns NULL when
+ * SLAB_MAX slabs exist already or out of memory.
+ */
+slab_t *create_slab(size_t size);
+
+/**
+ * slab_alloc returns an uninitialized object, NULL when out of memory.
+ */
+void *slab_alloc(slab_t *slab);
+
+/**
+ * slab_free gives an object back, from any thread.
+ */
+void slab_free(slab_t *slab, void *object);
+
+/**
+ * destroy_slab frees every chunk. no object of the slab may be in use
+ * and no thread may use the slab anymore.
+ */
+void destroy_slab(slab_t *slab);
+
+#endif
@@ -0,0 +1,328 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+typedef enum
+{
+    false,
+    true
+} bool;
+
+#define ERROR -1
+#define SUCCESS 0
+
+static const char *stage_names[STAGES] = {"queue", "parse", "resolve", "send", "total"};
+static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char *percentile_names[] = {"p50", "p90", "p99", "p999"};
+static const char *alloc_names[ALLOC_KINDS] = {"heap", "slab", "arena"};
+
+static stats_block_t *_Atomic blocks = NULL; /* Every block, pushed once and never unlinked */
+static __thread stats_block_t *mine = NULL;   /* The block of the calling thread */
+static pthread_key_t owner;                   /* Its destructor frees the block of an exiting thread */
+static pthread_once_t owner_once = PTHREAD_ONCE_INIT;
+static long started;
+
+long stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void stats_init()
+{
+    started = stats_now();
+}
+
+/* A thread exits: its block is left to the next new thread, the counters stay in the totals */
+static void release_block(void *b)
+{
+    mine = NULL;
+    atomic_store(&((stats_block_t *)b)->owned, 0);
+}
+
+static void create_owner()
+{
+    pthread_key_create(&owner, release_block);
+}
+
+/* The block of the calling thread on its first sample: one an exited thread left, or a new one */
+static stats_block_t *block()
+{
+    if (mine != NULL)
+        return mine;
+    pthread_once(&owner_once, create_owner);
+    stats_block_t *b;
+    for (b = atomic_load(&blocks); b != NULL; b = b->next)
+    {
+        int left = 0;
+        if (atomic_compare_exchange_strong(&b->owned, &left, 1))
+            break;
+    }
+    if (b == NULL)
+    {
+        if ((b = calloc(1, sizeof(stats_block_t))) == NULL)
+            return NULL;
+        atomic_init(&b->owned, 1);
+        b->next = atomic_load(&blocks);
+        while (atomic_compare_exchange_weak(&blocks, &b->next, b) == false)
+            ;
+    }
+    mine = b;
+    pthread_setspecific(owner, b);
+    return b;
+}
+
+/* Add to a counter only this thread writes, no locked instruction needed */
+static void bump(atomic_ulong *counter, unsigned long n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/* Log-linear bucket: exact below STATS_SUB_BUCKETS, then STATS_SUB_BUCKETS buckets per power of two */
+static int bucket_of(unsigned long ns)
+{
+    if (ns < STATS_SUB_BUCKETS)
+        return ns;
+    int power = 63 - __builtin_clzl(ns);
+    int bucket = (power - 2) * STATS_SUB_BUCKETS + ((ns >> (power - 3)) & (STATS_SUB_BUCKETS - 1));
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/* Highest value that falls in a bucket */
+static unsigned long bucket_value(int bucket)
+{
+    if (bucket < STATS_SUB_BUCKETS)
+        return bucket;
+    int power = bucket / STATS_SUB_BUCKETS + 2;
+    unsigned long low = (unsigned long)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (power - 3);
+    return low + (1UL << (power - 3)) - 1;
+}
+
+void stats_record(stats_stage stage, long ns)
+{
+    stats_block_t *b = block();
+    if (b == NULL)
+        return;
+    if (ns < 0)
+        ns = 0;
+    bump(&b->hist[stage][bucket_of(ns)], 1);
+    bump(&b->sum[stage], ns);
+    if ((unsigned long)ns > atomic_load_explicit(&b->max[stage], memory_order_relaxed))
+        atomic_store_explicit(&b->max[stage], ns, memory_order_relaxed);
+}
+
+void stats_response(http_status status, size_t bytes)
+{
+    stats_block_t *b = block();
+    if (b == NULL)
+        return;
+    bump(&b->status[status], 1);
+    bump(&b->bytes, bytes);
+}
+
+void stats_alloc(alloc_kind kind)
+{
+    stats_block_t *b = block();
+    if (b != NULL)
+        bump(&b->allocs[kind], 1);
+}
+
+/* The server is linked with --wrap=malloc,--wrap=calloc,--wrap=realloc, its calls land here.
+ * block() allocates itself, so only the threads that have a block already are counted */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *data, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    if (mine != NULL)
+        bump(&mine->allocs[ALLOC_HEAP], 1);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    if (mine != NULL)
+        bump(&mine->allocs[ALLOC_HEAP], 1);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *data, size_t size)
+{
+    if (mine != NULL)
+        bump(&mine->allocs[ALLOC_HEAP], 1);
+    return __real_realloc(data, size);
+}
+
+/* The sum of every block */
+typedef struct totals_st
+{
+    unsigned long hist[STAGES][STATS_BUCKETS];
+    unsigned long count[STAGES];
+    unsigned long sum[STAGES];
+    unsigned long max[STAGES];
+    unsigned long status[HTTP_STATUSES];
+    unsigned long bytes;
+    unsigned long requests;
+    unsigned long allocs[ALLOC_KINDS];
+} totals_t;
+
+static void collect(totals_t *t)
+{
+    memset(t, 0, sizeof(totals_t));
+    for (stats_block_t *b = atomic_load(&blocks); b != NULL; b = b->next)
+    {
+        for (int s = 0; s < STAGES; s++)
+        {
+            for (int i = 0; i < STATS_BUCKETS; i++)
+            {
+                unsigned long n = atomic_load_explicit(&b->hist[s][i], memory_order_relaxed);
+                t->hist[s][i] += n;
+                t->count[s] += n;
+            }
+            t->sum[s] += atomic_load_explicit(&b->sum[s], memory_order_relaxed);
+            unsigned long max = atomic_load_explicit(&b->max[s], memory_order_relaxed);
+            if (max > t->max[s])
+                t->max[s] = max;
+        }
+        for (int i = 0; i < HTTP_STATUSES; i++)
+        {
+            unsigned long n = atomic_load_explicit(&b->status[i], memory_order_relaxed);
+            t->status[i] += n;
+            t->requests += n;
+        }
+        t->bytes += atomic_load_explicit(&b->bytes, memory_order_relaxed);
+        for (int i = 0; i < ALLOC_KINDS; i++)
+            t->allocs[i] += atomic_load_explicit(&b->allocs[i], memory_order_relaxed);
+    }
+}
+
+/* Microseconds at or below which a fraction q of the samples of a stage fall */
+static double percentile_us(totals_t *t, int stage, double q)
+{
+    unsigned long target = (unsigned long)(q * t->count[stage] + 0.5), seen = 0;
+    if (t->count[stage] == 0)
+        return 0;
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += t->hist[stage][i];
+        if (seen >= target)
+        {
+            unsigned long value = bucket_value(i);
+            return (value < t->max[stage] ? value : t->max[stage]) / 1000.0;
+        }
+    }
+    return t->max[stage] / 1000.0;
+}
+
+/* name value lines */
+static int render_text(buffer_t *out, totals_t *t, cache_stats_t *cache, pool_stats_t *pool)
+{
+    if (buffer_printf(out, "uptime_seconds %ld\nrequests %lu\nbytes_sent %lu\n",
+                      (stats_now() - started) / 1000000000L, t->requests, t->bytes) == ERROR)
+        return ERROR;
+    for (int i = 0; i < HTTP_STATUSES; i++)
+    {
+        if (buffer_printf(out, "status_%d %lu\n", status_code(i), t->status[i]) == ERROR)
+            return ERROR;
+    }
+    for (int s = 0; s < STAGES; s++)
+    {
+        if (buffer_printf(out, "%s_count %lu\n%s_mean_us %.1f\n", stage_names[s], t->count[s],
+                          stage_names[s], t->count[s] ? t->sum[s] / 1000.0 / t->count[s] : 0) == ERROR)
+            return ERROR;
+        for (int p = 0; p < 4; p++)
+        {
+            if (buffer_printf(out, "%s_%s_us %.1f\n", stage_names[s], percentile_names[p], percentile_us(t, s, percentiles[p])) == ERROR)
+                return ERROR;
+        }
+        if (buffer_printf(out, "%s_max_us %.1f\n", stage_names[s], t->max[s] / 1000.0) == ERROR)
+            return ERROR;
+    }
+    for (int i = 0; i < ALLOC_KINDS; i++)
+    {
+        if (buffer_printf(out, "allocs_%s %lu\nallocs_%s_per_request %.2f\n", alloc_names[i], t->allocs[i],
+                          alloc_names[i], t->requests ? (double)t->allocs[i] / t->requests : 0) == ERROR)
+            return ERROR;
+    }
+    if (cache != NULL && buffer_printf(out, "cache_hits %ld\ncache_misses %ld\ncache_stale %ld\ncache_evictions %ld\n"
+                                            "cache_entries %ld\ncache_bytes %zu\ncache_mapped_bytes %zu\ncache_capacity %zu\n",
+                                       cache->hits, cache->misses, cache->stale, cache->evictions,
+                                       cache->entries, cache->bytes, cache->mapped, cache->capacity) == ERROR)
+        return ERROR;
+    if (pool != NULL && buffer_printf(out, "pool_threads %d\npool_idle %d\npool_min %d\npool_max %d\npool_queued %d\n"
+                                           "pool_grown %ld\npool_retired %ld\n",
+                                      pool->threads, pool->idle, pool->min_threads, pool->max_threads, pool->queued,
+                                      pool->grown, pool->retired) == ERROR)
+        return ERROR;
+    return SUCCESS;
+}
+
+/* One JSON object */
+static int render_json(buffer_t *out, totals_t *t, cache_stats_t *cache, pool_stats_t *pool)
+{
+    if (buffer_printf(out, "{\"uptime_seconds\":%ld,\"requests\":%lu,\"bytes_sent\":%lu,\"status\":{",
+                      (stats_now() - started) / 1000000000L, t->requests, t->bytes) == ERROR)
+        return ERROR;
+    for (int i = 0; i < HTTP_STATUSES; i++)
+    {
+        if (buffer_printf(out, "%s\"%d\":%lu", i ? "," : "", status_code(i), t->status[i]) == ERROR)
+            return ERROR;
+    }
+    if (buffer_printf(out, "},\"stages\":{") == ERROR)
+        return ERROR;
+    for (int s = 0; s < STAGES; s++)
+    {
+        if (buffer_printf(out, "%s\"%s\":{\"count\":%lu,\"mean_us\":%.1f", s ? "," : "", stage_names[s], t->count[s],
+                          t->count[s] ? t->sum[s] / 1000.0 / t->count[s] : 0) == ERROR)
+            return ERROR;
+        for (int p = 0; p < 4; p++)
+        {
+            if (buffer_printf(out, ",\"%s_us\":%.1f", percentile_names[p], percentile_us(t, s, percentiles[p])) == ERROR)
+                return ERROR;
+        }
+        if (buffer_printf(out, ",\"max_us\":%.1f}", t->max[s] / 1000.0) == ERROR)
+            return ERROR;
+    }
+    if (buffer_printf(out, "},\"allocs\":{") == ERROR)
+        return ERROR;
+    for (int i = 0; i < ALLOC_KINDS; i++)
+    {
+        if (buffer_printf(out, "%s\"%s\":%lu,\"%s_per_request\":%.2f", i ? "," : "", alloc_names[i], t->allocs[i],
+                          alloc_names[i], t->requests ? (double)t->allocs[i] / t->requests : 0) == ERROR)
+            return ERROR;
+    }
+    if (buffer_printf(out, "}") == ERROR)
+        return ERROR;
+    if (cache != NULL && buffer_printf(out, ",\"cache\":{\"hits\":%ld,\"misses\":%ld,\"stale\":%ld,\"evictions\":%ld,"
+                                            "\"entries\":%ld,\"bytes\":%zu,\"mapped_bytes\":%zu,\"capacity\":%zu}",
+                                       cache->hits, cache->misses, cache->stale, cache->evictions,
+                                       cache->entries, cache->bytes, cache->mapped, cache->capacity) == ERROR)
+        return ERROR;
+    if (pool != NULL && buffer_printf(out, ",\"pool\":{\"threads\":%d,\"idle\":%d,\"min\":%d,\"max\":%d,\"queued\":%d,"
+                                           "\"grown\":%ld,\"retired\":%ld}",
+                                      pool->threads, pool->idle, pool->min_threads, pool->max_threads, pool->queued,
+                                      pool->grown, pool->retired) == ERROR)
+        return ERROR;
+    return buffer_printf(out, "}\n");
+}
+
+int stats_report(buffer_t *out, cache_t *cache, pool_stats_t *pool, int json)
+{
+    cache_stats_t counters;
+    totals_t *t = malloc(sizeof(totals_t)); /* Too big for a worker stack */
+    if (t == NULL)
+        return ERROR;
+    collect(t);
+    if (cache != NULL)
+        cache_stats(cache, &counters);
+    int res = json ? render_json(out, t, cache ? &counters : NULL, pool) : render_text(out, t, cache ? &counters : NULL, pool);
+    free(t);
+    return res;
+}
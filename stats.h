@@ -0,0 +1,102 @@
+#if !defined(STATS_H)
+#define STATS_H
+#include <stdatomic.h>
+#include <stddef.h>
+#include "buffer.h"
+#include "headers.h"
+#include "cache.h"
+#include "threadpool.h"
+
+/**
+ * stats.h
+ *
+ * Request metrics. Every thread that serves requests records into its
+ * own block: one log-linear latency histogram per stage, counters per
+ * status and the bytes sent. A block has a single writer, so recording
+ * is a few relaxed loads and stores with no lock and no shared cache
+ * line. A reader sums all the blocks to render a report, it may see a
+ * request half recorded but never blocks the workers.
+ */
+
+// sub buckets per power of two, values are kept within 1/8 (12.5%)
+#define STATS_SUB_BUCKETS 8
+
+// buckets of a histogram, enough for 2^40 ns (18 minutes)
+#define STATS_BUCKETS (38 * STATS_SUB_BUCKETS)
+
+/**
+ * the timed stages of a request
+ */
+typedef enum
+{
+	STAGE_QUEUE,   //waiting in the threadpool queue
+	STAGE_PARSE,   //parsing the request line and headers
+	STAGE_RESOLVE, //resolving the path in the document root
+	STAGE_SEND,	   //building and sending the response
+	STAGE_TOTAL,   //parse to the last byte sent
+	STAGES
+} stats_stage;
+
+/**
+ * where an allocation was served from
+ */
+typedef enum
+{
+	ALLOC_HEAP,	 //malloc, calloc or realloc called by the server code
+	ALLOC_SLAB,	 //a per thread slab free list, see slab.h
+	ALLOC_ARENA, //a connection arena, see arena.h
+	ALLOC_KINDS
+} alloc_kind;
+
+/**
+ * the counters of one thread
+ */
+typedef struct stats_block_st
+{
+	atomic_ulong hist[STAGES][STATS_BUCKETS]; //nanosecond histograms
+	atomic_ulong sum[STAGES];				  //total nanoseconds per stage
+	atomic_ulong max[STAGES];				  //slowest sample per stage
+	atomic_ulong status[HTTP_STATUSES];		  //responses per status
+	atomic_ulong bytes;						  //bytes written to the clients
+	atomic_ulong allocs[ALLOC_KINDS];		  //allocations made by the thread
+	atomic_int owned;						  //1 while a thread records into it, 0 once it exited
+	struct stats_block_st *next;			  //all the blocks, newest first
+} stats_block_t;
+
+/**
+ * stats_init starts the uptime clock.
+ */
+void stats_init();
+
+/**
+ * stats_now returns the monotonic clock in nanoseconds.
+ */
+long stats_now();
+
+/**
+ * stats_record adds a sample of ns nanoseconds to a stage.
+ */
+void stats_record(stats_stage stage, long ns);
+
+/**
+ * stats_response counts one response of status that sent bytes bytes.
+ */
+void stats_response(http_status status, size_t bytes);
+
+/**
+ * stats_alloc counts one allocation of a kind. heap allocations are
+ * counted without it: the server is linked with --wrap for malloc,
+ * calloc and realloc, and the wrappers count the calls of the threads
+ * that have a block.
+ */
+void stats_alloc(alloc_kind kind);
+
+/**
+ * stats_report renders the sum of all the blocks, the counters of cache
+ * and the size of the threadpools (see threadpool_stats) when they are
+ * not NULL, into out: "name value" lines, or one JSON object when json
+ * is set. returns 0 on success, -1 when out of memory.
+ */
+int stats_report(buffer_t *out, cache_t *cache, pool_stats_t *pool, int json);
+
+#endif
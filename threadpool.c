@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdint.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -7,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -20,9 +25,173 @@ typedef enum
 #define ERROR -1
 #define BUFF 4000
 
-threadpool *create_threadpool(int num_threads_in_pool)
+/* Round the queue capacity up to a power of two so positions can be masked */
+static size_t ring_size(int queue_capacity)
 {
-    if (num_threads_in_pool < 0 || num_threads_in_pool > MAXT_IN_POOL)
+    size_t size = 1;
+    if (queue_capacity <= 0)
+        queue_capacity = DEFAULT_QUEUE_SIZE;
+    while (size < (size_t)queue_capacity)
+        size <<= 1;
+    return size < 2 ? 2 : size;
+}
+
+/* Index of the calling worker and the pool it belongs to, -1 outside any pool */
+static __thread threadpool *self_pool = NULL;
+static __thread int self_id = -1;
+static __thread long self_wait = 0; /* Queue wait of the job the worker runs */
+
+/* Monotonic clock in nanoseconds, stamps the jobs when they are queued */
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Allocate one deque per worker for the work stealing mode */
+static bool create_deques(threadpool *pool, int queue_capacity)
+{
+    if (queue_capacity <= 0)
+        queue_capacity = DEFAULT_QUEUE_SIZE;
+    int per_worker = pool->num_threads > 0 ? (queue_capacity + pool->num_threads - 1) / pool->num_threads : queue_capacity;
+    size_t size = ring_size(per_worker);
+    int count = pool->num_threads > 0 ? pool->num_threads : 1;
+    pool->deques = (deque_t *)calloc(count, sizeof(deque_t));
+    if (pool->deques == NULL)
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        pool->deques[i].jobs = (work_t *)malloc(size * sizeof(work_t));
+        if (pool->deques[i].jobs == NULL)
+        {
+            while (i-- > 0)
+                free(pool->deques[i].jobs);
+            free(pool->deques);
+            return false;
+        }
+        pool->deques[i].mask = size - 1;
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    return true;
+}
+
+/* Free the per worker deques, one per worker the pool was created with */
+static void destroy_deques(threadpool *pool)
+{
+    if (pool->deques == NULL)
+        return;
+    int count = pool->min_threads > 0 ? pool->min_threads : 1;
+    for (int i = 0; i < count; i++)
+    {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].jobs);
+    }
+    free(pool->deques);
+    pool->deques = NULL;
+}
+
+/* Start a worker in a free slot, it counts as idle until it takes its first job. Resize lock held */
+static bool spawn_worker(threadpool *pool)
+{
+    for (int i = 0; i < pool->max_threads; i++)
+    {
+        if (pool->running[i] == 1)
+            continue;
+        atomic_fetch_add(&pool->idle, 1);
+        if (pthread_create(&pool->threads[i], NULL, do_work, (void *)pool) != 0)
+        {
+            atomic_fetch_sub(&pool->idle, 1);
+            return false;
+        }
+        pool->running[i] = 1;
+        pool->num_threads++;
+        return true;
+    }
+    return false;
+}
+
+/* Add a worker when none is idle and the oldest job waited longer than the target */
+static void grow(threadpool *pool, long waited)
+{
+    if (pool->num_threads >= pool->max_threads || atomic_load(&pool->idle) > 0 || (waited < pool->target_wait && pool->num_threads > 0))
+        return;
+    pthread_mutex_lock(&pool->resize_lock);
+    if (atomic_load(&pool->shutdown) == 0 && pool->num_threads < pool->max_threads && atomic_load(&pool->idle) == 0 && spawn_worker(pool))
+        atomic_fetch_add(&pool->grown, 1);
+    pthread_mutex_unlock(&pool->resize_lock);
+}
+
+/* Give up the calling worker when the pool is above its minimum, false when it has to stay.
+ * The worker leaves the counts before it looks at the queue: a dispatch that queues a job
+ * after that look sees the smaller pool and grows it (even from no worker at all) */
+static bool retire(threadpool *pool)
+{
+    bool gone = false;
+    pthread_mutex_lock(&pool->resize_lock);
+    if (atomic_load(&pool->shutdown) == 0 && pool->num_threads > pool->min_threads)
+    {
+        pool->num_threads--;
+        atomic_fetch_sub(&pool->idle, 1);
+        if (atomic_load(&pool->qsize) > 0) /* Not while jobs wait, stay for them */
+        {
+            pool->num_threads++;
+            atomic_fetch_add(&pool->idle, 1);
+        }
+        else
+        {
+            for (int i = 0; i < pool->max_threads; i++)
+            {
+                if (pool->running[i] == 1 && pthread_equal(pool->threads[i], pthread_self()))
+                    pool->running[i] = 0;
+            }
+            atomic_fetch_add(&pool->retired, 1);
+            pthread_detach(pthread_self()); /* Nobody joins it */
+            gone = true;
+        }
+    }
+    pthread_mutex_unlock(&pool->resize_lock);
+    return gone;
+}
+
+/* Wait for a job. In an adaptive pool a worker that gets none for idle_timeout ms may retire, false then */
+static bool wait_for_job(threadpool *pool)
+{
+    if (pool->min_threads == pool->max_threads) /* Fixed size */
+    {
+        while (sem_wait(&pool->q_not_empty) == ERROR) /* interrupted by a signal, wait again */
+            ;
+        return true;
+    }
+    while (true)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += pool->idle_timeout / 1000;
+        deadline.tv_nsec += (pool->idle_timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (sem_clockwait(&pool->q_not_empty, CLOCK_MONOTONIC, &deadline) == 0)
+            return true;
+        if (errno == ETIMEDOUT && retire(pool))
+            return false;
+    }
+}
+
+threadpool *create_threadpool(int num_threads_in_pool, int queue_capacity)
+{
+    return create_threadpool_mode(num_threads_in_pool, queue_capacity, POOL_GLOBAL_QUEUE);
+}
+
+/* Build a pool of min_threads workers that may grow to max_threads */
+static threadpool *create_pool(int min_threads, int max_threads, int queue_capacity, pool_mode mode, long target_wait, int idle_timeout)
+{
+    if (min_threads < 0 || max_threads < min_threads || max_threads > MAXT_IN_POOL)
+        return NULL;
+    if (mode != POOL_GLOBAL_QUEUE && mode != POOL_WORK_STEALING)
         return NULL;
     threadpool *pool = (threadpool *)malloc(sizeof(threadpool));
     if (pool == NULL)
@@ -31,143 +200,300 @@ threadpool *create_threadpool(int num_threads_in_pool)
         return NULL;
     }
 
-    pool->num_threads = num_threads_in_pool;
-    pool->qsize = 0;
-    pool->shutdown = pool->dont_accept = 0;
-    pool->qhead = NULL;
-    pool->qtail = NULL;
+    pool->mode = mode;
+    pool->num_threads = min_threads; /* Sizes the deques, counted again as the workers start */
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->target_wait = target_wait > 0 ? target_wait : DEFAULT_TARGET_WAIT;
+    pool->idle_timeout = idle_timeout > 0 ? idle_timeout : DEFAULT_IDLE_TIMEOUT;
+    pool->deques = NULL;
+    pool->capacity = ring_size(queue_capacity);
+    pool->mask = pool->capacity - 1;
+    atomic_init(&pool->qsize, 0);
+    atomic_init(&pool->idle, 0);
+    atomic_init(&pool->last_take, now_ns());
+    atomic_init(&pool->grown, 0);
+    atomic_init(&pool->retired, 0);
+    atomic_init(&pool->qhead, 0);
+    atomic_init(&pool->qtail, 0);
+    atomic_init(&pool->producers, 0);
+    atomic_init(&pool->next_deque, 0);
+    atomic_init(&pool->started, 0);
+    atomic_init(&pool->shutdown, 0);
+    atomic_init(&pool->dont_accept, 0);
 
-    pthread_mutex_init(&pool->qlock, NULL);
-    pthread_cond_init(&pool->q_empty, NULL);
-    pthread_cond_init(&pool->q_not_empty, NULL);
+    if (mode == POOL_WORK_STEALING)
+        pool->capacity = 0, pool->mask = 0;
+    pool->queue = (work_t *)malloc((pool->capacity > 0 ? pool->capacity : 1) * sizeof(work_t));
+    if (pool->queue == NULL || (mode == POOL_WORK_STEALING && create_deques(pool, queue_capacity) == false))
+    {
+        fprintf(stderr, "malloc failed at create threadpool <queue>");
+        free(pool->queue);
+        free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < pool->capacity; i++)
+        atomic_init(&pool->queue[i].seq, i);
+    sem_init(&pool->q_not_empty, 0, 0);
+    pthread_mutex_init(&pool->resize_lock, NULL);
 
-    pool->threads = (pthread_t *)malloc(pool->num_threads * sizeof(pthread_t));
-    if (pool == NULL)
+    pool->threads = (pthread_t *)malloc((max_threads > 0 ? max_threads : 1) * sizeof(pthread_t));
+    pool->running = (unsigned char *)calloc(max_threads > 0 ? max_threads : 1, 1);
+    if (pool->threads == NULL || pool->running == NULL)
     {
         fprintf(stderr, "malloc failed at create threadpool <threads *>");
+        free(pool->threads);
+        free(pool->running);
+        destroy_deques(pool);
+        free(pool->queue);
+        free(pool);
         return NULL;
     }
 
-    for (int i = 0; i < pool->num_threads; i++)
+    pool->num_threads = 0;
+    pthread_mutex_lock(&pool->resize_lock);
+    for (int i = 0; i < min_threads; i++)
     {
-        if (pthread_create(&pool->threads[i], NULL, do_work, (void *)pool))
+        if (spawn_worker(pool) == false)
         {
             fprintf(stderr, "failed to init threads");
+            pthread_mutex_unlock(&pool->resize_lock);
+            destroy_threadpool(pool); /* Stops and joins the workers already started, frees the rest */
             return NULL;
         }
     }
+    pthread_mutex_unlock(&pool->resize_lock);
 
     return pool;
 }
 
-void dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg)
+threadpool *create_threadpool_mode(int num_threads_in_pool, int queue_capacity, pool_mode mode)
 {
-    pthread_mutex_lock(&from_me->qlock);
-    if (from_me->dont_accept == 1 || from_me == NULL)
+    return create_pool(num_threads_in_pool, num_threads_in_pool, queue_capacity, mode, 0, 0);
+}
+
+threadpool *create_threadpool_adaptive(int min_threads, int max_threads, int queue_capacity, long target_wait, int idle_timeout)
+{
+    return create_pool(min_threads, max_threads, queue_capacity, POOL_GLOBAL_QUEUE, target_wait, idle_timeout);
+}
+
+/* Claim the slot at the tail of the ring, false if the ring is full */
+static bool enqueue(threadpool *pool, dispatch_fn routine, void *arg)
+{
+    work_t *slot;
+    size_t pos = atomic_load_explicit(&pool->qtail, memory_order_relaxed);
+    while (true)
     {
-        pthread_mutex_unlock(&(from_me->qlock));
-        return;
+        slot = &pool->queue[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) /* slot is free, try to claim it */
+        {
+            if (atomic_compare_exchange_weak_explicit(&pool->qtail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) /* the consumers did not release it yet -> full */
+            return false;
+        else
+            pos = atomic_load_explicit(&pool->qtail, memory_order_relaxed);
     }
-    work_t *work = (work_t *)malloc(sizeof(work_t));
-    if (work == NULL)
+    slot->routine = routine;
+    slot->arg = arg;
+    slot->queued = now_ns();
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release); /* publish to the consumers */
+    return true;
+}
+
+/* Take the job at the head of the ring, false if the ring is empty. A claimed slot
+ * whose producer did not publish it yet is waited for: the caller holds a token for
+ * some job in the ring and must not give it up, or that job is left with no wakeup */
+static bool dequeue(threadpool *pool, work_t *job)
+{
+    work_t *slot;
+    size_t pos = atomic_load_explicit(&pool->qhead, memory_order_relaxed);
+    while (true)
     {
-        fprintf(stderr, "malloc failed at dispatch");
-        pthread_mutex_unlock(&(from_me->qlock));
-        return;
+        slot = &pool->queue[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) /* slot holds a job, try to claim it */
+        {
+            if (atomic_compare_exchange_weak_explicit(&pool->qhead, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0 && atomic_load_explicit(&pool->qtail, memory_order_acquire) == pos) /* nothing claimed there -> empty */
+            return false;
+        else if (diff < 0) /* a producer claimed it and is still filling it in */
+        {
+            sched_yield();
+            pos = atomic_load_explicit(&pool->qhead, memory_order_relaxed);
+        }
+        else
+            pos = atomic_load_explicit(&pool->qhead, memory_order_relaxed);
     }
-    from_me->qsize++;
-    work->arg = arg;
-    work->routine = dispatch_to_here;
-    work->next = NULL;
-    if (from_me->qhead == NULL)
+    job->routine = slot->routine;
+    job->arg = slot->arg;
+    job->queued = slot->queued;
+    atomic_store_explicit(&slot->seq, pos + pool->mask + 1, memory_order_release); /* hand the slot back to the producers */
+    return true;
+}
+
+/* Push a job to the tail of a deque, false if it is full */
+static bool deque_push(deque_t *deque, dispatch_fn routine, void *arg)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head > deque->mask)
     {
-        from_me->qhead = from_me->qtail = work;
-        pthread_cond_signal(&from_me->q_not_empty);
-        pthread_mutex_unlock(&from_me->qlock);
-        return;
+        pthread_mutex_unlock(&deque->lock);
+        return false;
     }
-    from_me->qtail->next = work;
-    from_me->qtail = work;
-    pthread_cond_signal(&from_me->q_not_empty);
-    pthread_mutex_unlock(&from_me->qlock);
+    work_t *slot = &deque->jobs[deque->tail & deque->mask];
+    slot->routine = routine;
+    slot->arg = arg;
+    slot->queued = now_ns();
+    deque->tail++;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
 }
 
-work_t *dequeue(threadpool *pool)
+/* Pop a job from the head (owner) or the tail (thief) of a deque */
+static bool deque_pop(deque_t *deque, work_t *job, bool steal)
 {
-    if (pool == NULL || pool->qhead == NULL) /* if the pool is not init, or the queue is empty, return NULL */
-        return NULL;
-    work_t *temp = pool->qhead;      /* store the head */
-    pool->qhead = pool->qhead->next; /* move the head down */
-    if (pool->qhead == NULL)         /* if the head is NULL, then the tail also need to be NULL */
-        pool->qtail = NULL;
-    return temp;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head == deque->tail)
+    {
+        pthread_mutex_unlock(&deque->lock);
+        return false;
+    }
+    work_t *slot = steal ? &deque->jobs[--deque->tail & deque->mask] : &deque->jobs[deque->head++ & deque->mask];
+    job->routine = slot->routine;
+    job->arg = slot->arg;
+    job->queued = slot->queued;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+/* Push to the caller's own deque when it is a worker, otherwise round robin */
+static bool steal_enqueue(threadpool *pool, dispatch_fn routine, void *arg)
+{
+    int count = pool->num_threads > 0 ? pool->num_threads : 1;
+    int first = (self_pool == pool && self_id >= 0) ? self_id : (int)(atomic_fetch_add(&pool->next_deque, 1) % count);
+    for (int i = 0; i < count; i++) /* fall over to the next deque when the target is full */
+    {
+        if (deque_push(&pool->deques[(first + i) % count], routine, arg) == true)
+            return true;
+    }
+    return false;
+}
+
+/* Pop from the worker's own deque, then try to steal from the others */
+static bool steal_dequeue(threadpool *pool, int id, work_t *job)
+{
+    int count = pool->num_threads;
+    if (deque_pop(&pool->deques[id], job, false) == true)
+        return true;
+    for (int i = 1; i < count; i++)
+    {
+        if (deque_pop(&pool->deques[(id + i) % count], job, true) == true)
+            return true;
+    }
+    return false;
+}
+
+int dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg)
+{
+    if (from_me == NULL || dispatch_to_here == NULL)
+        return ERROR;
+    atomic_fetch_add(&from_me->producers, 1);
+    bool queued = false;
+    if (atomic_load(&from_me->dont_accept) == 0)
+        queued = from_me->mode == POOL_WORK_STEALING ? steal_enqueue(from_me, dispatch_to_here, arg) : enqueue(from_me, dispatch_to_here, arg);
+    if (queued == false)
+    {
+        atomic_fetch_sub(&from_me->producers, 1);
+        return ERROR;
+    }
+    int waiting = atomic_fetch_add(&from_me->qsize, 1);
+    sem_post(&from_me->q_not_empty);
+    if ((waiting > 0 || from_me->num_threads == 0) && from_me->num_threads < from_me->max_threads) /* The queue went that long without a take */
+        grow(from_me, now_ns() - atomic_load_explicit(&from_me->last_take, memory_order_relaxed));
+    atomic_fetch_sub(&from_me->producers, 1);
+    return 0;
+}
+
+long job_wait()
+{
+    return self_wait;
 }
 
 void *do_work(void *p)
 {
     threadpool *pool = (threadpool *)p;
-    work_t *worker = NULL;
+    work_t job;
+    self_pool = pool;
+    self_id = atomic_fetch_add(&pool->started, 1);
     while (true)
     {
-        pthread_mutex_lock(&(pool->qlock));
-        if (pool->shutdown == 1)
-        {
-            pthread_mutex_unlock(&(pool->qlock));
+        if (wait_for_job(pool) == false) /* Idle for too long above the minimum, retired */
             return NULL;
-        }
-        if (pool->qsize == 0 && pool->dont_accept == 0 && pool->shutdown == 0)
+        while ((pool->mode == POOL_WORK_STEALING ? steal_dequeue(pool, self_id, &job) : dequeue(pool, &job)) == false)
         {
-            pthread_cond_wait(&(pool->q_not_empty), &(pool->qlock));
+            if (atomic_load(&pool->shutdown) == 1) /* shutdown with nothing left to run */
+                return NULL;
+            sched_yield(); /* keep the token and retry, a job for it is queued or being published */
         }
-
-        if (pool->shutdown == 1)
-        {
-            pthread_mutex_unlock(&(pool->qlock));
-            return NULL;
-        }
-
-        worker = dequeue(pool);
-        if (worker != NULL)
-        {
-            (worker->routine)(worker->arg);
-            pool->qsize--;
-            free(worker);
-        }
-
-        if (worker != NULL && pool->qsize == 0 && pool->dont_accept == 1)
-        {
-            pthread_mutex_unlock(&(pool->qlock));
-            pthread_cond_signal(&(pool->q_empty));
-            return NULL;
-        }
-        pthread_mutex_unlock(&(pool->qlock));
+        atomic_fetch_sub(&pool->qsize, 1);
+        atomic_fetch_sub(&pool->idle, 1);
+        long now = now_ns();
+        self_wait = now - job.queued;
+        atomic_store_explicit(&pool->last_take, now, memory_order_relaxed);
+        if (self_wait > pool->target_wait && atomic_load(&pool->qsize) > 0) /* Late, and more are waiting */
+            grow(pool, self_wait);
+        (job.routine)(job.arg);
+        self_wait = 0;
+        atomic_fetch_add(&pool->idle, 1);
     }
     return NULL;
 }
 
+void threadpool_stats(threadpool *pool, pool_stats_t *st)
+{
+    st->threads = pool->num_threads;
+    st->idle = atomic_load(&pool->idle);
+    st->min_threads = pool->min_threads;
+    st->max_threads = pool->max_threads;
+    st->queued = atomic_load(&pool->qsize);
+    st->grown = atomic_load(&pool->grown);
+    st->retired = atomic_load(&pool->retired);
+}
+
 void destroy_threadpool(threadpool *destroyme) // Debug and test with valgring
 {
     void *do_nothing;
     if (destroyme == NULL)
         return;
-    pthread_mutex_lock(&(destroyme->qlock));
-    destroyme->dont_accept = 1;  /* rise up the dont accept flag */
-    while (destroyme->qsize > 0) /* wait for work queue to get empty */
-        pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
-    destroyme->shutdown = 1;
-    pthread_cond_broadcast(&(destroyme->q_not_empty)); /* wake up all worker threads */
-    pthread_mutex_unlock(&(destroyme->qlock));
+    atomic_store(&destroyme->dont_accept, 1); /* rise up the dont accept flag */
+    while (atomic_load(&destroyme->producers) > 0) /* let in flight dispatch calls publish their job */
+        sched_yield();
+    pthread_mutex_lock(&destroyme->resize_lock); /* no worker is added or retires from now on */
+    atomic_store(&destroyme->shutdown, 1);
+    pthread_mutex_unlock(&destroyme->resize_lock);
+    for (int i = 0; i < destroyme->num_threads; i++) /* one extra wakeup per worker, they drain the ring and exit */
+        sem_post(&destroyme->q_not_empty);
 
-    for (int i = 0; i < destroyme->num_threads; i++) /* Join all worker thread */
+    for (int i = 0; i < destroyme->max_threads; i++) /* Join all worker thread */
     {
-        pthread_join(destroyme->threads[i], &do_nothing);
+        if (destroyme->running[i] == 1)
+            pthread_join(destroyme->threads[i], &do_nothing);
     }
 
     if (destroyme->threads)
         free(destroyme->threads);
+    free(destroyme->running);
 
-    pthread_mutex_destroy(&(destroyme->qlock));
-    pthread_cond_destroy(&(destroyme->q_empty));
-    pthread_cond_destroy(&(destroyme->q_not_empty));
+    sem_destroy(&destroyme->q_not_empty);
+    pthread_mutex_destroy(&destroyme->resize_lock);
+    destroy_deques(destroyme);
+    free(destroyme->queue);
     free(destroyme);
-}
\ No newline at end of file
+}
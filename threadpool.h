@@ -1,6 +1,8 @@
 #if !defined(THREADPOOL_H)
 #define THREADPOOL_H
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -23,31 +25,82 @@
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
 
+// queue capacity used when create_threadpool gets a non positive one
+#define DEFAULT_QUEUE_SIZE 1024
+
+// nanoseconds a job may wait in an adaptive pool before a worker is added
+#define DEFAULT_TARGET_WAIT 5000000L
+
+// milliseconds an extra worker of an adaptive pool waits for a job before it retires
+#define DEFAULT_IDLE_TIMEOUT 10000
+
 /**
- * the pool holds a queue of this structure
+ * the pool holds a ring of this structure, preallocated at creation.
+ * seq is the slot sequence number of the bounded MPMC queue: a slot is
+ * free for the producer at position pos when seq == pos, and holds a job
+ * for the consumer at position pos when seq == pos + 1.
  */
 typedef struct work_st
 {
 	int (*routine)(void *); //the threads process function
 	void *arg;				//argument to the function
-	struct work_st *next;
+	long queued;			//monotonic nanoseconds when it was dispatched
+	atomic_size_t seq;		//slot sequence number
 } work_t;
 
+/**
+ * scheduling modes of a pool, see create_threadpool_mode
+ */
+typedef enum
+{
+	POOL_GLOBAL_QUEUE,	//one shared lock-free ring for all the workers
+	POOL_WORK_STEALING	//a deque per worker, idle workers steal from the others
+} pool_mode;
+
+/**
+ * per worker deque used by POOL_WORK_STEALING. the owner pops from the
+ * head (oldest job first), thieves steal from the tail.
+ */
+typedef struct deque_st
+{
+	pthread_mutex_t lock; //lock on this deque only
+	work_t *jobs;		  //ring of jobs
+	size_t mask;		  //ring size - 1
+	size_t head;		  //next position to pop from
+	size_t tail;		  //next position to push to
+} deque_t;
+
 /**
  * The actual pool
  */
 typedef struct _threadpool_st
 {
-	int num_threads;			//number of active threads
-	int qsize;					//number in the queue
-	pthread_t *threads;			//pointer to threads
-	work_t *qhead;				//queue head pointer
-	work_t *qtail;				//queue tail pointer
-	pthread_mutex_t qlock;		//lock on the queue list
-	pthread_cond_t q_not_empty; //non empty and empty condidtion vairiables
-	pthread_cond_t q_empty;
-	int shutdown;	//1 if the pool is in distruction process
-	int dont_accept; //1 if destroy function has begun
+	pool_mode mode;			 //scheduling mode
+	atomic_int num_threads;	 //number of active threads
+	int min_threads;		 //an adaptive pool never retires below this
+	int max_threads;		 //nor grows beyond this, both equal num_threads for a fixed pool
+	long target_wait;		 //nanoseconds a job may wait before a worker is added
+	int idle_timeout;		 //milliseconds an extra worker waits for a job before it retires
+	atomic_int qsize;		 //number in the queue
+	atomic_int idle;		 //workers waiting for a job, new ones included
+	atomic_long last_take;	 //monotonic nanoseconds when a worker last took a job
+	atomic_long grown;		 //workers added because jobs waited too long
+	atomic_long retired;	 //workers retired after idle_timeout without a job
+	pthread_mutex_t resize_lock; //guards threads, running and the thread count changes
+	pthread_t *threads;		 //pointer to threads, max_threads of them
+	unsigned char *running;	 //running[i] is 1 while threads[i] is a live worker
+	work_t *queue;			 //the ring of jobs
+	size_t capacity;		 //ring size, a power of two
+	size_t mask;			 //capacity - 1
+	atomic_size_t qhead;	 //next position to dequeue from
+	atomic_size_t qtail;	 //next position to enqueue to
+	deque_t *deques;		 //per worker deques (POOL_WORK_STEALING only)
+	atomic_uint next_deque;	 //round robin target for outside dispatch
+	atomic_int started;		 //workers that picked their index
+	sem_t q_not_empty;		 //counts jobs (and shutdown wakeups) for idle workers
+	atomic_int producers;	 //dispatch calls currently in flight
+	atomic_int shutdown;	 //1 if the pool is in distruction process
+	atomic_int dont_accept; //1 if destroy function has begun
 } threadpool;
 
 // "dispatch_fn" declares a typed function pointer.  A
@@ -58,43 +111,101 @@ typedef struct _threadpool_st
 
 typedef int (*dispatch_fn)(void *);
 
+/**
+ * a snapshot of the size of a pool, see threadpool_stats
+ */
+typedef struct pool_stats_st
+{
+	int threads;	 //workers now
+	int idle;		 //workers waiting for a job
+	int min_threads; //bounds of the pool
+	int max_threads;
+	int queued;		 //jobs waiting for a worker
+	long grown;		 //workers added on load
+	long retired;	 //workers retired when idle
+} pool_stats_t;
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
  * "threadpool", else it returns NULL.
+ * queue_capacity bounds the number of waiting jobs, it is rounded up to a
+ * power of two (DEFAULT_QUEUE_SIZE when it is not positive).
  * this function should:
  * 1. input sanity check 
- * 2. initialize the threadpool structure
- * 3. initialized mutex and conditional variables
+ * 2. initialize the threadpool structure and preallocate the ring
+ * 3. initialized the semaphore
  * 4. create the threads, the thread init function is do_work and its argument is the initialized threadpool. 
  */
-threadpool *create_threadpool(int num_threads_in_pool);
+threadpool *create_threadpool(int num_threads_in_pool, int queue_capacity);
+
+/**
+ * create_threadpool_mode is create_threadpool with a choice of scheduler.
+ * POOL_GLOBAL_QUEUE is what create_threadpool builds. POOL_WORK_STEALING
+ * splits queue_capacity between one deque per worker: dispatch from
+ * outside the pool spreads jobs round robin, dispatch from a worker goes
+ * to its own deque, and a worker whose deque is empty steals from the
+ * others. jobs are then no longer started in global FIFO order.
+ */
+threadpool *create_threadpool_mode(int num_threads_in_pool, int queue_capacity, pool_mode mode);
+
+/**
+ * create_threadpool_adaptive creates a pool (POOL_GLOBAL_QUEUE) that
+ * starts with min_threads workers and sizes itself between min_threads
+ * and max_threads. when no worker is idle and the oldest job waited
+ * longer than target_wait nanoseconds, seen by dispatch from how long
+ * the queue went without a take or by the worker that takes a late job,
+ * one worker is added. a worker above min_threads that gets no job for
+ * idle_timeout milliseconds retires. the resizes are counted, see
+ * threadpool_stats. with min_threads == max_threads it is a fixed pool.
+ */
+threadpool *create_threadpool_adaptive(int min_threads, int max_threads, int queue_capacity, long target_wait, int idle_timeout);
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
  * when an available thread takes a job from the queue, it will
  * call the function "dispatch_to_here" with argument "arg".
  * this function should:
- * 1. create and init work_t element
- * 2. lock the mutex
- * 3. add the work_t element to the queue
- * 4. unlock mutex
+ * 1. claim a free slot in the ring (no lock, no allocation)
+ * 2. fill it and publish it through the slot sequence number
+ * 3. wake up one idle worker
  *
+ * returns 0 when the job was queued, or ERROR (-1) when the ring is full
+ * or the pool is being destroyed. the job is not run in that case and
+ * the caller still owns "arg", so it can shed the load (answer 503).
+ *
+ * concurrency guarantee: jobs are started in FIFO order, but up to
+ * num_threads jobs run at the same time and may finish in any order.
+ * the routine is called without any pool lock held, so it must be
+ * thread safe and must not assume exclusive access to shared state.
+ * jobs dispatched after destroy_threadpool has begun are rejected.
+ */
+int dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * job_wait returns how long the job the calling worker runs waited in
+ * the queue, in nanoseconds. 0 when called outside a job.
  */
-void dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg);
+long job_wait();
 
 /**
  * The work function of the thread
  * this function should:
- * 1. lock mutex
- * 2. if the queue is empty, wait
- * 3. take the first element from the queue (work_t)
- * 4. unlock mutex
- * 5. call the thread routine
+ * 1. wait on the semaphore for a job
+ * 2. take the first element from the ring (work_t)
+ * 3. release the slot back to the producers
+ * 4. call the thread routine
+ * 5. if the ring is empty and shutdown is set, exit
  *
  */
 void *do_work(void *p);
 
+/**
+ * threadpool_stats fills st with the current size of the pool and its
+ * resize counters. the fields are read one by one, without a lock.
+ */
+void threadpool_stats(threadpool *pool, pool_stats_t *st);
+
 /**
  * destroy_threadpool kills the threadpool, causing
  * all threads in it to commit suicide, and then
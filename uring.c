@@ -0,0 +1,757 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "uring.h"
+#include "stats.h"
+
+typedef enum
+{
+    false,
+    true
+} bool;
+#define ERROR -1
+#define SUCCESS 0
+#define LOOP_TIMEOUT 500 /* ms between checks of the stop flag */
+#define PROBE_OPS 256
+
+/* user_data of the requests that are not a connection recv, a conn_t * is never this small */
+#define ACCEPT_TAG 1
+#define TIMER_TAG 2
+#define CANCEL_TAG 3
+#define WAKE_TAG 4
+
+/**
+ * one ring: the io_uring instance, its thread and the connections with
+ * a recv or an operation of the handler in flight. pending is ordered by
+ * activity like in the reactor. lock guards the submission queue, the
+ * list and handled against the handlers. only the ring thread enters the
+ * kernel: the completion work of a request runs on the task that
+ * submitted it, a worker that submitted would be interrupted for it.
+ * uring_resume and the operations queue their entry and wake the ring
+ * through wakefd, a read of it is always in flight.
+ */
+typedef struct ring_st
+{
+    uring *owner;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int fd;
+    int accepting;  /* 1 while an accept is in flight */
+    int cancelling; /* 1 while a cancel of that accept is in flight */
+    int timing;     /* 1 while the loop timer is in flight */
+    int closed;     /* 1 once the ring stopped taking connections back */
+    int waking;     /* 1 while the read of wakefd is in flight */
+    int deferred;   /* 1 when the completion work waits for the ring thread, see map_ring */
+    int handled;    /* Connections the handler owns, given back with uring_resume or uring_close */
+    int wakefd;
+    uint64_t wakeValue;
+    conn_t *pending;
+    conn_t *tail;
+    struct __kernel_timespec timeout;
+    void *rings;     /* The shared submission and completion rings */
+    size_t ringsSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqArray;
+    unsigned sqMask, sqEntries, sqLocal; /* sqLocal: tail with the entries not published yet */
+    unsigned *cqHead, *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+} ring_t;
+
+static int ring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+/* Seconds on the monotonic clock */
+static time_t now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* The features the engine relies on: one mmap for both rings, no lost completions */
+static bool has_features(struct io_uring_params *params)
+{
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP;
+    return (params->features & needed) == needed;
+}
+
+/* Every opcode the engine submits is known to this kernel */
+static bool has_ops(int fd)
+{
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL, IORING_OP_READ,
+                              IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_SENDMSG, IORING_OP_SPLICE};
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op));
+    bool ok = probe != NULL && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == SUCCESS;
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+int uring_supported()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = ring_setup(8, &params); /* ENOSYS on old kernels, EPERM when disabled by sysctl */
+    if (fd == ERROR)
+        return false;
+    bool ok = has_features(&params) && has_ops(fd);
+    close(fd);
+    return ok;
+}
+
+/* Create the io_uring of a ring and map its queues. Where the kernel has it (6.1)
+ * the ring has a single issuer and runs the completion work only when that thread
+ * waits, it starts disabled and the ring thread enables it to become the issuer */
+static int map_ring(ring_t *ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = 4 * RING_ENTRIES; /* A recv per connection can be in flight at once */
+    ring->deferred = 1;
+    if ((ring->fd = ring_setup(RING_ENTRIES, &params)) == ERROR && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = 4 * RING_ENTRIES;
+        ring->deferred = 0;
+        ring->fd = ring_setup(RING_ENTRIES, &params);
+    }
+    if (ring->fd == ERROR)
+        return ERROR;
+    if (has_features(&params) == false || (ring->wakefd = eventfd(0, EFD_CLOEXEC)) == ERROR)
+    {
+        close(ring->fd);
+        ring->fd = ERROR;
+        return ERROR;
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->rings != MAP_FAILED)
+            munmap(ring->rings, ring->ringsSize);
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqesSize);
+        close(ring->wakefd);
+        close(ring->fd);
+        ring->fd = ERROR;
+        return ERROR;
+    }
+    char *base = (char *)ring->rings;
+    ring->sqHead = (unsigned *)(base + params.sq_off.head);
+    ring->sqTail = (unsigned *)(base + params.sq_off.tail);
+    ring->sqArray = (unsigned *)(base + params.sq_off.array);
+    ring->sqMask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocal = *ring->sqTail;
+    ring->cqHead = (unsigned *)(base + params.cq_off.head);
+    ring->cqTail = (unsigned *)(base + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    for (unsigned i = 0; i < ring->sqEntries; i++) /* Entry i always sits in slot i */
+        ring->sqArray[i] = i;
+    return SUCCESS;
+}
+
+static void unmap_ring(ring_t *ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->rings, ring->ringsSize);
+    close(ring->wakefd);
+    close(ring->fd);
+    ring->fd = ERROR;
+}
+
+/* A free submission entry, lock held. The ring thread hands a full queue to the kernel first */
+static struct io_uring_sqe *get_sqe(ring_t *ring, unsigned long tag)
+{
+    if (ring->sqLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+    {
+        if (pthread_equal(pthread_self(), ring->thread) == 0)
+            return NULL;
+        ring_enter(ring->fd, ring->sqEntries, 0, 0); /* Everything queued, no wait */
+        if (ring->sqLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocal & ring->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = tag;
+    return sqe;
+}
+
+/* Publish the entry taken last, the next io_uring_enter submits it */
+static void push_sqe(ring_t *ring)
+{
+    ring->sqLocal++;
+    __atomic_store_n(ring->sqTail, ring->sqLocal, __ATOMIC_RELEASE);
+}
+
+/* Queue a recv into the free end of the connection buffer, lock held.
+ * idle: nothing is expected to be waiting, wait for data instead of trying a read first */
+static int arm_recv(ring_t *ring, conn_t *conn, bool idle)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, (uintptr_t)conn);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->buf + conn->len);
+    sqe->len = CONN_BUFF - conn->len;
+    if (idle && ring->deferred) /* The flag (5.19) is older than the deferred rings (6.1) */
+        sqe->ioprio = IORING_RECVSEND_POLL_FIRST;
+    push_sqe(ring);
+    return SUCCESS;
+}
+
+/* Queue an accept on the listening socket, lock held */
+static void arm_accept(ring_t *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, ACCEPT_TAG);
+    if (sqe == NULL)
+        return; /* Tried again on the next turn */
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->owner->listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    push_sqe(ring);
+    ring->accepting = 1;
+}
+
+/* Queue the timer that wakes the loop to check the stop flag and the idle connections, lock held */
+static void arm_timer(ring_t *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, TIMER_TAG);
+    if (sqe == NULL)
+        return;
+    ring->timeout.tv_sec = LOOP_TIMEOUT / 1000;
+    ring->timeout.tv_nsec = (LOOP_TIMEOUT % 1000) * 1000000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = ERROR;
+    sqe->addr = (uintptr_t)&ring->timeout;
+    sqe->len = 1;
+    push_sqe(ring);
+    ring->timing = 1;
+}
+
+/* Queue the read of wakefd, it completes when uring_resume queued work, lock held */
+static void arm_wake(ring_t *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, WAKE_TAG);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->wakefd;
+    sqe->addr = (uintptr_t)&ring->wakeValue;
+    sqe->len = sizeof(ring->wakeValue);
+    push_sqe(ring);
+    ring->waking = 1;
+}
+
+/* Queue a cancel of the accept in flight, lock held */
+static void cancel_accept(ring_t *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, CANCEL_TAG);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = ERROR;
+    sqe->addr = ACCEPT_TAG;
+    push_sqe(ring);
+    ring->cancelling = 1;
+}
+
+/* Put a connection at the head of the pending list, lock held */
+static void link_head(ring_t *ring, conn_t *conn)
+{
+    conn->ring = ring;
+    conn->prev = NULL;
+    conn->next = ring->pending;
+    if (ring->pending)
+        ring->pending->prev = conn;
+    else
+        ring->tail = conn;
+    ring->pending = conn;
+}
+
+/* Take a connection out of the pending list, lock held */
+static void unlink_conn(ring_t *ring, conn_t *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        ring->pending = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    else
+        ring->tail = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+/* Close a connection whose recv completed, nothing refers to it anymore */
+static void drop(ring_t *ring, conn_t *conn)
+{
+    pthread_mutex_lock(&ring->lock);
+    unlink_conn(ring, conn);
+    pthread_mutex_unlock(&ring->lock);
+    close(conn->fd);
+    conn_free(conn);
+}
+
+/* Read on. When the first bytes of a request arrived (started) its headers are due idle_timeout
+ * from now, to the head of the list. Later reads of the same request keep that deadline */
+static void touch(ring_t *ring, conn_t *conn, bool started)
+{
+    pthread_mutex_lock(&ring->lock);
+    if (started)
+    {
+        unlink_conn(ring, conn);
+        link_head(ring, conn);
+        conn->last_active = now_sec();
+    }
+    bool armed = arm_recv(ring, conn, true) == SUCCESS;
+    pthread_mutex_unlock(&ring->lock);
+    if (armed == false)
+        drop(ring, conn);
+}
+
+/* Wake the recv of the connections idle for too long, and of idle keep-alives when draining.
+ * The recv completes empty and the connection is dropped there, its buffer is never freed under the kernel */
+static void expire(ring_t *ring, int stop)
+{
+    uring *u = ring->owner;
+    time_t now = now_sec();
+    pthread_mutex_lock(&ring->lock);
+    for (conn_t *conn = ring->tail; u->idle_timeout > 0 && conn != NULL && now - conn->last_active >= u->idle_timeout; conn = conn->prev)
+        shutdown(conn->fd, SHUT_RDWR);
+    for (conn_t *conn = ring->pending; stop != 0 && conn != NULL; conn = conn->next)
+    {
+        if (stop == 2 || (conn->len == 0 && conn->served > 0)) /* Dropped, or between requests, a new one still gets its first */
+            shutdown(conn->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Hand a connection the handler owns to the pool, or run it here */
+static void handle(uring *u, conn_t *conn)
+{
+    if (conn->admitted == 0) /* Over the admission cap, turned away here without queueing */
+    {
+        if (u->overload != NULL)
+            u->overload(conn);
+        else
+            uring_close(conn);
+        return;
+    }
+    if (u->pool == NULL)
+    {
+        u->handler(conn);
+        return;
+    }
+    if (dispatch(u->pool, u->handler, conn) == ERROR)
+        u->overload(conn);
+}
+
+/* A connection with a complete request goes to the handler */
+static void ready(ring_t *ring, conn_t *conn)
+{
+    pthread_mutex_lock(&ring->lock);
+    unlink_conn(ring, conn);
+    ring->handled++;
+    pthread_mutex_unlock(&ring->lock);
+    handle(ring->owner, conn);
+}
+
+/* An operation of the handler completed, the connection is the handler's again */
+static void operated(ring_t *ring, conn_t *conn, int res)
+{
+    pthread_mutex_lock(&ring->lock);
+    unlink_conn(ring, conn);
+    conn->operating = 0;
+    pthread_mutex_unlock(&ring->lock);
+    ring->owner->complete(conn, res);
+}
+
+/* A recv completed with res bytes, or -errno */
+static void received(ring_t *ring, conn_t *conn, int res)
+{
+    if (res > 0)
+    {
+        bool started = conn->len == 0; /* Otherwise part of the request is in, its deadline runs already */
+        conn->len += res;
+        conn->buf[conn->len] = '\0';
+        long start = stats_now();
+        http_parse_status status = http_parse(&conn->request, conn->buf, conn->len);
+        conn->request.elapsed += stats_now() - start;
+        if (status != HTTP_PARSE_AGAIN || conn->len == CONN_BUFF) /* Complete, malformed or full */
+            ready(ring, conn);
+        else
+            touch(ring, conn, started);
+        return;
+    }
+    if (res == -EINTR || res == -EAGAIN)
+    {
+        pthread_mutex_lock(&ring->lock);
+        bool armed = arm_recv(ring, conn, false) == SUCCESS;
+        pthread_mutex_unlock(&ring->lock);
+        if (armed)
+            return;
+    }
+    drop(ring, conn); /* Peer closed, expired or read failed */
+}
+
+/* An accept completed with the new socket, or -errno */
+static void accepted(ring_t *ring, int res)
+{
+    uring *u = ring->owner;
+    ring->accepting = 0;
+    if (res < 0)
+    {
+        if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN && res != -ECANCELED)
+        {
+            errno = -res;
+            perror("accept");
+        }
+        return;
+    }
+    if (atomic_load(&u->stop) == 2) /* When draining it is served, it was accepted already */
+    {
+        close(res);
+        return;
+    }
+    conn_t *conn = conn_alloc(res);
+    if (conn == NULL)
+    {
+        close(res);
+        return;
+    }
+    pthread_mutex_lock(&ring->lock);
+    link_head(ring, conn);
+    if (arm_recv(ring, conn, false) == ERROR)
+    {
+        unlink_conn(ring, conn);
+        close(conn->fd);
+        conn_free(conn);
+    }
+    else if (atomic_load(&u->stop) == 0)
+        arm_accept(ring); /* The next one goes in with the same io_uring_enter */
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Run every completion the kernel posted */
+static void reap(ring_t *ring)
+{
+    unsigned head = *ring->cqHead;
+    while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+        unsigned long tag = cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE); /* The slot is free, the values are copied */
+        if (tag == ACCEPT_TAG)
+            accepted(ring, res);
+        else if (tag == TIMER_TAG)
+            ring->timing = 0;
+        else if (tag == CANCEL_TAG)
+            ring->cancelling = 0;
+        else if (tag == WAKE_TAG)
+            ring->waking = 0;
+        else if (((conn_t *)(uintptr_t)tag)->operating)
+            operated(ring, (conn_t *)(uintptr_t)tag, res);
+        else
+            received(ring, (conn_t *)(uintptr_t)tag, res);
+    }
+}
+
+/* The ring thread: queue what has to be re-armed, submit it and wait in one call, run the completions */
+static void *ring_loop(void *p)
+{
+    ring_t *ring = (ring_t *)p;
+    uring *u = ring->owner;
+    if (ring->deferred && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) == ERROR)
+    {
+        perror("io_uring_register");
+        atomic_store(&u->stop, 2); /* Nothing was submitted, nothing to drain */
+        return NULL;
+    }
+    while (true)
+    {
+        int stop = atomic_load(&u->stop);
+        expire(ring, stop);
+        pthread_mutex_lock(&ring->lock);
+        if (stop != 0 && ring->pending == NULL && ring->accepting == 0 && ring->handled == 0) /* Drained, refuse resumed connections from now on */
+        {
+            ring->closed = 1;
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+        if (stop != 0 && ring->accepting == 1 && ring->cancelling == 0)
+            cancel_accept(ring);
+        if (stop == 0 && ring->accepting == 0)
+            arm_accept(ring);
+        if (ring->timing == 0)
+            arm_timer(ring);
+        if (ring->waking == 0)
+            arm_wake(ring);
+        unsigned queued = ring->sqLocal - *ring->sqHead; /* Exactly: the kernel does not wait when it submits fewer */
+        pthread_mutex_unlock(&ring->lock);
+        if (ring_enter(ring->fd, queued, 1, IORING_ENTER_GETEVENTS) == ERROR && errno != EINTR && errno != EBUSY)
+        {
+            perror("io_uring_enter");
+            pthread_mutex_lock(&ring->lock);
+            ring->closed = 1;
+            for (conn_t *conn = ring->pending; conn != NULL; conn = conn->next) /* The kernel may still write into their buffers, leave them */
+                shutdown(conn->fd, SHUT_RDWR);
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+        reap(ring);
+    }
+    return NULL;
+}
+
+/* Let the ring thread submit what another thread queued, with its next wait */
+static void wake(ring_t *ring)
+{
+    uint64_t one = 1;
+    if (pthread_equal(pthread_self(), ring->thread) == 0 && write(ring->wakefd, &one, sizeof(one)) == ERROR)
+        perror("write");
+}
+
+/* An entry for an operation of a connection the handler owns, with the ring locked. NULL unlocked when there is none */
+static struct io_uring_sqe *op_sqe(conn_t *conn)
+{
+    ring_t *ring = conn->ring;
+    pthread_mutex_lock(&ring->lock);
+    struct io_uring_sqe *sqe = ring->closed == 1 ? NULL : get_sqe(ring, (uintptr_t)conn);
+    if (sqe == NULL)
+        pthread_mutex_unlock(&ring->lock);
+    return sqe;
+}
+
+/* Submit the entry of op_sqe. The connection waits in the list like for a recv, the idle timeout runs from now */
+static int op_push(conn_t *conn)
+{
+    ring_t *ring = conn->ring;
+    push_sqe(ring);
+    conn->operating = 1;
+    conn->last_active = now_sec();
+    link_head(ring, conn);
+    pthread_mutex_unlock(&ring->lock);
+    wake(ring);
+    return SUCCESS;
+}
+
+int uring_openat(conn_t *conn, int dirfd, const char *path, int flags)
+{
+    struct io_uring_sqe *sqe = op_sqe(conn);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)path;
+    sqe->open_flags = flags;
+    return op_push(conn);
+}
+
+int uring_statx(conn_t *conn, int dirfd, const char *path, int flags, struct statx *stx)
+{
+    struct io_uring_sqe *sqe = op_sqe(conn);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)path;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uintptr_t)stx; /* addr2 */
+    sqe->statx_flags = flags;
+    return op_push(conn);
+}
+
+int uring_sendmsg(conn_t *conn, struct msghdr *msg, int flags)
+{
+    struct io_uring_sqe *sqe = op_sqe(conn);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags | MSG_NOSIGNAL;
+    return op_push(conn);
+}
+
+int uring_splice(conn_t *conn, int in, long offset, int out, unsigned len, unsigned flags)
+{
+    struct io_uring_sqe *sqe = op_sqe(conn);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = in;
+    sqe->splice_off_in = (uint64_t)offset; /* -1 reads a pipe from its head */
+    sqe->fd = out;
+    sqe->off = (uint64_t)-1;
+    sqe->len = len;
+    sqe->splice_flags = flags;
+    return op_push(conn);
+}
+
+void uring_run(conn_t *conn, dispatch_fn fn)
+{
+    threadpool *pool = conn->ring->owner->pool;
+    if (pool == NULL || dispatch(pool, fn, conn) == ERROR)
+        fn(conn);
+}
+
+void uring_ready(conn_t *conn)
+{
+    handle(conn->ring->owner, conn);
+}
+
+void uring_close(conn_t *conn)
+{
+    ring_t *ring = conn->ring;
+    pthread_mutex_lock(&ring->lock);
+    ring->handled--;
+    pthread_mutex_unlock(&ring->lock);
+    close(conn->fd);
+    conn_free(conn);
+}
+
+void uring_resume(conn_t *conn)
+{
+    ring_t *ring = conn->ring;
+    pthread_mutex_lock(&ring->lock);
+    ring->handled--;
+    if (ring->closed == 1 || atomic_load(&ring->owner->stop) != 0) /* Stopping, do not keep idle connections */
+    {
+        pthread_mutex_unlock(&ring->lock);
+        close(conn->fd);
+        conn_free(conn);
+        return;
+    }
+    conn->last_active = now_sec();
+    link_head(ring, conn);
+    if (arm_recv(ring, conn, conn->len == 0) == ERROR)
+    {
+        unlink_conn(ring, conn);
+        pthread_mutex_unlock(&ring->lock);
+        close(conn->fd);
+        conn_free(conn);
+        return;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    wake(ring);
+}
+
+uring *create_uring(int listenfd, int num_rings, threadpool *pool, dispatch_fn handler, dispatch_fn overload, uring_complete_fn complete, int idle_timeout)
+{
+    if (num_rings <= 0 || num_rings > MAX_RINGS || handler == NULL || complete == NULL || (pool != NULL && overload == NULL))
+        return NULL;
+    if (uring_supported() == false)
+        return NULL;
+    uring *u = (uring *)malloc(sizeof(uring));
+    if (u == NULL)
+    {
+        fprintf(stderr, "malloc failed at create uring <uring>");
+        return NULL;
+    }
+    u->listenfd = listenfd;
+    u->num_rings = 0;
+    u->pool = pool;
+    u->handler = handler;
+    u->overload = overload;
+    u->complete = complete;
+    u->idle_timeout = idle_timeout;
+    atomic_init(&u->stop, 0);
+    u->rings = (ring_t *)calloc(num_rings, sizeof(ring_t));
+    if (u->rings == NULL)
+    {
+        fprintf(stderr, "malloc failed at create uring <rings>");
+        free(u);
+        return NULL;
+    }
+    for (int i = 0; i < num_rings; i++)
+    {
+        ring_t *ring = &u->rings[i];
+        ring->owner = u;
+        pthread_mutex_init(&ring->lock, NULL);
+        if (map_ring(ring) == ERROR)
+        {
+            perror("io_uring_setup");
+            pthread_mutex_destroy(&ring->lock);
+            break;
+        }
+        if (pthread_create(&ring->thread, NULL, ring_loop, ring))
+        {
+            fprintf(stderr, "failed to init ring");
+            unmap_ring(ring);
+            pthread_mutex_destroy(&ring->lock);
+            break;
+        }
+        u->num_rings++;
+    }
+    if (u->num_rings != num_rings)
+    {
+        destroy_uring(u);
+        return NULL;
+    }
+    return u;
+}
+
+void uring_stop(uring *u)
+{
+    int running = 0;
+    atomic_compare_exchange_strong(&u->stop, &running, 1); /* The rings see it within LOOP_TIMEOUT */
+}
+
+void uring_wait(uring *u)
+{
+    if (u == NULL)
+        return;
+    for (int i = 0; i < u->num_rings; i++)
+    {
+        if (u->rings[i].fd != ERROR)
+        {
+            pthread_join(u->rings[i].thread, NULL);
+            unmap_ring(&u->rings[i]);
+        }
+    }
+}
+
+void destroy_uring(uring *u)
+{
+    if (u == NULL)
+        return;
+    atomic_store(&u->stop, 2);
+    uring_wait(u);
+    for (int i = 0; i < u->num_rings; i++)
+        pthread_mutex_destroy(&u->rings[i].lock);
+    free(u->rings);
+    free(u);
+}
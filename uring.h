@@ -0,0 +1,134 @@
+#if !defined(URING_H)
+#define URING_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include "threadpool.h"
+#include "reactor.h"
+
+/**
+ * uring.h
+ *
+ * Completion driven connection engine over io_uring, the alternative to
+ * the epoll reactor. Every ring is a thread that keeps an accept on the
+ * shared listening socket and a recv on each of its connections in the
+ * submission queue; whatever the handlers gave back and whatever has to
+ * be re-armed goes to the kernel in the same io_uring_enter that waits
+ * for the next completions, so a loop turn is one system call however
+ * many connections it served. Complete requests go to the threadpool
+ * (or run inline) as with the reactor, and the handler answers them with
+ * operations of the ring too: it submits the opens, stats and sends of a
+ * response with uring_openat, uring_statx, uring_sendmsg and
+ * uring_splice, and each completion runs its next step. The rings are
+ * driven with the raw system calls, no liburing needed.
+ */
+
+// maximum number of rings in an engine
+#define MAX_RINGS 64
+
+// submission queue entries of a ring, the completion queue is 4 times larger
+#define RING_ENTRIES 1024
+
+struct statx;
+
+// "uring_complete_fn" gets a connection whose operation completed and
+// its result, the return value of the system call or -errno
+typedef void (*uring_complete_fn)(conn_t *conn, int res);
+
+/**
+ * The io_uring engine
+ */
+typedef struct _uring_st
+{
+	int listenfd;		   //shared listening socket, blocking
+	int num_rings;		   //number of rings
+	struct ring_st *rings; //ring threads
+	threadpool *pool;	   //where ready requests are dispatched, NULL to run inline
+	dispatch_fn handler;   //called with a conn_t * when its headers are complete
+	dispatch_fn overload;  //called with a conn_t * when the pool rejects it or it is over the admission cap
+	uring_complete_fn complete; //called on the ring thread when an operation of the handler completed
+	int idle_timeout;	   //seconds a connection may wait in a ring, 0 for no limit
+	atomic_int stop;	   //1 stop accepting and drain, 2 drop pending connections
+} uring;
+
+/**
+ * uring_supported tells if the kernel has io_uring with every operation
+ * the engine submits. when it does not, the server keeps the threadpool.
+ */
+int uring_supported();
+
+/**
+ * create_uring starts num_rings rings over an already bound and
+ * listening socket. the handlers get the conn_t like the reactor ones
+ * and own it until they give it back with uring_resume or uring_close.
+ * meanwhile they submit its operations, one at a time, and complete gets
+ * each result. a connection waits for its operation in the ring like
+ * for a recv: the idle timeout and the drain apply, and the ring exits
+ * only once the handlers gave back every connection. returns NULL on
+ * failure, or when the kernel lacks io_uring.
+ */
+uring *create_uring(int listenfd, int num_rings, threadpool *pool, dispatch_fn handler, dispatch_fn overload, uring_complete_fn complete, int idle_timeout);
+
+/**
+ * the operations a handler submits for a connection it owns, from any
+ * thread. what the pointers point to must stay valid until complete is
+ * called. they return -1 when the ring is full or stopped, the handler
+ * keeps the connection then.
+ * uring_openat opens path relative to dirfd (openat(2)).
+ * uring_statx stats path relative to dirfd into stx (statx(2)), flags
+ * AT_EMPTY_PATH and an empty path stat dirfd itself.
+ * uring_sendmsg sends msg on the socket (sendmsg(2), MSG_NOSIGNAL added).
+ * uring_splice moves len bytes from in at offset (-1 for a pipe) to out
+ * (splice(2)).
+ */
+int uring_openat(conn_t *conn, int dirfd, const char *path, int flags);
+int uring_statx(conn_t *conn, int dirfd, const char *path, int flags, struct statx *stx);
+int uring_sendmsg(conn_t *conn, struct msghdr *msg, int flags);
+int uring_splice(conn_t *conn, int in, long offset, int out, unsigned len, unsigned flags);
+
+/**
+ * uring_run runs fn(conn) on the threadpool of the engine, or right here
+ * when it has none or its queue is full. for the work a completion leads
+ * to that would hold up the ring thread.
+ */
+void uring_run(conn_t *conn, dispatch_fn fn);
+
+/**
+ * uring_ready hands a connection the handler owns to the handler again,
+ * like a request the ring just read: for the next request already in
+ * its buffer.
+ */
+void uring_ready(conn_t *conn);
+
+/**
+ * uring_resume gives a connection back to its ring, to read the next
+ * request. safe to call from any thread. if the engine is stopping the
+ * connection is closed and freed instead.
+ */
+void uring_resume(conn_t *conn);
+
+/**
+ * uring_close closes and frees a connection the handler owns.
+ */
+void uring_close(conn_t *conn);
+
+/**
+ * uring_stop drains the engine like reactor_stop: the accepts are
+ * cancelled, the listening socket is left open for a successor, and
+ * uring_wait returns once every ring answered what it had read.
+ */
+void uring_stop(uring *u);
+
+/**
+ * uring_wait blocks until the engine was stopped and every ring has
+ * exited. the rings accept for as long as the engine is not stopped.
+ */
+void uring_wait(uring *u);
+
+/**
+ * destroy_uring stops the rings, closes the connections that are still
+ * waiting for their headers and frees the engine.
+ */
+void destroy_uring(uring *u);
+
+#endif
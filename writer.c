@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "writer.h"
+
+#define ERROR -1
+#define SUCCESS 0
+
+ssize_t write_segments(int fd, struct iovec *iov, int count)
+{
+    ssize_t sum = 0;
+    while (count > 0 && iov->iov_len == 0)
+    {
+        iov++;
+        count--;
+    }
+    while (count > 0)
+    {
+        ssize_t bytes = writev(fd, iov, count);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            return ERROR;
+        }
+        sum += bytes;
+        while (count > 0 && (size_t)bytes >= iov->iov_len) /* Skip the segments that went out whole */
+        {
+            bytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) /* Resume inside the segment the socket stopped at */
+        {
+            iov->iov_base = (char *)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+    return sum;
+}
+
+/* Copy the file through a fixed size buffer, used when sendfile is not supported */
+static int copy_file(int fd, int filefd, off_t offset, off_t length)
+{
+    char chunk[WRITER_CHUNK];
+    while (length > 0)
+    {
+        ssize_t bytes = pread(filefd, chunk, length < WRITER_CHUNK ? length : WRITER_CHUNK, offset);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0) /* Error, or the file was truncated under us */
+            return ERROR;
+        struct iovec iov = {chunk, bytes};
+        if (write_segments(fd, &iov, 1) == ERROR)
+            return ERROR;
+        offset += bytes;
+        length -= bytes;
+    }
+    return SUCCESS;
+}
+
+/* Zero-copy send of length bytes of the file from offset */
+static int send_file(int fd, int filefd, off_t offset, off_t length)
+{
+    off_t end = offset + length;
+    while (offset < end)
+    {
+        ssize_t bytes = sendfile(fd, filefd, &offset, end - offset);
+        if (bytes < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS) /* Not supported for this fd pair */
+                return copy_file(fd, filefd, offset, end - offset);
+            perror("sendfile");
+            return ERROR;
+        }
+        if (bytes == 0) /* The file was truncated under us */
+            return ERROR;
+    }
+    return SUCCESS;
+}
+
+/* Hold partial frames while the header and the file are queued, not a TCP socket is fine */
+static void cork(int fd, int on)
+{
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+int write_file(int fd, struct iovec *iov, int count, int filefd, off_t offset, off_t length)
+{
+    int res = SUCCESS;
+    cork(fd, 1);
+    if (write_segments(fd, iov, count) == ERROR)
+        res = ERROR;
+    else if (length > 0)
+        res = send_file(fd, filefd, offset, length);
+    cork(fd, 0); /* Flush the last partial frame */
+    return res;
+}
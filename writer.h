@@ -0,0 +1,33 @@
+#if !defined(WRITER_H)
+#define WRITER_H
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * writer.h
+ *
+ * Response writer. A response is a list of segments (header, body,
+ * trailer) that goes out with as few system calls as possible: one
+ * writev for everything that is in memory, resumed where the socket
+ * stopped after a partial write. A file body is sent with sendfile
+ * behind TCP_CORK, so the header and the first bytes of the file still
+ * leave in full packets.
+ */
+
+// size of the copy buffer when sendfile is not supported
+#define WRITER_CHUNK 65536
+
+/**
+ * write_segments sends count segments in order. the iovec array is
+ * consumed (advanced) while writing. returns the number of bytes sent,
+ * or -1 on error.
+ */
+ssize_t write_segments(int fd, struct iovec *iov, int count);
+
+/**
+ * write_file sends count segments followed by length bytes of filefd
+ * from offset. returns 0 on success, -1 on error.
+ */
+int write_file(int fd, struct iovec *iov, int count, int filefd, off_t offset, off_t length);
+
+#endif